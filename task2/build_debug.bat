@@ -14,6 +14,7 @@ set debugLinkerOptions= /link /ignore:4099 /LIBPATH:../../libraries/debug /INCRE
 IF NOT EXIST "./binaries/x64_debug" mkdir "./binaries/x64_debug"
 pushd "./binaries/x64_debug"
 cl -MDd -Od -DDEBUG %commonCompilerOptions% ..\..\source\main.cpp %debugLinkerOptions% /OUT:rrt_debug.exe
+cl -MDd -Od -DDEBUG %commonCompilerOptions% ..\..\source\main_headless.cpp %debugLinkerOptions% /OUT:rrt_headless_debug.exe
 
 
 echo.
@@ -7,4 +7,5 @@
 mkdir -p ./binaries/linux_debug
 pushd ./binaries/linux_debug
 g++ ./../../source/main.cpp -I./../../external -I./../../external/SDL -std=gnu++11 -Wno-write-strings -Werror -Wswitch -lSDL2 -lGL -lGLEW -o rrt_debug
+g++ ./../../source/main_headless.cpp -I./../../external -I./../../external/SDL -std=gnu++11 -Wno-write-strings -Werror -Wswitch -pthread -lSDL2 -lGL -lGLEW -o rrt_headless_debug
 popd
\ No newline at end of file
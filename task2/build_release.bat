@@ -14,6 +14,7 @@ set releaseLinkerOptions= /link /ignore:4099 /LIBPATH:../../libraries/release /I
 IF NOT EXIST "./binaries/x64_release" mkdir "./binaries/x64_release"
 pushd "./binaries/x64_release"
 cl -MD -Ox -Oi -GS- %commonCompilerOptions% ..\..\source\main.cpp %releaseLinkerOptions% /OUT:rrt_release.exe
+cl -MD -Ox -Oi -GS- %commonCompilerOptions% ..\..\source\main_headless.cpp %releaseLinkerOptions% /OUT:rrt_headless_release.exe
 
 echo.
 echo Copying external libraries...
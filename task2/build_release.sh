@@ -7,4 +7,5 @@
 mkdir -p ./binaries/linux_release
 pushd ./binaries/linux_release
 g++ ./../../source/main.cpp -O3 -I./../../external -I./../../external/SDL -std=gnu++11 -Wno-write-strings -Werror -Wswitch -lSDL2 -lGL -lGLEW -o rrt_release
+g++ ./../../source/main_headless.cpp -O3 -I./../../external -I./../../external/SDL -std=gnu++11 -Wno-write-strings -Werror -Wswitch -pthread -lSDL2 -lGL -lGLEW -o rrt_headless_release
 popd
\ No newline at end of file
@@ -0,0 +1,22 @@
+#include "base.h"
+
+layout(location = 0) out vec4 OUT_Color;
+
+uniform sampler2D IntermediateBuffer;
+uniform sampler2D AccumulationHistory;
+// 1 / number of accumulated frames including this one, the first frame ignores the history.
+uniform float AccumulationWeight;
+
+
+// Running average of the lighting of all frames since the accumulation restarted.
+void main() {
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	vec3 current = texelFetch(IntermediateBuffer, pixel, 0).rgb;
+	if(AccumulationWeight >= 1.0) {
+		// The history isn't cleared on a restart.
+		OUT_Color = vec4(current, 1.0);
+		return;
+	}
+	vec3 history = texelFetch(AccumulationHistory, pixel, 0).rgb;
+	OUT_Color = vec4(mix(history, current, AccumulationWeight), 1.0);
+}
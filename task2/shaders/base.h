@@ -18,13 +18,106 @@
 #define BVH_USE_RANDOM 0
 #define BVH_MAX_TRIANGLES_PER_NODE 1
 #define BVH_MAX_CHILD_NODES 2
+#define BVH_MAX_STACK_SIZE 64
+
+// Store a precomputed affine transform per triangle for a cheaper (but not watertight) intersection test.
+#define BVH_PRECOMPUTE_TRIANGLE_TRANSFORMS 0
+
+// Traverse the BVH with skip links instead of a per-ray stack (fewer registers, but no front to back order).
+#define BVH_STACKLESS_TRAVERSAL 0
 
 // Constants used for raytracing.
 #define RENDERING_MAX_RECURSIONS 8
-#define RENDERING_MAX_SAMPLES 1
-
-// Constants used for temporal anti-aliasing.
+#define RENDERING_MAX_REFRACTIONS 2
+// Most samples adaptive sampling takes per pixel and frame (see GetAdaptiveSampleCount in shaders/lighting.h).
+#define RENDERING_MAX_SAMPLES 4
+// Weight of the history in the running mean and variance of the pixels (see shaders/sample_variance.h) and the
+// largest relative variance a frame adds, which keeps single outliers from taking the samples for many frames.
+#define RENDERING_SAMPLE_VARIANCE_HISTORY 0.9
+#define RENDERING_SAMPLE_VARIANCE_MAX 100.0
+
+// Dynamic resolution (see UpdateDynamicResolution in source/scene_renderer.cpp): the rendering scale only changes when
+// the GPU time is further from the target than the relative tolerance, and by at most the factors of one step.
+#define RENDERING_DYNAMIC_RESOLUTION_TOLERANCE 0.1
+#define RENDERING_DYNAMIC_RESOLUTION_STEP_DOWN 0.75
+#define RENDERING_DYNAMIC_RESOLUTION_STEP_UP 1.1
+
+// Temporal reprojection of the lighting (see shaders/temporal.frag): the history of a pixel is dropped when the
+// reprojected surface differs by more than the relative depth difference or the normals by more than the cosine.
+#define TEMPORAL_DEPTH_TOLERANCE 0.05
+#define TEMPORAL_NORMAL_TOLERANCE 0.9
+
+// Resolution the reflection and refraction rays are traced at (see IsSecondaryRayPixel). The traced pixels are packed
+// into a compact texture and the pixels that skip them are reconstructed by shaders/secondary_upsample.frag.
+#define SECONDARY_RAYS_FULL 0
+#define SECONDARY_RAYS_CHECKERBOARD 1
+#define SECONDARY_RAYS_HALF_RESOLUTION 2
+
+// Edge stopping functions of the a-trous denoiser (see shaders/denoise.frag): distance of a neighbor to the plane of
+// the pixel in pixel footprints, exponent of the normal similarity and luminance difference in standard deviations.
+// The albedo is clamped to the minimum before the lighting is divided by it.
+#define DENOISE_MAX_ITERATIONS 5
+#define DENOISE_PLANE_SIGMA 4.0
+#define DENOISE_NORMAL_POWER 64.0
+#define DENOISE_LUMINANCE_SIGMA 4.0
+#define DENOISE_MIN_ALBEDO 0.01
+
+// Russian roulette of the reflection and refraction loops: bounces that are always traced and the lowest
+// probability a path continues with afterwards, which bounds the weight of the bounces that follow.
+#define RENDERING_ROULETTE_START_BOUNCE 1
+#define RENDERING_ROULETTE_MIN_PROBABILITY 0.5
+
+// First sampler dimensions (see shaders/random.h) of the random numbers of the lighting features. Every reflection
+// and refraction bounce has RANDOM_DIMENSIONS_PER_BOUNCE of them: the russian roulette, the direction and from
+// RANDOM_DIMENSION_BOUNCE_HIT on the light samples at the hit.
+#define RANDOM_DIMENSION_LIGHTS 0
+#define RANDOM_DIMENSION_EMISSIVE 8
+#define RANDOM_DIMENSION_RESTIR_INITIAL 32
+#define RANDOM_DIMENSION_RESTIR_SPATIAL 56
+#define RANDOM_DIMENSION_REFLECTION 64
+#define RANDOM_DIMENSION_REFRACTION 192
+#define RANDOM_DIMENSIONS_PER_BOUNCE 16
+#define RANDOM_DIMENSION_BOUNCE_HIT 4
+// The additional samples of adaptive sampling repeat the layout above with an offset.
+#define RANDOM_DIMENSIONS_PER_SAMPLE 256
+
+// Shadow rays of the first lights start by testing the triangle that occluded the same pixel and light in the
+// previous frame (one RGBA32I texel per pixel, -1 when the light was visible).
+#define RENDERING_SHADOW_CACHE_LIGHTS 4
+
+// Constants used for the wavefront lighting kernels (ray queues are binned by direction octant or material).
+#define WAVEFRONT_GROUP_SIZE 64
+#define WAVEFRONT_BIN_COUNT 64
+#define WAVEFRONT_RAY_REFRACTION 1
+
+// Constants used for the tiled lighting kernels, tiles are classified by the most expensive pixel they contain.
+#define LIGHTING_TILE_SIZE 8
+#define LIGHTING_TILE_CLASS_BACKGROUND 0
+#define LIGHTING_TILE_CLASS_DIFFUSE 1
+#define LIGHTING_TILE_CLASS_GLOSSY 2
+#define LIGHTING_TILE_CLASS_TRANSPARENT 3
+#define LIGHTING_TILE_CLASS_COUNT 4
+
+// Constants used for clustered lighting, screen space tiles times exponential depth slices between the near and far plane.
+#define LIGHT_CLUSTER_TILES_X 16
+#define LIGHT_CLUSTER_TILES_Y 9
+#define LIGHT_CLUSTER_SLICES 24
+
+// Constants used for the light resampling (ReSTIR): light tree candidates per pixel, history length in frames
+// of candidates kept by the temporal reuse, neighbors and radius in pixels of the spatial reuse.
+#define RESTIR_INITIAL_CANDIDATES 8
+#define RESTIR_TEMPORAL_MAX_FRAMES 20
+#define RESTIR_SPATIAL_NEIGHBORS 4
+#define RESTIR_SPATIAL_RADIUS 16.0
+
+// Leaf flag in RendererLightTreeNode::Data, the remaining bits hold the light index of the leaf.
+#define LIGHT_TREE_LEAF 0x80000000u
+
+// Constants used for temporal anti-aliasing: jitter positions per cycle, the weight of the current frame in the
+// resolve and the standard deviations around the neighborhood mean the history is clamped to (see shaders/taa.frag).
 #define RENDERING_TAA_SAMPLE_COUNT 16
+#define RENDERING_TAA_CURRENT_WEIGHT 0.1
+#define RENDERING_TAA_CLAMP_SIGMA 1.25
 
 // Constants used for performance measure.
 #define RENDERING_FRAME_GPU_TIME_COUNT 3
@@ -69,6 +162,38 @@
         return normalize(v);
     }
 
+    // World position of a gbuffer depth at a screen position in [0, 1].
+    vec3 GetWorldPosition(vec2 screenCoord, float depthFromBuffer, mat4 invViewProjection) {
+        vec4 worldPosBeforeW = vec4(screenCoord * 2.0 - 1.0, 2.0 * depthFromBuffer - 1.0, 1.0) * invViewProjection;
+        return worldPosBeforeW.xyz / worldPosBeforeW.w;
+    }
+
+    // Whether a pixel traces the reflection and refraction rays in a reduced resolution mode. The checkerboard
+    // alternates every frame, half resolution traces one pixel of every 2x2 quad and cycles through them.
+    bool IsSecondaryRayPixel(int mode, ivec2 pixel, uint frame) {
+        if(mode == SECONDARY_RAYS_CHECKERBOARD) {
+            return ((pixel.x + pixel.y + int(frame & 1u)) & 1) == 0;
+        }
+        if(mode == SECONDARY_RAYS_HALF_RESOLUTION) {
+            return all(equal(pixel & 1, ivec2(frame & 1u, (frame >> 1) & 1u)));
+        }
+        return true;
+    }
+
+    // Texel of the compact secondary lighting of a traced pixel, the checkerboard halves the width and half resolution
+    // both dimensions.
+    ivec2 GetSecondaryRayTexel(int mode, ivec2 pixel) {
+        return mode == SECONDARY_RAYS_CHECKERBOARD ? ivec2(pixel.x >> 1, pixel.y) : pixel >> 1;
+    }
+
+    // Pixel traced by a texel of the compact secondary lighting.
+    ivec2 GetSecondaryRayPixel(int mode, ivec2 texel, uint frame) {
+        if(mode == SECONDARY_RAYS_CHECKERBOARD) {
+            return ivec2(texel.x * 2 + ((texel.y + int(frame & 1u)) & 1), texel.y);
+        }
+        return texel * 2 + ivec2(frame & 1u, (frame >> 1) & 1u);
+    }
+
     // This texture array contains all textures in our scene.
     uniform sampler2DArray MaterialTextures;
     vec4 SampleMaterialTexture(int textureIndex, vec2 texCoords) {
@@ -187,6 +312,69 @@ struct RendererLight {
     float AngleScale;
     float AngleOffset;
     float Radius;
+    float Padding0;
+};
+
+// Light hierarchy node as stored in the light tree texture buffer (four RGBA32UI texels).
+// Bounds, power, cone and range cover all lights below the node.
+struct RendererLightTreeNode {
+    vec3 AABBMin;
+    float Power;
+
+    vec3 AABBMax;
+    // Inner node: index of the second child (the first one directly follows its parent).
+    // Leaf: light index with LIGHT_TREE_LEAF set.
+    uint Data;
+
+    // Directions the lights emit into, a cosine of -1 is the full sphere.
+    vec3 ConeAxis;
+    float ConeCosAngle;
+
+    float Range;
+    float Padding0;
+    float Padding1;
+    float Padding2;
+};
+
+// Emissive triangle as stored in the alias table the area lights are sampled from (two RGBA32UI texels).
+struct RendererEmissiveTriangle {
+    uint A;
+    uint B;
+    uint C;
+    uint MaterialIndex;
+
+    // Probability to keep this entry of the alias table instead of taking the one at Alias.
+    float AliasProbability;
+    uint Alias;
+    // Probability the triangle is sampled with (its share of the emitted power) and its area.
+    float Probability;
+    float Area;
+};
+
+// Flattened BVH node as stored in the node texture buffer (two RGBA32UI texels).
+struct RendererBVHNode {
+    vec3 AABBMin;
+    // Inner node: index of the second child (the first one directly follows its parent).
+    // Leaf: first triangle in the lower 24 bits and triangle count in the upper 8 bits.
+    uint Data;
+
+    vec3 AABBMax;
+    // Skip index in the upper 30 bits and split axis in the lower 2 bits, an axis of 3 marks a leaf.
+    uint Links;
+};
+
+// World space vertex as stored in the vertex texture buffer (one RGBA32UI texel).
+struct RendererVertex {
+    vec3 Position;
+    uint TexCoord;
+};
+
+// Leaf triangle as stored in the triangle texture buffer (one RGBA32UI texel), indexing into the vertex buffer.
+struct RendererTriangle {
+    uint A;
+    uint B;
+    uint C;
+    uint MaterialIndex;
 };
 
 // All information needed to shade a surface point.
@@ -198,6 +386,42 @@ struct SurfacePoint {
     float Roughness;
 };
 
+// Reflection or refraction ray in the wavefront ray queues, Direction is normalized and the traced segment is 40 units long.
+struct RendererWavefrontRay {
+    vec3 Origin;
+    uint PixelIndex;
+
+    vec3 Direction;
+    // WAVEFRONT_RAY_REFRACTION in the lowest bit, bounce index in the bits above.
+    uint Flags;
+
+    vec2 HitBarycentrics;
+    float HitT;
+    int HitTriangle;
+
+    uint Padding0;
+    uint Bin;
+    // Path throughput and russian roulette weight of the bounce, see ContinuesPath in lighting.h.
+    float Throughput;
+    float Weight;
+};
+
+// Counters of the wavefront ray queues, also holds the indirect dispatch size of the sorted queue.
+struct RendererWavefrontCounters {
+    uint EmittedRayCount;
+    uint SortedRayCount;
+    uint DispatchSize[3];
+    uint BinCounts[WAVEFRONT_BIN_COUNT];
+    uint BinOffsets[WAVEFRONT_BIN_COUNT];
+};
+
+// Indirect dispatch size of the tiles of one class, the classification counts the tiles in GroupCountX.
+struct RendererTileDispatch {
+    uint GroupCountX;
+    uint GroupCountY;
+    uint GroupCountZ;
+};
+
 #ifdef __cplusplus
     // Undef our defines from above so that we don't overwrite something by mistake that we need.
     #undef sampler2D
@@ -213,30 +437,28 @@ struct SurfacePoint {
     // Light count to loop over all lights in the scene for lighting.
     uniform int LightCount;
 
-    // Decode the structure from the raw texture buffer.
+    // Decode the structure from the raw texture buffer, every light is four RGBA32UI texels.
     // On more modern hardware (OGL 4.2+) we could use shader storage buffers which 
     // have a nicer interface but are functionaly similar.
     RendererLight GetLight(int lightIndex) {
-        int structOffset = lightIndex * 15;
+        int structOffset = lightIndex * 4;
         RendererLight light;
-        light.Position.x = uintBitsToFloat(texelFetch(LightBuffer, structOffset).r); ++structOffset;
-        light.Position.y = uintBitsToFloat(texelFetch(LightBuffer, structOffset).r); ++structOffset;
-        light.Position.z = uintBitsToFloat(texelFetch(LightBuffer, structOffset).r); ++structOffset;
-        light.Range      = uintBitsToFloat(texelFetch(LightBuffer, structOffset).r); ++structOffset;
-
-        light.Direction.x = uintBitsToFloat(texelFetch(LightBuffer, structOffset).r); ++structOffset;
-        light.Direction.y = uintBitsToFloat(texelFetch(LightBuffer, structOffset).r); ++structOffset;
-        light.Direction.z = uintBitsToFloat(texelFetch(LightBuffer, structOffset).r); ++structOffset;
-        light.Type        = texelFetch(LightBuffer, structOffset).r; ++structOffset;
-
-        light.Color.x   = uintBitsToFloat(texelFetch(LightBuffer, structOffset).r); ++structOffset;
-        light.Color.y   = uintBitsToFloat(texelFetch(LightBuffer, structOffset).r); ++structOffset;
-        light.Color.z   = uintBitsToFloat(texelFetch(LightBuffer, structOffset).r); ++structOffset;
-        light.Intensity = uintBitsToFloat(texelFetch(LightBuffer, structOffset).r); ++structOffset;
-
-        light.AngleScale  = uintBitsToFloat(texelFetch(LightBuffer, structOffset).r); ++structOffset;
-        light.AngleOffset = uintBitsToFloat(texelFetch(LightBuffer, structOffset).r); ++structOffset;
-        light.Radius      = uintBitsToFloat(texelFetch(LightBuffer, structOffset).r); ++structOffset;
+        uvec4 data = texelFetch(LightBuffer, structOffset);
+        light.Position = uintBitsToFloat(data.xyz);
+        light.Range    = uintBitsToFloat(data.w);
+
+        data = texelFetch(LightBuffer, structOffset + 1);
+        light.Direction = uintBitsToFloat(data.xyz);
+        light.Type      = data.w;
+
+        data = texelFetch(LightBuffer, structOffset + 2);
+        light.Color     = uintBitsToFloat(data.xyz);
+        light.Intensity = uintBitsToFloat(data.w);
+
+        data = texelFetch(LightBuffer, structOffset + 3);
+        light.AngleScale  = uintBitsToFloat(data.x);
+        light.AngleOffset = uintBitsToFloat(data.y);
+        light.Radius      = uintBitsToFloat(data.z);
 
         return light;
     }
@@ -0,0 +1,102 @@
+#include "base.h"
+
+layout(location = 0) out vec4 OUT_Color;
+
+layout(location = 0) in vec2 INOUT_TextureCoords;
+
+// Lighting of the frame in the first iteration, afterwards the illumination and its variance of the previous one.
+uniform sampler2D IntermediateBuffer;
+uniform sampler2D GBufferDepth;
+uniform sampler2D GBufferNormal;
+uniform sampler2D GBufferAlbedoTransparency;
+uniform mat4 CameraInvViewProjection;
+uniform vec3 CameraPosition;
+// Distance in pixels between the taps of the 5x5 kernel, it doubles every iteration.
+uniform int DenoiseStepSize;
+uniform int DenoiseFirstIteration;
+uniform int DenoiseLastIteration;
+// 1 when the lighting comes from the temporal reprojection and holds the history length in alpha.
+uniform int DenoiseTemporalHistory;
+uniform ivec2 RenderingSize;
+
+#include "sample_variance.h"
+
+
+vec3 GetDenoiseAlbedo(ivec2 pixel) {
+	return max(texelFetch(GBufferAlbedoTransparency, pixel, 0).rgb, vec3(DENOISE_MIN_ALBEDO));
+}
+
+// Illumination with the albedo divided out, so that the filter keeps the texture detail, and its luminance variance.
+// The first iteration derives the variance from the running per sample variance and the frames averaged into it.
+vec4 LoadIllumination(ivec2 pixel) {
+	vec4 value = texelFetch(IntermediateBuffer, pixel, 0);
+	if(DenoiseFirstIteration == 0) {
+		return value;
+	}
+
+	vec3 albedo = GetDenoiseAlbedo(pixel);
+	vec2 meanVariance = texelFetch(SampleVariance, pixel, 0).rg;
+	float historyLength = DenoiseTemporalHistory != 0 ? max(value.a, 1.0) : 1.0;
+	float albedoLuminance = GetLuminance(albedo);
+	float variance = meanVariance.g * meanVariance.r * meanVariance.r / (historyLength * albedoLuminance * albedoLuminance);
+	return vec4(value.rgb / albedo, variance);
+}
+
+vec3 GetDenoisePosition(ivec2 pixel, float depthFromBuffer) {
+	return GetWorldPosition((vec2(pixel) + 0.5) / vec2(RenderingSize), depthFromBuffer, CameraInvViewProjection);
+}
+
+// One iteration of the edge-aware a-trous wavelet filter (Dammertz et al. 2010, with the variance guidance of
+// Schied et al. 2017: "Spatiotemporal Variance-Guided Filtering"). The taps are weighted by the B3 spline kernel and
+// by how well their surface and illumination match the pixel, the variance is filtered along with the squared weights.
+void main() {
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	float depthFromBuffer = texelFetch(GBufferDepth, pixel, 0).r;
+	if(depthFromBuffer >= 1.0) {
+		// The background is neither demodulated nor filtered.
+		OUT_Color = vec4(texelFetch(IntermediateBuffer, pixel, 0).rgb, 0.0);
+		return;
+	}
+
+	ivec2 size = RenderingSize;
+	vec4 center = LoadIllumination(pixel);
+	vec3 position = GetDenoisePosition(pixel, depthFromBuffer);
+	vec3 normal = decodeNormal(texelFetch(GBufferNormal, pixel, 0).rg);
+	float luminance = GetLuminance(center.rgb);
+	float planeSigma = DENOISE_PLANE_SIGMA * distance(position, CameraPosition) * float(DenoiseStepSize) / float(size.y);
+	float luminanceSigma = DENOISE_LUMINANCE_SIGMA * sqrt(max(center.a, 0.0)) + 0.0001;
+
+	const float kernel[3] = float[3](3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0);
+	float weightSum = kernel[0] * kernel[0];
+	vec3 illumination = center.rgb * weightSum;
+	float variance = center.a * weightSum * weightSum;
+	for(int y = -2; y <= 2; ++y) {
+		for(int x = -2; x <= 2; ++x) {
+			ivec2 samplePixel = pixel + ivec2(x, y) * DenoiseStepSize;
+			if((x == 0 && y == 0) || any(lessThan(samplePixel, ivec2(0))) || any(greaterThanEqual(samplePixel, size))) {
+				continue;
+			}
+			float sampleDepth = texelFetch(GBufferDepth, samplePixel, 0).r;
+			if(sampleDepth >= 1.0) {
+				continue;
+			}
+
+			vec4 value = LoadIllumination(samplePixel);
+			vec3 sampleNormal = decodeNormal(texelFetch(GBufferNormal, samplePixel, 0).rg);
+			float planeDistance = abs(dot(normal, GetDenoisePosition(samplePixel, sampleDepth) - position));
+			float weight = kernel[abs(x)] * kernel[abs(y)] * pow(max(dot(normal, sampleNormal), 0.0), DENOISE_NORMAL_POWER) *
+						   exp(-planeDistance / planeSigma - abs(GetLuminance(value.rgb) - luminance) / luminanceSigma);
+			illumination += value.rgb * weight;
+			variance += value.a * weight * weight;
+			weightSum += weight;
+		}
+	}
+
+	illumination /= weightSum;
+	variance /= weightSum * weightSum;
+	if(DenoiseLastIteration != 0) {
+		OUT_Color = vec4(illumination * GetDenoiseAlbedo(pixel), 1.0);
+	} else {
+		OUT_Color = vec4(illumination, variance);
+	}
+}
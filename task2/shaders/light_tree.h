@@ -0,0 +1,92 @@
+// Light hierarchy over the point and spot lights, four RGBA32UI texels per node (see RendererLightTreeNode).
+// The LightTreeDirectionalCount directional light leaves follow the LightTreeNodeCount tree nodes.
+uniform usamplerBuffer LightTreeBuffer;
+uniform int LightTreeNodeCount;
+uniform int LightTreeDirectionalCount;
+
+// Lights sampled from the tree per shaded point, 0 shades every light of the cluster instead.
+uniform int LightSampleCount;
+
+RendererLightTreeNode GetLightTreeNode(int nodeIndex) {
+	uvec4 texel0 = texelFetch(LightTreeBuffer, nodeIndex * 4);
+	uvec4 texel1 = texelFetch(LightTreeBuffer, nodeIndex * 4 + 1);
+	uvec4 texel2 = texelFetch(LightTreeBuffer, nodeIndex * 4 + 2);
+	uvec4 texel3 = texelFetch(LightTreeBuffer, nodeIndex * 4 + 3);
+
+	RendererLightTreeNode node;
+	node.AABBMin = uintBitsToFloat(texel0.xyz);
+	node.Power = uintBitsToFloat(texel0.w);
+	node.AABBMax = uintBitsToFloat(texel1.xyz);
+	node.Data = texel1.w;
+	node.ConeAxis = uintBitsToFloat(texel2.xyz);
+	node.ConeCosAngle = uintBitsToFloat(texel2.w);
+	node.Range = uintBitsToFloat(texel3.x);
+	return node;
+}
+
+int GetDirectionalLightIndex(int i) {
+	return int(GetLightTreeNode(LightTreeNodeCount + i).Data & ~LIGHT_TREE_LEAF);
+}
+
+// Estimate of the light a node contributes to a position, power over squared distance limited by the
+// emission cone. It is conservative: only zero if none of the lights below the node can reach the position.
+float GetLightTreeImportance(RendererLightTreeNode node, vec3 position) {
+	vec3 closestOffset = clamp(position, node.AABBMin, node.AABBMax) - position;
+	if(dot(closestOffset, closestOffset) >= node.Range * node.Range) {
+		return 0.0;
+	}
+
+	vec3 center = (node.AABBMin + node.AABBMax) * 0.5;
+	float radiusSq = dot(node.AABBMax - center, node.AABBMax - center);
+	vec3 toPosition = position - center;
+	float distanceSq = dot(toPosition, toPosition);
+
+	if(node.ConeCosAngle > -1.0 && distanceSq > radiusSq) {
+		// Angle between the cone and the position minus the cone angle and the angle the bounds subtend.
+		float theta = acos(clamp(dot(node.ConeAxis, toPosition * inversesqrt(distanceSq)), -1.0, 1.0));
+		float thetaBounds = asin(sqrt(radiusSq / distanceSq));
+		if(theta - acos(node.ConeCosAngle) - thetaBounds > 0.001) {
+			return 0.0;
+		}
+	}
+	return node.Power / max(max(distanceSq, radiusSq), 0.0001);
+}
+
+// Walks down the tree choosing the children proportional to their importance. Returns the light index and the
+// probability it was chosen with, or -1 when no light can reach the position.
+int SampleLightTree(vec3 position, inout Sampler rng, out float pdf) {
+	pdf = 1.0;
+	if(LightTreeNodeCount == 0) {
+		return -1;
+	}
+
+	float u = SampleFloat(rng);
+	int nodeIndex = 0;
+	RendererLightTreeNode node = GetLightTreeNode(0);
+	while((node.Data & LIGHT_TREE_LEAF) == 0u) {
+		int firstIndex = nodeIndex + 1;
+		int secondIndex = int(node.Data);
+		RendererLightTreeNode first = GetLightTreeNode(firstIndex);
+		RendererLightTreeNode second = GetLightTreeNode(secondIndex);
+		float firstImportance = GetLightTreeImportance(first, position);
+		float secondImportance = GetLightTreeImportance(second, position);
+		if(firstImportance + secondImportance <= 0.0) {
+			return -1;
+		}
+
+		// Reuse the random number for the next level by rescaling it to the chosen interval.
+		float firstProbability = firstImportance / (firstImportance + secondImportance);
+		if(u < firstProbability) {
+			u = min(u / firstProbability, 0.99999994);
+			pdf *= firstProbability;
+			nodeIndex = firstIndex;
+			node = first;
+		} else {
+			u = min((u - firstProbability) / (1.0 - firstProbability), 0.99999994);
+			pdf *= 1.0 - firstProbability;
+			nodeIndex = secondIndex;
+			node = second;
+		}
+	}
+	return int(node.Data & ~LIGHT_TREE_LEAF);
+}
@@ -4,15 +4,52 @@ uniform sampler2D GBufferAlbedoTransparency;
 uniform sampler2D GBufferMetallnessRoughness;
 uniform sampler2D GBufferMotion;
 
+// Occluding triangle per pixel and light of the previous frame, see RENDERING_SHADOW_CACHE_LIGHTS.
+uniform isampler2D ShadowOccluderCache;
+// Set while the camera, the lights and the BVH did not change since the cache was traced,
+// the cached occluders then decide the visibility without casting any shadow ray.
+uniform bool ReuseShadowVisibility;
+
 uniform uint FrameCount;
 
 uniform vec3 CameraPosition;
 uniform mat4 CameraInvViewProjection;
 
+// Offset and count of the light indices of every cluster followed by the indices, see source/light_clusters.cpp.
+uniform usamplerBuffer LightClusterBuffer;
+uniform mat4 LightClusterViewProjection;
+// Maps log(view depth) to the depth slice.
+uniform vec2 LightClusterDepthScaleBias;
+
+// Resampled light per pixel (see shaders/restir.h), used by ShadePointDirect instead of the light list if set.
+uniform sampler2D LightReservoirs;
+uniform bool UseLightReservoirs;
+
+// Reflection and refraction paths end once their throughput falls below the cutoff, 0 keeps them to the last bounce.
+uniform float PathThroughputCutoff;
+
+// Points sampled on the emissive triangles per shaded point, 0 disables the emissive lighting.
+uniform int EmissiveSampleCount;
+
+// Adaptive sampling spends additional samples on the pixels whose relative error (standard deviation over mean, see
+// shaders/sample_variance.h) is above the threshold, the budget are the additional samples per pixel of a frame on average.
+uniform bool UseAdaptiveSampling;
+uniform float AdaptiveSamplingBudget;
+// Share of the SampleVariance texels the rendering covers, the others are cleared and lower the mean of the top mip.
+uniform float AdaptiveSamplingCoverage;
+
+// SECONDARY_RAYS_* mode, with a reduced resolution the lighting passes leave out the reflections and refractions and
+// they are only traced for the pixels of the pattern (see IsSecondaryRayPixel in shaders/base.h).
+uniform int SecondaryRayMode;
+
+// Sample of the pixel that is shaded, the additional samples of adaptive sampling use their own sampler dimensions.
+uint PixelSample = 0u;
+
 const vec3 dielectricSpecular = vec3(0.04, 0.04, 0.04);
 const vec3 black = vec3(0, 0, 0);
 const vec3 AmbientLight = vec3(0.4, 0.4, 0.25) * 10.0;
 const float SurfaceOffset = 0.01;
+const float RefractionOffset = 0.002;
 
 struct ShadingResult {
 	vec3 Diffuse;
@@ -81,16 +118,223 @@ float GetLightAttenuationAndLightVec(vec3 position, inout RendererLight light, o
     return attenuation;
 }
 
-ShadingResult ShadePointSimple(SurfacePoint point) 
+vec3 GetDiffuseColor(SurfacePoint point) {
+	return mix(point.Albedo.rgb * (1.0 - dielectricSpecular.r), black, point.Metalness);
+}
+
+// Reflection and shadow rays start slightly above the surface, refraction rays slightly below.
+vec3 GetReflectionOrigin(SurfacePoint point) {
+	return point.Position + point.Normal * SurfaceOffset;
+}
+
+vec3 GetRefractionOrigin(SurfacePoint point) {
+	return point.Position - point.Normal * RefractionOffset;
+}
+
+bool ContinuesReflection(SurfacePoint point) {
+	return point.Roughness < 0.5 || point.Metalness > 0.5;
+}
+
+bool ContinuesRefraction(SurfacePoint point) {
+	return point.Albedo.a > 0.0 && point.Albedo.a < 1.0;
+}
+
+// The frames are the samples of the sequence, see shaders/random.h.
+Sampler GetPixelSampler(ivec2 pixel, uint dimension) {
+	return CreateSampler(pixel, FrameCount, dimension + PixelSample * uint(RANDOM_DIMENSIONS_PER_SAMPLE));
+}
+
+// Samples to shade the pixel with, between 1 and RENDERING_MAX_SAMPLES.
+int GetAdaptiveSampleCount(ivec2 pixel) {
+	if(!UseAdaptiveSampling) {
+		return 1;
+	}
+
+	// Samples needed to get the relative error below the threshold, the mean over the screen comes from the top mip
+	// level. When all pixels together would exceed the budget their samples are scaled down evenly.
+	float wanted = texelFetch(SampleVariance, pixel, 0).b;
+	float meanWanted = textureLod(SampleVariance, vec2(0.5), 16.0).b / AdaptiveSamplingCoverage;
+	float additional = wanted * min(1.0, AdaptiveSamplingBudget / max(meanWanted, 0.000001));
+
+	// Dithered rounding keeps the fractional samples on average.
+	float dither = InterleavedGradientNoise(vec2(pixel) + 5.588238 * float(FrameCount % 64u));
+	return 1 + int(clamp(floor(additional + dither), 0.0, float(RENDERING_MAX_SAMPLES - 1)));
+}
+
+// Sampler of a reflection or refraction bounce, its light samples at the hit use GetBounceHitSampler.
+Sampler GetBounceSampler(ivec2 pixel, bool refraction, int bounce) {
+	uint dimension = uint(refraction ? RANDOM_DIMENSION_REFRACTION : RANDOM_DIMENSION_REFLECTION);
+	return GetPixelSampler(pixel, dimension + uint(bounce * RANDOM_DIMENSIONS_PER_BOUNCE));
+}
+
+Sampler GetBounceHitSampler(ivec2 pixel, bool refraction, int bounce) {
+	Sampler rng = GetBounceSampler(pixel, refraction, bounce);
+	rng.Dimension += uint(RANDOM_DIMENSION_BOUNCE_HIT);
+	return rng;
+}
+
+vec3 GetReflectionDirection(SurfacePoint point, vec3 viewDirection, inout Sampler rng) {
+	vec3 reflectionVec = normalize(reflect(-viewDirection, point.Normal));
+	return normalize(mix(reflectionVec, randomHemisphereDirection(reflectionVec, rng), point.Roughness));
+}
+
+// Share of the light a surface passes on along a reflection or refraction path.
+float GetReflectance(SurfacePoint point) {
+	vec3 specularColor = mix(dielectricSpecular, point.Albedo.rgb, point.Metalness);
+	return max(max(specularColor.r, specularColor.g), specularColor.b);
+}
+
+float GetTransmittance(SurfacePoint point) {
+	return 1.0 - point.Albedo.a;
+}
+
+// Russian roulette before a bounce off a surface that passes on the given share of the light. The throughput of the
+// path is the product of these shares. After the first bounces a path only continues with a probability following
+// the share, and the bounces after it are weighted by the inverse, so the expected result stays the same.
+bool ContinuesPath(int bounce, float share, inout float throughput, inout float weight, inout Sampler rng) {
+	float u = SampleFloat(rng);
+	throughput *= share;
+	if(throughput < PathThroughputCutoff) {
+		return false;
+	}
+	if(bounce < RENDERING_ROULETTE_START_BOUNCE) {
+		return true;
+	}
+	float probability = clamp(share, RENDERING_ROULETTE_MIN_PROBABILITY, 1.0);
+	if(u >= probability) {
+		return false;
+	}
+	weight /= probability;
+	return true;
+}
+
+vec3 GetRefractionDirection(SurfacePoint point, vec3 viewDirection) {
+	return normalize(refract(-viewDirection, point.Normal, 0.9f));
+}
+
+// Reconstructs the surface seen by a pixel from the gbuffer. screenCoord is in [0, 1], texCoord is the
+// matching gbuffer coordinate (scaled by RenderingScale).
+void GetGBufferSurfacePoint(vec2 screenCoord, vec2 texCoord, out SurfacePoint point) {
+	float depthFromBuffer = 2.0 * textureLod(GBufferDepth, texCoord, 0).r - 1.0;
+	vec2 normalXY = textureLod(GBufferNormal, texCoord, 0).rg;
+	vec4 albedoTransparency = textureLod(GBufferAlbedoTransparency, texCoord, 0);
+	vec2 metalnessRoughness = textureLod(GBufferMetallnessRoughness, texCoord, 0).rg;
+
+	vec4 projectedPosition = vec4(screenCoord * 2.0 - 1.0, depthFromBuffer, 1.0);
+	vec4 worldPosBeforeW = projectedPosition * CameraInvViewProjection;
+
+	point.Position = worldPosBeforeW.xyz / worldPosBeforeW.w;
+	point.Normal = decodeNormal(normalXY);
+	point.Albedo = albedoTransparency;
+	point.Metalness = metalnessRoughness.r;
+	point.Roughness = metalnessRoughness.g;
+}
+
+// Lights shaded at a position. Either the range of light indices of its cluster (all lights if it is outside of
+// the clustered frustum), or with LightSampleCount the directional lights followed by lights sampled from the light tree,
+// or the directional lights followed by the resampled light of the pixel.
+struct LightList {
+	int Offset;
+	int Count;
+	bool Clustered;
+	bool Sampled;
+	Sampler Rng;
+	// Only the list of the pixel itself takes the resampled light, the lists at reflection and refraction hits do not.
+	bool UsesReservoir;
+	int ReservoirLight;
+	float ReservoirWeight;
+};
+
+// rng is only used for the lights sampled from the light tree.
+LightList GetLightList(vec3 position, Sampler rng) {
+	LightList list;
+	list.Offset = 0;
+	list.Count = LightCount;
+	list.Clustered = false;
+	list.Sampled = false;
+	list.Rng = rng;
+	list.UsesReservoir = false;
+	list.ReservoirLight = -1;
+	list.ReservoirWeight = 0.0;
+
+	if(LightSampleCount > 0) {
+		list.Count = LightTreeDirectionalCount + LightSampleCount;
+		list.Sampled = true;
+		return list;
+	}
+
+	vec4 clipPos = vec4(position, 1.0) * LightClusterViewProjection;
+	if(clipPos.w <= 0.0) {
+		return list;
+	}
+	ivec2 tile = ivec2(floor((clipPos.xy / clipPos.w * 0.5 + 0.5) * vec2(LIGHT_CLUSTER_TILES_X, LIGHT_CLUSTER_TILES_Y)));
+	int slice = int(floor(log(clipPos.w) * LightClusterDepthScaleBias.x + LightClusterDepthScaleBias.y));
+	if(any(lessThan(ivec3(tile, slice), ivec3(0))) || any(greaterThanEqual(ivec3(tile, slice), ivec3(LIGHT_CLUSTER_TILES_X, LIGHT_CLUSTER_TILES_Y, LIGHT_CLUSTER_SLICES)))) {
+		return list;
+	}
+
+	int cluster = (slice * LIGHT_CLUSTER_TILES_Y + tile.y) * LIGHT_CLUSTER_TILES_X + tile.x;
+	list.Offset = int(texelFetch(LightClusterBuffer, cluster * 2).r);
+	list.Count = int(texelFetch(LightClusterBuffer, cluster * 2 + 1).r);
+	list.Clustered = true;
+	return list;
+}
+
+LightList GetPixelLightList(vec3 position, ivec2 pixel) {
+	LightList list = GetLightList(position, GetPixelSampler(pixel, uint(RANDOM_DIMENSION_LIGHTS)));
+	if(UseLightReservoirs) {
+		vec4 reservoir = texelFetch(LightReservoirs, pixel, 0);
+		list.Count = LightTreeDirectionalCount + 1;
+		list.Clustered = false;
+		list.Sampled = true;
+		list.UsesReservoir = true;
+		list.ReservoirLight = int(reservoir.x);
+		list.ReservoirWeight = reservoir.y;
+	}
+	return list;
+}
+
+// Returns the light index, or -1 if no light was sampled. The contribution of the light has to be scaled by weight.
+int GetLightListIndex(inout LightList list, int i, vec3 position, out float weight) {
+	weight = 1.0;
+	if(list.Sampled) {
+		if(i < LightTreeDirectionalCount) {
+			return GetDirectionalLightIndex(i);
+		}
+		if(list.UsesReservoir) {
+			weight = list.ReservoirWeight;
+			return list.ReservoirLight;
+		}
+		float pdf;
+		int lightIndex = SampleLightTree(position, list.Rng, pdf);
+		weight = 1.0 / (pdf * float(LightSampleCount));
+		return lightIndex;
+	}
+	return list.Clustered ? int(texelFetch(LightClusterBuffer, list.Offset + i).r) : i;
+}
+
+// Sampled lights change every frame, so their shadow rays can't use the occluder cache.
+bool IsSampledLight(LightList list, int i) {
+	return list.Sampled && i >= LightTreeDirectionalCount;
+}
+
+ShadingResult ShadePointSimple(SurfacePoint point, Sampler rng) 
 {
-    vec3 surfacePos = point.Position + point.Normal * SurfaceOffset;
-    vec3 diffuseColor = mix(point.Albedo.rgb * (1.0 - dielectricSpecular.r), black, point.Metalness);
+    vec3 surfacePos = GetReflectionOrigin(point);
+    vec3 diffuseColor = GetDiffuseColor(point);
 
     ShadingResult result;
     result.Diffuse = vec3(0, 0, 0);
     result.Specular = vec3(0, 0, 0);
-    for(int i = 0; i < LightCount; ++i) {
-    	RendererLight light = GetLight(i);
+    LightList lights = GetLightList(point.Position, rng);
+    for(int i = 0; i < lights.Count; ++i) {
+    	float weight;
+    	int lightIndex = GetLightListIndex(lights, i, point.Position, weight);
+    	if(lightIndex < 0) {
+    		continue;
+    	}
+    	RendererLight light = GetLight(lightIndex);
+    	light.Intensity *= weight;
     	vec3 lightVec;
     	float attenuation = GetLightAttenuationAndLightVec(point.Position, light, lightVec);
     	if(attenuation > 0.0) {
@@ -107,12 +351,22 @@ ShadingResult ShadePointSimple(SurfacePoint point)
     return result;
 }
 
-ShadingResult ShadePoint(SurfacePoint point, vec3 viewDirection) 
+bool IsLightOccluded(int lightIndex, vec3 lightPosition, vec3 surfacePos, inout ivec4 shadowOccluders) {
+	if(lightIndex < RENDERING_SHADOW_CACHE_LIGHTS) {
+		if(ReuseShadowVisibility) {
+			return shadowOccluders[lightIndex] >= 0;
+		}
+		return CastVisRayCached(lightPosition, surfacePos, shadowOccluders[lightIndex]);
+	}
+	return CastVisRay(lightPosition, surfacePos);
+}
+
+// Adds the diffuse and specular lighting of one light, the diffuse part is only added if the light is visible.
+void AddLight(SurfacePoint point, vec3 viewDirection, RendererLight light, vec3 lightVec, float attenuation, bool visible, inout ShadingResult result)
 {
-    vec3 surfacePos = point.Position + point.Normal * SurfaceOffset;
     float alphaRoughness = point.Roughness * point.Roughness;
 
-    vec3 diffuseColor = mix(point.Albedo.rgb * (1.0 - dielectricSpecular.r), black, point.Metalness);
+    vec3 diffuseColor = GetDiffuseColor(point);
     vec3 specularColor = mix(dielectricSpecular, point.Albedo.rgb, point.Metalness);
 
 	float reflectance = max(max(specularColor.r, specularColor.g), specularColor.b);
@@ -120,82 +374,200 @@ ShadingResult ShadePoint(SurfacePoint point, vec3 viewDirection)
 	vec3 specularEnvironmentR0 = specularColor.rgb;
 	vec3 specularEnvironmentR90 = vec3(1.0, 1.0, 1.0) * reflectance90;
 
-	float seed = surfacePos.x + surfacePos.y * 3.43121412313 + surfacePos.z * 5.1231491 + float(FrameCount) * 0.177421;
+	if(visible) {
+		float NdotL = clamp(dot(point.Normal, lightVec), 0.001, 1.0);
+		result.Diffuse += light.Color * diffuseColor * (NdotL * attenuation * light.Intensity / M_PI);
+	}
+
+    vec3 halfVec = normalize(lightVec + viewDirection);
+
+	float NdotL = clamp(dot(point.Normal, lightVec), 0.001, 1.0);
+	float NdotV = clamp(abs(dot(point.Normal, viewDirection)), 0.001, 1.0);
+	float NdotH = clamp(dot(point.Normal, halfVec), 0.0, 1.0);
+	float LdotH = clamp(dot(lightVec, halfVec), 0.0, 1.0);
+	float VdotH = clamp(dot(viewDirection, halfVec), 0.0, 1.0);
+
+	// Calculate the shading terms for the microfacet specular shading model
+	vec3 F = specularReflection(specularEnvironmentR0, specularEnvironmentR90, VdotH);
+	float G = geometricOcclusion(NdotL, NdotV, alphaRoughness);
+	float D = microfacetDistribution(NdotH, alphaRoughness);
+
+	// Calculation of analytical lighting contribution
+	// Obtain final intensity as reflectance (BRDF) scaled by the energy of the light (cosine law)
+	vec3 lighting = (NdotL * attenuation * light.Intensity) * light.Color;
+	result.Diffuse += (diffuseColor / M_PI) * (1.0 - F) * lighting;
+	result.Specular += (lighting * F * G) * D / (4.0 * NdotL * NdotV);
+}
+
+// Luminance of the unshadowed lighting of a light, the target function of the light resampling.
+float GetLightTargetPdf(SurfacePoint point, vec3 viewDirection, int lightIndex)
+{
+	RendererLight light = GetLight(lightIndex);
+	vec3 lightVec;
+	float attenuation = GetLightAttenuationAndLightVec(point.Position, light, lightVec);
+
+	ShadingResult result;
+	result.Diffuse = vec3(0, 0, 0);
+	result.Specular = vec3(0, 0, 0);
+	AddLight(point, viewDirection, light, lightVec, attenuation, attenuation > 0.0, result);
+	return dot(result.Diffuse + result.Specular, vec3(0.2126, 0.7152, 0.0722));
+}
+
+// Adds the light of points sampled on the emissive triangles. Every sample acts as a light at the point whose
+// attenuation turns the area density of the sample into a solid angle one. Both sides of a triangle emit.
+void AddEmissiveLights(SurfacePoint point, vec3 viewDirection, ivec2 pixel, inout ShadingResult result)
+{
+	if(EmissiveTriangleCount == 0) {
+		return;
+	}
+
+	vec3 surfacePos = GetReflectionOrigin(point);
+	Sampler rng = GetPixelSampler(pixel, uint(RANDOM_DIMENSION_EMISSIVE));
+	for(int i = 0; i < EmissiveSampleCount; ++i) {
+		RendererLight light;
+		vec3 normal;
+		float pdf;
+		SampleEmissiveTriangle(vec3(SampleFloat(rng), Sample2D(rng)), light.Position, normal, light.Color, pdf);
+		light.Intensity = 1.0 / float(EmissiveSampleCount);
+
+		vec3 toLight = light.Position - point.Position;
+		float distanceSq = dot(toLight, toLight);
+		vec3 lightVec = toLight * inversesqrt(max(distanceSq, 1e-8));
+		float cosLight = dot(normal, lightVec);
+		if(dot(point.Normal, lightVec) <= 0.0 || cosLight == 0.0 || pdf <= 0.0) {
+			continue;
+		}
+
+		// Start the shadow ray slightly in front of the emitting side so it doesn't hit the emissive triangle.
+		vec3 lightOrigin = light.Position - normal * (sign(cosLight) * SurfaceOffset);
+		if(!CastVisRay(lightOrigin, surfacePos)) {
+			float attenuation = abs(cosLight) / (max(distanceSq, 1e-8) * pdf);
+			AddLight(point, viewDirection, light, lightVec, attenuation, true, result);
+		}
+	}
+}
+
+// Lighting of all lights at the point without reflections, refractions and ambient.
+// shadowOccluders holds the occluders of the previous frame and is updated with the ones of this frame.
+ShadingResult ShadePointDirect(SurfacePoint point, vec3 viewDirection, ivec2 pixel, inout ivec4 shadowOccluders)
+{
+    vec3 surfacePos = GetReflectionOrigin(point);
 
     ShadingResult result;
     result.Diffuse = vec3(0, 0, 0);
     result.Specular = vec3(0, 0, 0);
 
-    for(int i = 0; i < LightCount; ++i) {
-    	RendererLight light = GetLight(i);
+    LightList lights = GetPixelLightList(point.Position, pixel);
+    for(int i = 0; i < lights.Count; ++i) {
+    	float weight;
+    	int lightIndex = GetLightListIndex(lights, i, point.Position, weight);
+    	if(lightIndex < 0) {
+    		continue;
+    	}
+    	RendererLight light = GetLight(lightIndex);
+    	light.Intensity *= weight;
     	vec3 lightVec;
     	float attenuation = GetLightAttenuationAndLightVec(point.Position, light, lightVec);
+    	bool visible = false;
     	if(attenuation > 0.0) {
-		    if(!CastVisRay(light.Position, surfacePos)) {
-				float NdotL = clamp(dot(point.Normal, lightVec), 0.001, 1.0);
-				result.Diffuse += light.Color * diffuseColor * (NdotL * attenuation * light.Intensity / M_PI);
-	 		}
+    		visible = !(IsSampledLight(lights, i) ? CastVisRay(light.Position, surfacePos) : IsLightOccluded(lightIndex, light.Position, surfacePos, shadowOccluders));
  		}
-
-	    vec3 halfVec = normalize(lightVec + viewDirection);
-
-		float NdotL = clamp(dot(point.Normal, lightVec), 0.001, 1.0);
-		float NdotV = clamp(abs(dot(point.Normal, viewDirection)), 0.001, 1.0);
-		float NdotH = clamp(dot(point.Normal, halfVec), 0.0, 1.0);
-		float LdotH = clamp(dot(lightVec, halfVec), 0.0, 1.0);
-		float VdotH = clamp(dot(viewDirection, halfVec), 0.0, 1.0);
-
-		// Calculate the shading terms for the microfacet specular shading model
-		vec3 F = specularReflection(specularEnvironmentR0, specularEnvironmentR90, VdotH);
-		float G = geometricOcclusion(NdotL, NdotV, alphaRoughness);
-		float D = microfacetDistribution(NdotH, alphaRoughness);
-
-		// Calculation of analytical lighting contribution
-		// Obtain final intensity as reflectance (BRDF) scaled by the energy of the light (cosine law)
-		vec3 lighting = (NdotL * attenuation * light.Intensity) * light.Color;
-		result.Diffuse += (diffuseColor / M_PI) * (1.0 - F) * lighting;
-		result.Specular += (lighting * F * G) * D / (4.0 * NdotL * NdotV);
+ 		AddLight(point, viewDirection, light, lightVec, attenuation, visible, result);
     }
+    AddEmissiveLights(point, viewDirection, pixel, result);
 
-    // Add some reflection, this is not 100% pbr.
+    return result;
+}
+
+// Adds some reflection to the specular term, this is not 100% pbr.
+void AddReflections(SurfacePoint point, vec3 viewDirection, ivec2 pixel, inout ShadingResult result)
+{
+    vec3 surfacePos = GetReflectionOrigin(point);
     SurfacePoint nextPoint = point;
     vec3 lastViewDir = viewDirection;
+    float throughput = 1.0;
+    float weight = 1.0;
     for(int i = 0; i < RENDERING_MAX_RECURSIONS; ++i) {
-    	seed = mod( seed * 1.1234567893490423, 13. );
-	    if(nextPoint.Roughness < 0.5 || nextPoint.Metalness > 0.5) {
-			vec3 reflectionVec = normalize(reflect(-lastViewDir, nextPoint.Normal));
-			vec3 glossyReflectionVec = normalize(mix(reflectionVec, randomHemisphereDirection(reflectionVec, seed), nextPoint.Roughness));
+	    if(ContinuesReflection(nextPoint)) {
+	    	Sampler rng = GetBounceSampler(pixel, false, i);
+	    	if(!ContinuesPath(i, GetReflectance(nextPoint), throughput, weight, rng)) {
+	    		break;
+	    	}
+			vec3 glossyReflectionVec = GetReflectionDirection(nextPoint, lastViewDir, rng);
 			if(CastSurfaceRay(surfacePos, surfacePos + glossyReflectionVec * 40.0, nextPoint)) {
 				lastViewDir = -glossyReflectionVec;
-				surfacePos = nextPoint.Position + nextPoint.Normal * SurfaceOffset;
-				ShadingResult reflection = ShadePointSimple(nextPoint); 
-				result.Specular += reflection.Diffuse + reflection.Specular;
+				surfacePos = GetReflectionOrigin(nextPoint);
+				ShadingResult reflection = ShadePointSimple(nextPoint, GetBounceHitSampler(pixel, false, i)); 
+				result.Specular += (reflection.Diffuse + reflection.Specular) * weight;
 			} else {
 				break;
 			}
 		} 
     }
+}
 
- 	// Add refraction.
- 	surfacePos = point.Position - point.Normal * 0.002;
-    nextPoint = point;
-    lastViewDir = viewDirection;
-    for(int i = 0; i < 2; ++i) {
-    	if(nextPoint.Albedo.a > 0.0 && nextPoint.Albedo.a < 1.0) {
-    		vec3 refractionVec = normalize(refract(-lastViewDir, nextPoint.Normal, 0.9f));
+void AddRefractions(SurfacePoint point, vec3 viewDirection, ivec2 pixel, inout ShadingResult result)
+{
+ 	vec3 surfacePos = GetRefractionOrigin(point);
+    SurfacePoint nextPoint = point;
+    vec3 lastViewDir = viewDirection;
+    float throughput = 1.0;
+    float weight = 1.0;
+    for(int i = 0; i < RENDERING_MAX_REFRACTIONS; ++i) {
+    	if(ContinuesRefraction(nextPoint)) {
+    		Sampler rng = GetBounceSampler(pixel, true, i);
+    		if(!ContinuesPath(i, GetTransmittance(nextPoint), throughput, weight, rng)) {
+    			break;
+    		}
+    		vec3 refractionVec = GetRefractionDirection(nextPoint, lastViewDir);
 			if(CastSurfaceRay(surfacePos, surfacePos + refractionVec * 40.0, nextPoint)) {
 				lastViewDir = -refractionVec;
-				surfacePos = nextPoint.Position - nextPoint.Normal * 0.002;
-				ShadingResult refraction = ShadePointSimple(nextPoint); 
-				result.Specular += refraction.Diffuse + refraction.Specular;
+				surfacePos = GetRefractionOrigin(nextPoint);
+				ShadingResult refraction = ShadePointSimple(nextPoint, GetBounceHitSampler(pixel, true, i)); 
+				result.Specular += (refraction.Diffuse + refraction.Specular) * weight;
 			} else {
 				break;
 			}
     	}
     }
+}
+
+ShadingResult ShadePoint(SurfacePoint point, vec3 viewDirection, ivec2 pixel, inout ivec4 shadowOccluders) 
+{
+    ShadingResult result = ShadePointDirect(point, viewDirection, pixel, shadowOccluders);
+    AddReflections(point, viewDirection, pixel, result);
+    AddRefractions(point, viewDirection, pixel, result);
 
     // Add some ambient.
-	result.Diffuse += diffuseColor * AmbientLight;
+	result.Diffuse += GetDiffuseColor(point) * AmbientLight;
 
     return result;
 }
+
+bool TracesSecondaryRays(ivec2 pixel) {
+	return IsSecondaryRayPixel(SecondaryRayMode, pixel, FrameCount);
+}
+
+// Lighting of a pixel at full resolution. With a reduced secondary ray resolution the reflections and refractions are
+// left out, shaders/secondary_rays.frag traces them for the pixels of the pattern.
+ShadingResult ShadePointPrimary(SurfacePoint point, vec3 viewDirection, ivec2 pixel, inout ivec4 shadowOccluders)
+{
+	if(SecondaryRayMode == SECONDARY_RAYS_FULL) {
+		return ShadePoint(point, viewDirection, pixel, shadowOccluders);
+	}
+
+	ShadingResult result = ShadePointDirect(point, viewDirection, pixel, shadowOccluders);
+	result.Diffuse += GetDiffuseColor(point) * AmbientLight;
+	return result;
+}
+
+// Reflected and refracted radiance of a point.
+vec3 ShadePointSecondary(SurfacePoint point, vec3 viewDirection, ivec2 pixel)
+{
+	ShadingResult result;
+	result.Diffuse = vec3(0.0);
+	result.Specular = vec3(0.0);
+	AddReflections(point, viewDirection, pixel, result);
+	AddRefractions(point, viewDirection, pixel, result);
+	return result.Specular;
+}
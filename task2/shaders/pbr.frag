@@ -1,9 +1,13 @@
 #include "base.h"
 #include "random.h"
 #include "raytrace.h"
+#include "light_tree.h"
+#include "sample_variance.h"
 #include "lighting.h"
 
 layout(location = 0) out vec4 OUT_Color;
+layout(location = 1) out ivec4 OUT_ShadowOccluders;
+layout(location = 2) out vec4 OUT_SampleVariance;
 layout(location = 0) in vec2 INOUT_TextureCoords;
 layout(location = 1) in vec2 INOUT_GBufferTextureCoords;
 
@@ -12,24 +16,21 @@ void main() {
     vec2 texCoord = INOUT_GBufferTextureCoords; 
 
 	// Fetch and compute surface aspects from gbuffer.
-	float depthFromBuffer = 2.0 * textureLod(GBufferDepth, texCoord, 0).r - 1.0;
-	vec2 normalXY = textureLod(GBufferNormal, texCoord, 0).rg;
-	vec3 normal = decodeNormal(normalXY);
-	vec4 albedoTransparency = textureLod(GBufferAlbedoTransparency, texCoord, 0);
-	vec2 metalnessRoughness = textureLod(GBufferMetallnessRoughness, texCoord, 0).rg;
-
-	vec4 projectedPosition = vec4(INOUT_TextureCoords * 2.0 - 1.0, depthFromBuffer, 1.0);
-    vec4 worldPosBeforeW = projectedPosition * CameraInvViewProjection;
-	vec3 worldPosition = worldPosBeforeW.xyz / worldPosBeforeW.w;
-
     SurfacePoint point;
-    point.Position = worldPosition;
-    point.Normal = normal;
-    point.Albedo = albedoTransparency;
-    point.Metalness = metalnessRoughness.r;
-    point.Roughness = metalnessRoughness.g;
+    GetGBufferSurfacePoint(INOUT_TextureCoords, texCoord, point);
 
-    vec3 viewVec = normalize(CameraPosition - worldPosition); 
-    ShadingResult result = ShadePoint(point, viewVec);
-    OUT_Color = vec4(result.Diffuse + result.Specular, 1.0);
+    vec3 viewVec = normalize(CameraPosition - point.Position); 
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    ivec4 shadowOccluders = texelFetch(ShadowOccluderCache, pixel, 0);
+    int sampleCount = GetAdaptiveSampleCount(pixel);
+    vec3 radiance = vec3(0.0);
+    for(int i = 0; i < sampleCount; ++i) {
+        PixelSample = uint(i);
+        ShadingResult result = ShadePointPrimary(point, viewVec, pixel, shadowOccluders);
+        radiance += result.Diffuse + result.Specular;
+    }
+    radiance /= float(sampleCount);
+    OUT_Color = vec4(radiance, 1.0);
+    OUT_ShadowOccluders = shadowOccluders;
+    OUT_SampleVariance = vec4(UpdateSampleVariance(pixel, radiance, sampleCount), 0.0);
 }
\ No newline at end of file
@@ -7,7 +7,10 @@ layout(location = 1) in vec2 INOUT_TextureCoordsRendering;
 layout(location = 2) in vec2 INOUT_TextureCoordsRenderingOld;
 
 uniform sampler2D IntermediateBuffer;
+uniform vec2 RenderingScale;
 uniform float CameraExposure;
+// Strength of the unsharp mask that restores the detail the temporal anti-aliasing blurs, 0 disables it.
+uniform float Sharpness;
 
 float A = 0.15;
 float B = 0.50;
@@ -29,9 +32,25 @@ vec3 Uncharted2Tonemap(vec3 x) {
 }
 
 
+// The lighting only covers the lower left RenderingScale part of the buffer. The bilinear lookups that upscale it
+// stay half a texel inside, so that no texels of earlier frames at another scale bleed in at the edges.
+vec3 SampleLighting(vec2 texCoord) {
+	vec2 halfTexel = 0.5 / vec2(textureSize(IntermediateBuffer, 0));
+	return textureLod(IntermediateBuffer, clamp(texCoord, halfTexel, RenderingScale - halfTexel), 0).rgb;
+}
+
 void main() {
 	float Exposure = exp2(CameraExposure);
-	vec3 hdr = textureLod(IntermediateBuffer, INOUT_TextureCoordsRendering, 0).rgb * Exposure;
+	vec3 hdr = SampleLighting(INOUT_TextureCoordsRendering);
+	if(Sharpness > 0.0) {
+		vec2 texelSize = 1.0 / vec2(textureSize(IntermediateBuffer, 0));
+		vec3 neighbors = SampleLighting(INOUT_TextureCoordsRendering + vec2(texelSize.x, 0.0)) +
+						 SampleLighting(INOUT_TextureCoordsRendering - vec2(texelSize.x, 0.0)) +
+						 SampleLighting(INOUT_TextureCoordsRendering + vec2(0.0, texelSize.y)) +
+						 SampleLighting(INOUT_TextureCoordsRendering - vec2(0.0, texelSize.y));
+		hdr = max(hdr + (hdr - neighbors * 0.25) * Sharpness, vec3(0.0));
+	}
+	hdr *= Exposure;
 
     float whiteScale = 1.0 / Uncharted2Tonemap(W);
     vec3 ldr = Uncharted2Tonemap(hdr);
@@ -1,55 +1,119 @@
+// Random numbers of the lighting, one sampler per pixel and feature with a running dimension. Every dimension is an
+// Owen scrambled Sobol sequence over the frames that all pixels share, rotated per pixel by blue noise
+// (Cranley-Patterson rotation). The sequence stratifies the samples of a pixel over time and the rotation spreads
+// the error of neighboring pixels evenly. See Burley: "Practical Hash-based Owen Scrambling" (JCGT 2020).
+struct Sampler {
+	ivec2 Pixel;
+	uint Index;
+	uint Dimension;
+};
 
-float hash1(inout float seed) {
-    return fract(sin(seed += 0.1)*43758.5453123);
+Sampler CreateSampler(ivec2 pixel, uint sampleIndex, uint dimension) {
+	Sampler rng;
+	rng.Pixel = pixel;
+	rng.Index = sampleIndex;
+	rng.Dimension = dimension;
+	return rng;
 }
 
-vec2 hash2(inout float seed) {
-    return fract(sin(vec2(seed+=0.1,seed+=0.1))*vec2(43758.5453123,22578.1459123));
+uint HashUint(uint x) {
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
 }
 
-vec3 hash3(inout float seed) {
-    return fract(sin(vec3(seed+=0.1,seed+=0.1,seed+=0.1))*vec3(43758.5453123,22578.1459123,19642.3490423));
+// Owen scrambling of the bits of x with the Laine-Karras permutation.
+uint NestedUniformScramble(uint x, uint seed) {
+	x = bitfieldReverse(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return bitfieldReverse(x);
 }
 
-vec3 cosWeightedRandomHemisphereDirection( const vec3 n, inout float seed ) {
-  	vec2 r = hash2(seed);
-    
+// Second dimension of the Sobol sequence, the first one is the reversed index.
+uint SobolSecondDimension(uint index) {
+	uint result = 0u;
+	for(uint v = 0x80000000u; index != 0u; index >>= 1, v ^= v >> 1) {
+		if((index & 1u) != 0u) {
+			result ^= v;
+		}
+	}
+	return result;
+}
+
+// Point of a 2D Sobol sequence, the index is shuffled and the dimensions are scrambled with seeds of the dimension.
+vec2 SobolOwen2D(uint index, uint dimension) {
+	uint seed = HashUint(dimension + 0x9e3779b9u);
+	index = NestedUniformScramble(index, seed);
+	uint x = NestedUniformScramble(bitfieldReverse(index), HashUint(seed + 1u));
+	uint y = NestedUniformScramble(SobolSecondDimension(index), HashUint(seed + 2u));
+	return vec2(uvec2(x, y) >> 8) * (1.0 / 16777216.0);
+}
+
+float InterleavedGradientNoise(vec2 position_screen)
+{
+  	const vec3 magic = vec3(0.06711056, 0.00583715, 52.9829189);
+  	return fract(magic.z * fract(dot(position_screen, magic.xy)));
+}
+
+// Blue noise rotation of a pixel. Interleaved gradient noise along both screen axes stands in for a blue noise
+// texture, the dimension shifts the pattern.
+vec2 GetBlueNoise2D(ivec2 pixel, uint dimension) {
+	vec2 position = vec2(pixel) + vec2(5.0, 3.0) * float(dimension % 256u);
+	return vec2(InterleavedGradientNoise(position), InterleavedGradientNoise(position.yx));
+}
+
+float SampleFloat(inout Sampler rng) {
+	uint dimension = rng.Dimension++;
+	float u = SobolOwen2D(rng.Index, dimension).x + GetBlueNoise2D(rng.Pixel, dimension).x;
+	return min(fract(u), 0.99999994);
+}
+
+vec2 Sample2D(inout Sampler rng) {
+	uint dimension = rng.Dimension;
+	rng.Dimension += 2u;
+	vec2 u = SobolOwen2D(rng.Index, dimension) + GetBlueNoise2D(rng.Pixel, dimension);
+	return min(fract(u), vec2(0.99999994));
+}
+
+vec3 cosWeightedRandomHemisphereDirection( const vec3 n, inout Sampler rng ) {
+  	vec2 r = Sample2D(rng);
+
 	vec3  uu = normalize( cross( n, vec3(0.0,1.0,1.0) ) );
 	vec3  vv = cross( uu, n );
-	
+
 	float ra = sqrt(r.y);
-	float rx = ra*cos(6.2831*r.x); 
+	float rx = ra*cos(6.2831*r.x);
 	float ry = ra*sin(6.2831*r.x);
 	float rz = sqrt( 1.0-r.y );
 	vec3  rr = vec3( rx*uu + ry*vv + rz*n );
-    
+
     return normalize( rr );
 }
 
-vec3 randomSphereDirection(inout float seed) {
-    vec2 h = hash2(seed) * vec2(2.,6.28318530718)-vec2(1,0);
+vec3 randomSphereDirection(inout Sampler rng) {
+    vec2 h = Sample2D(rng) * vec2(2.,6.28318530718)-vec2(1,0);
     float phi = h.y;
 	return vec3(sqrt(1.-h.x*h.x)*vec2(sin(phi),cos(phi)),h.x);
 }
 
-vec3 randomHemisphereDirection( const vec3 n, inout float seed ) {
-	vec3 dr = randomSphereDirection(seed);
+vec3 randomHemisphereDirection( const vec3 n, inout Sampler rng ) {
+	vec3 dr = randomSphereDirection(rng);
 	return dot(dr,n) * dr;
 }
 
-
-float InterleavedGradientNoise(vec2 position_screen)
-{
-  	const vec3 magic = vec3(0.06711056, 0.00583715, 52.9829189);
-  	return fract(magic.z * fract(dot(position_screen, magic.xy)));
-}
-
 vec2 VogelDiskSample(int sampleIndex, int samplesCount, float phi)
 {
     const float GoldenAngle = 2.4;
-  
+
     float r = sqrt(sampleIndex + 0.5) * inversesqrt(samplesCount);
     float theta = float(sampleIndex) * GoldenAngle + phi;
-    
+
     return vec2(r * cos(theta), r * sin(theta));
 }
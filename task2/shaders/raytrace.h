@@ -1,85 +1,453 @@
-#define MAX_STACK_SIZE 32
-
-//Todo(task2):
-// Define your own BVH/Triangle structs and buffers.
-// Implement an AABB and Triangle intersection test.
-// struct IterativeNode {
-//     int childrenStart;
-//     int childCount;
-//     int triangleCount;
-//     int triangleStart;
-//     vec3 aabbMin;
-//     vec3 aabbMax;
-// };
+// Flattened BVH nodes, two RGBA32UI texels per node (see RendererBVHNode).
+uniform usamplerBuffer BVHNodeBuffer;
+
+// Leaf triangles in BVH order, one RGBA32UI texel per triangle (see RendererTriangle).
+uniform usamplerBuffer BVHTriangleBuffer;
+
+// World space vertices shared by the triangles, one RGBA32UI texel per vertex (see RendererVertex).
+uniform usamplerBuffer BVHVertexBuffer;
+
+// Alias table over the emissive triangles, two RGBA32UI texels per triangle (see RendererEmissiveTriangle).
+uniform usamplerBuffer EmissiveTriangleBuffer;
+uniform int EmissiveTriangleCount;
+
+#if BVH_PRECOMPUTE_TRIANGLE_TRANSFORMS
+	// Rows of the unit triangle transform, three RGBA32F texels per triangle.
+	uniform samplerBuffer BVHTriangleTransformBuffer;
+#endif
+
+RendererBVHNode GetBVHNode(int nodeIndex) {
+	uvec4 lower = texelFetch(BVHNodeBuffer, nodeIndex * 2);
+	uvec4 upper = texelFetch(BVHNodeBuffer, nodeIndex * 2 + 1);
+
+	RendererBVHNode node;
+	node.AABBMin = uintBitsToFloat(lower.xyz);
+	node.Data = lower.w;
+	node.AABBMax = uintBitsToFloat(upper.xyz);
+	node.Links = upper.w;
+	return node;
+}
+
+bool IsBVHLeaf(RendererBVHNode node) {
+	return (node.Links & 3u) == 3u;
+}
+
+RendererTriangle GetTriangle(int triangleIndex) {
+	uvec4 data = texelFetch(BVHTriangleBuffer, triangleIndex);
+
+	RendererTriangle triangle;
+	triangle.A = data.x;
+	triangle.B = data.y;
+	triangle.C = data.z;
+	triangle.MaterialIndex = data.w;
+	return triangle;
+}
+
+RendererVertex GetVertex(uint vertexIndex) {
+	uvec4 data = texelFetch(BVHVertexBuffer, int(vertexIndex));
+
+	RendererVertex vertex;
+	vertex.Position = uintBitsToFloat(data.xyz);
+	vertex.TexCoord = data.w;
+	return vertex;
+}
+
+// Ray with the per-ray constants of the watertight ray/triangle test precomputed.
+// See Woop, Benthin, Wald: "Watertight Ray/Triangle Intersection" (JCGT 2013).
+struct Ray {
+	vec3 Origin;
+	vec3 Direction;
+	vec3 InvDirection;
+	ivec3 Axes;
+	vec3 Shear;
+};
+
+Ray CreateRay(vec3 origin, vec3 direction) {
+	Ray ray;
+	ray.Origin = origin;
+	ray.Direction = direction;
+	ray.InvDirection = 1.0 / direction;
+
+	// Permute the axes so that the largest direction component becomes z.
+	vec3 absDirection = abs(direction);
+	int kz = absDirection.x > absDirection.y ? (absDirection.x > absDirection.z ? 0 : 2) : (absDirection.y > absDirection.z ? 1 : 2);
+	int kx = (kz + 1) % 3;
+	int ky = (kx + 1) % 3;
+
+	// Swap x and y to preserve the winding direction of triangles.
+	if(direction[kz] < 0.0) {
+		int swap = kx;
+		kx = ky;
+		ky = swap;
+	}
+
+	ray.Axes = ivec3(kx, ky, kz);
+	ray.Shear = vec3(direction[kx], direction[ky], 1.0) / direction[kz];
+	return ray;
+}
+
+bool RayHitsAABB(Ray ray, vec3 bmin, vec3 bmax, float maxT, out float entryT) {
+	vec3 t0 = (bmin - ray.Origin) * ray.InvDirection;
+	vec3 t1 = (bmax - ray.Origin) * ray.InvDirection;
+	vec3 tNear = min(t0, t1);
+	vec3 tFar = max(t0, t1);
+	entryT = max(max(tNear.x, tNear.y), max(tNear.z, 0.0));
+	float exitT = min(min(tFar.x, tFar.y), min(tFar.z, maxT));
+	return entryT <= exitT;
+}
+
+// Watertight test, rays can not slip through the shared edge of two triangles.
+// Returns the barycentric coordinates of b and c.
+bool RayHitsTriangle(Ray ray, vec3 a, vec3 b, vec3 c, float maxT, out float t, out vec2 barycentrics) {
+	int kx = ray.Axes.x;
+	int ky = ray.Axes.y;
+	int kz = ray.Axes.z;
+
+	vec3 A = a - ray.Origin;
+	vec3 B = b - ray.Origin;
+	vec3 C = c - ray.Origin;
+
+	// Shear the vertices into ray space.
+	vec2 a2 = vec2(A[kx], A[ky]) - ray.Shear.xy * A[kz];
+	vec2 b2 = vec2(B[kx], B[ky]) - ray.Shear.xy * B[kz];
+	vec2 c2 = vec2(C[kx], C[ky]) - ray.Shear.xy * C[kz];
+
+	// Scaled barycentric coordinates as 2D edge functions.
+	float U = c2.x * b2.y - c2.y * b2.x;
+	float V = a2.x * c2.y - a2.y * c2.x;
+	float W = b2.x * a2.y - b2.y * a2.x;
+
+	t = 0.0;
+	barycentrics = vec2(0.0);
+	if((U < 0.0 || V < 0.0 || W < 0.0) && (U > 0.0 || V > 0.0 || W > 0.0)) {
+		return false;
+	}
+
+	float det = U + V + W;
+	if(det == 0.0) {
+		return false;
+	}
+
+	float T = ray.Shear.z * (U * A[kz] + V * B[kz] + W * C[kz]);
+
+	// Depth test without dividing by the determinant.
+	float detSign = sign(det);
+	if(T * detSign < 0.0 || T * detSign > maxT * abs(det)) {
+		return false;
+	}
+
+	float invDet = 1.0 / det;
+	t = T * invDet;
+	barycentrics = vec2(V, W) * invDet;
+	return true;
+}
+
+// Test against a precomputed affine transform mapping the triangle onto the unit triangle
+// (see BVH_PRECOMPUTE_TRIANGLE_TRANSFORMS). Cheaper, but not watertight.
+bool RayHitsTriangleTransformed(Ray ray, vec4 row0, vec4 row1, vec4 row2, float maxT, out float t, out vec2 barycentrics) {
+	vec4 origin = vec4(ray.Origin, 1.0);
+	vec4 direction = vec4(ray.Direction, 0.0);
+
+	t = -dot(row2, origin) / dot(row2, direction);
+	barycentrics = vec2(dot(row0, origin), dot(row1, origin)) + t * vec2(dot(row0, direction), dot(row1, direction));
+	return t >= 0.0 && t <= maxT && barycentrics.x >= 0.0 && barycentrics.y >= 0.0 && barycentrics.x + barycentrics.y <= 1.0;
+}
+
+vec2 InterpolateTexCoords(RendererTriangle triangle, vec2 barycentrics) {
+	vec2 texCoordA = unpackHalf2x16_emu(GetVertex(triangle.A).TexCoord);
+	vec2 texCoordB = unpackHalf2x16_emu(GetVertex(triangle.B).TexCoord);
+	vec2 texCoordC = unpackHalf2x16_emu(GetVertex(triangle.C).TexCoord);
+	return texCoordA * (1.0 - barycentrics.x - barycentrics.y) + texCoordB * barycentrics.x + texCoordC * barycentrics.y;
+}
+
+// Rejects hits on the transparent parts of alpha tested materials (e.g. leaves) like the gbuffer pass does.
+bool IsTriangleOpaque(int triangleIndex, vec2 barycentrics) {
+	RendererTriangle triangle = GetTriangle(triangleIndex);
+	RendererMaterial material = GetMaterial(triangle.MaterialIndex);
+	if(!HasFeature(material, MATERIAL_FEATURE_OPACITY_CUTOUT)) {
+		return true;
+	}
+
+	float alpha = material.AlbedoFactor.a;
+	if(HasFeature(material, MATERIAL_FEATURE_ALBEDO_MAP)) {
+		alpha *= SampleMaterialTextureLod(material.AlbedoMap, InterpolateTexCoords(triangle, barycentrics), 0.0).a;
+	}
+	return alpha >= material.AlphaCutoff;
+}
+
+bool RayHitsBVHTriangle(Ray ray, int triangleIndex, float maxT, out float t, out vec2 barycentrics) {
+#if BVH_PRECOMPUTE_TRIANGLE_TRANSFORMS
+	int offset = triangleIndex * 3;
+	vec4 row0 = texelFetch(BVHTriangleTransformBuffer, offset);
+	vec4 row1 = texelFetch(BVHTriangleTransformBuffer, offset + 1);
+	vec4 row2 = texelFetch(BVHTriangleTransformBuffer, offset + 2);
+	bool hit = RayHitsTriangleTransformed(ray, row0, row1, row2, maxT, t, barycentrics);
+#else
+	uvec3 indices = texelFetch(BVHTriangleBuffer, triangleIndex).xyz;
+	vec3 a = uintBitsToFloat(texelFetch(BVHVertexBuffer, int(indices.x)).xyz);
+	vec3 b = uintBitsToFloat(texelFetch(BVHVertexBuffer, int(indices.y)).xyz);
+	vec3 c = uintBitsToFloat(texelFetch(BVHVertexBuffer, int(indices.z)).xyz);
+	bool hit = RayHitsTriangle(ray, a, b, c, maxT, t, barycentrics);
+#endif
+	return hit && IsTriangleOpaque(triangleIndex, barycentrics);
+}
+
+// Walks the nodes in depth-first order and follows the skip link whenever a subtree is missed or done.
+bool TraceBVHStackless(Ray ray, float maxT, bool anyHit, out float hitT, out int hitTriangle, out vec2 hitBarycentrics) {
+	bool hasHit = false;
+	hitT = maxT;
+	hitTriangle = -1;
+	hitBarycentrics = vec2(0.0);
+
+	int nodeIndex = 0;
+	do {
+		RendererBVHNode node = GetBVHNode(nodeIndex);
+		int nextIndex = int(node.Links >> 2);
+
+		float entryT;
+		if(RayHitsAABB(ray, node.AABBMin, node.AABBMax, hitT, entryT)) {
+			if(IsBVHLeaf(node)) {
+				int triangleStart = int(node.Data & 0xFFFFFFu);
+				int triangleEnd = triangleStart + int(node.Data >> 24);
+				for(int i = triangleStart; i < triangleEnd; ++i) {
+					float t;
+					vec2 barycentrics;
+					if(RayHitsBVHTriangle(ray, i, hitT, t, barycentrics)) {
+						hasHit = true;
+						hitT = t;
+						hitTriangle = i;
+						hitBarycentrics = barycentrics;
+						if(anyHit) {
+							return true;
+						}
+					}
+				}
+			} else {
+				nextIndex = nodeIndex + 1;
+			}
+		}
+		nodeIndex = nextIndex;
+	} while(nodeIndex != 0);
+
+	return hasHit;
+}
+
+// Finds the closest hit within maxT, or stops at the first hit for visibility rays.
+bool TraceBVH(Ray ray, float maxT, bool anyHit, out float hitT, out int hitTriangle, out vec2 hitBarycentrics) {
+#if BVH_STACKLESS_TRAVERSAL
+	return TraceBVHStackless(ray, maxT, anyHit, hitT, hitTriangle, hitBarycentrics);
+#else
+	bool hasHit = false;
+	hitT = maxT;
+	hitTriangle = -1;
+	hitBarycentrics = vec2(0.0);
+
+	// Visit the near child first based on the split axis and cull entries behind the closest hit.
+	int stack[BVH_MAX_STACK_SIZE];
+	float stackEntry[BVH_MAX_STACK_SIZE];
+	int stackSize = 0;
+
+	RendererBVHNode root = GetBVHNode(0);
+	float rootEntry;
+	if(RayHitsAABB(ray, root.AABBMin, root.AABBMax, hitT, rootEntry)) {
+		stack[0] = 0;
+		stackEntry[0] = rootEntry;
+		stackSize = 1;
+	}
+
+	while(stackSize > 0) {
+		--stackSize;
+		if(stackEntry[stackSize] > hitT) {
+			continue;
+		}
+		int nodeIndex = stack[stackSize];
+		RendererBVHNode node = GetBVHNode(nodeIndex);
+
+		uint axis = node.Links & 3u;
+		if(axis == 3u) {
+			int triangleStart = int(node.Data & 0xFFFFFFu);
+			int triangleEnd = triangleStart + int(node.Data >> 24);
+			for(int i = triangleStart; i < triangleEnd; ++i) {
+				float t;
+				vec2 barycentrics;
+				if(RayHitsBVHTriangle(ray, i, hitT, t, barycentrics)) {
+					hasHit = true;
+					hitT = t;
+					hitTriangle = i;
+					hitBarycentrics = barycentrics;
+					if(anyHit) {
+						return true;
+					}
+				}
+			}
+			continue;
+		}
+
+		int nearIndex = nodeIndex + 1;
+		int farIndex = int(node.Data);
+		if(ray.Direction[axis] < 0.0) {
+			nearIndex = int(node.Data);
+			farIndex = nodeIndex + 1;
+		}
+
+		RendererBVHNode nearNode = GetBVHNode(nearIndex);
+		RendererBVHNode farNode = GetBVHNode(farIndex);
+		float nearEntry;
+		float farEntry;
+		bool hitsNear = RayHitsAABB(ray, nearNode.AABBMin, nearNode.AABBMax, hitT, nearEntry);
+		bool hitsFar = RayHitsAABB(ray, farNode.AABBMin, farNode.AABBMax, hitT, farEntry);
+
+		// Deeper trees than the stack holds restart with the stackless walk instead of dropping nodes.
+		if(stackSize + int(hitsFar) + int(hitsNear) > BVH_MAX_STACK_SIZE) {
+			return TraceBVHStackless(ray, maxT, anyHit, hitT, hitTriangle, hitBarycentrics);
+		}
+
+		// Push the far child first so the near child is popped first.
+		if(hitsFar) {
+			stack[stackSize] = farIndex;
+			stackEntry[stackSize] = farEntry;
+			++stackSize;
+		}
+		if(hitsNear) {
+			stack[stackSize] = nearIndex;
+			stackEntry[stackSize] = nearEntry;
+			++stackSize;
+		}
+	}
+
+	return hasHit;
+#endif
+}
 
 bool CastVisRay(vec3 origin, vec3 target) {
-	// Todo(task2): Implement raycasting that only decides if the ray hits anything (return true) or not (return false).
-	return false;
+	// The direction is not normalized so the segment ends at t = 1.
+	Ray ray = CreateRay(origin, target - origin);
+	float hitT;
+	int hitTriangle;
+	vec2 hitBarycentrics;
+	return TraceBVH(ray, 1.0, true, hitT, hitTriangle, hitBarycentrics);
 }
 
+// Visibility ray that tests the last known occluder before traversing the BVH. The occluder is updated
+// with the triangle found by the traversal, or -1 if nothing blocks the segment.
+bool CastVisRayCached(vec3 origin, vec3 target, inout int occluder) {
+	Ray ray = CreateRay(origin, target - origin);
+	if(occluder >= 0 && occluder < textureSize(BVHTriangleBuffer)) {
+		float t;
+		vec2 barycentrics;
+		if(RayHitsBVHTriangle(ray, occluder, 1.0, t, barycentrics)) {
+			return true;
+		}
+	}
+
+	float hitT;
+	vec2 hitBarycentrics;
+	return TraceBVH(ray, 1.0, true, hitT, occluder, hitBarycentrics);
+}
+
+
+// Evaluates the material at a ray hit the same way the gbuffer pass does.
+void GetSurfacePoint(Ray ray, float hitT, int hitTriangle, vec2 hitBarycentrics, out SurfacePoint point) {
+	RendererTriangle triangle = GetTriangle(hitTriangle);
+	vec2 texCoords = InterpolateTexCoords(triangle, hitBarycentrics);
+
+	// There are no vertex normals in the triangle buffer, so use the face normal facing the ray.
+	vec3 a = GetVertex(triangle.A).Position;
+	vec3 b = GetVertex(triangle.B).Position;
+	vec3 c = GetVertex(triangle.C).Position;
+	vec3 normal = normalize(cross(b - a, c - a));
+	if(dot(normal, ray.Direction) > 0.0) {
+		normal = -normal;
+	}
+
+	RendererMaterial material = GetMaterial(triangle.MaterialIndex);
+	vec4 albedo = material.AlbedoFactor;
+	if(HasFeature(material, MATERIAL_FEATURE_ALBEDO_MAP)) {
+		albedo *= SampleMaterialTextureLod(material.AlbedoMap, texCoords, 0.0);
+	}
+
+	float metallic = material.MetalnessFactor;
+	float roughness = material.RoughnessFactor;
+	if(HasFeature(material, MATERIAL_FEATURE_METALLICROUGHNESS_MAP)) {
+		vec2 metallicRoughness = SampleMaterialTextureLod(material.MetallicRoughnessMap, texCoords, 0.0).rg;
+		metallic *= metallicRoughness.r;
+		roughness *= metallicRoughness.g;
+	}
+
+	point.Position = ray.Origin + ray.Direction * hitT;
+	point.Normal = normal;
+	point.Albedo = albedo;
+	point.Metalness = metallic;
+	point.Roughness = roughness;
+}
 
 bool CastSurfaceRay(vec3 origin, vec3 target, out SurfacePoint point) {
-	// Todo(task2): Implement raycasting that decides if the ray hits anything (return true) or not (return false) and
-	// also returns information about the point it hit.
-	point.Position = vec3(0, 0, 0);   
-	point.Normal = vec3(0, 1, 0);     
-	point.Albedo = vec4(0, 0, 0, 1);  
-    point.Metalness = 0.5;            
-    point.Roughness = 0.5;            
-
-	return false;
-}
-
-bool RayHitsAABB(vec3 p0, vec3 p1, vec3 bmin, vec3 bmax){
-	// vec3 box_center = (bmin + bmax) * 0.5; 
-	// vec3 halflength_extents = bmax - box_center; 
-	// vec3 segment_mid = (p0 + p1) * 0.5;
-	// vec3 segment_halflength_vec = p1 - segment_mid; // Segment halflength vector
-	// segment_mid = segment_mid - box_center; // Translate box and segment to origin
-	// // Try world coordinate axes as separating axes
-	// float adx = abs(d.x);
-	// if (abs(segment_mid.x) > halflength_extents.x + adx) return false;
-	// float ady = abs(d.y);
-	// if (abs(segment_mid.y) > halflength_extents.y + ady) return false;
-	// float adz = abs(d.z);
-	// if (abs(segment_mid.z) > halflength_extents.z + adz) return false;
-	// // Add in an epsilon term to counteract arithmetic errors when segment is
-	// // (near) parallel to a coordinate axis (see text for detail)
-	// adx += EPSILON; ady += EPSILON; adz += EPSILON;
-	// // Try cross products of segment direction vector with coordinate axes
-	// if (abs(segment_mid.y * segment_halflength_vec.z - m.z * segment_halflength_vec.y) > halflength_extents.y * adz + halflength_extents.z * ady) return false;
-	// if (abs(segment_mid.z * segment_halflength_vec.x - m.x * segment_halflength_vec.z) > halflength_extents.x * adz + halflength_extents.z * adx) return false;
-	// if (abs(segment_mid.x * segment_halflength_vec.y - m.y * segment_halflength_vec.x) > halflength_extents.x * ady + halflength_extents.y * adx) return false;
-	// // No separating axis found; segment must be overlapping AABB
+	point.Position = vec3(0, 0, 0);
+	point.Normal = vec3(0, 1, 0);
+	point.Albedo = vec4(0, 0, 0, 1);
+	point.Metalness = 0.5;
+	point.Roughness = 0.5;
+
+	Ray ray = CreateRay(origin, target - origin);
+	float hitT;
+	int hitTriangle;
+	vec2 hitBarycentrics;
+	if(!TraceBVH(ray, 1.0, false, hitT, hitTriangle, hitBarycentrics)) {
+		return false;
+	}
+
+	GetSurfacePoint(ray, hitT, hitTriangle, hitBarycentrics, point);
 	return true;
 }
 
-bool RayHitsTriangle(vec3 p, vec3 q, vec3 a, vec3 b, vec3 c, inout float u, inout float v, inout float w, inout float t) {
-	// vec3 ab = b - a;
-	// vec3 ac = c - a;
-	// vec3 qp = p - q;
-	// // Compute triangle normal. Can be precalculated or cached if intersecting multiple segments against the same triangle
-	// vec3 n = cross(ab, ac);
-	// // Compute denominator d. If d <= 0, segment is parallel to or points away from triangle, so exit early
-	// float d = dot(qp, n);
-	// if (d <= 0.0) return false;
-	// // Compute intersection t value of pq with plane of triangle. A ray intersects iff 0 <= t.
-	// // Segment intersects iff 0 <= t <= 1. Delay dividing by d until intersection has been found to pierce triangle
-	// vec3 ap = p - a;
-	// t = dot(ap, n);
-	// if (t < 0.0) return false;
-	// if (t > d) return false;
-	// // Compute barycentric coordinate components and test if within bounds
-	// vec3 e = cross(qp, ap);
-	// v = dot(ac, e);
-	// if (v < 0.0 || v > d) return false;
-	// w = -dot(ab, e);
-	// if (w < 0.0 || v + w > d) return false;
-	// // Segment/ray intersects triangle. Perform delayed division and compute the last barycentric coordinate component
-	// float ood = 1.0 / d;
-	// t *= ood;
-	// v *= ood;
-	// w *= ood;
-	// u = 1.0 - v - w;
-	 return true;
-}
\ No newline at end of file
+RendererEmissiveTriangle GetEmissiveTriangle(int index) {
+	uvec4 texel0 = texelFetch(EmissiveTriangleBuffer, index * 2);
+	uvec4 texel1 = texelFetch(EmissiveTriangleBuffer, index * 2 + 1);
+
+	RendererEmissiveTriangle triangle;
+	triangle.A = texel0.x;
+	triangle.B = texel0.y;
+	triangle.C = texel0.z;
+	triangle.MaterialIndex = texel0.w;
+	triangle.AliasProbability = uintBitsToFloat(texel1.x);
+	triangle.Alias = texel1.y;
+	triangle.Probability = uintBitsToFloat(texel1.z);
+	triangle.Area = uintBitsToFloat(texel1.w);
+	return triangle;
+}
+
+// Picks an emissive triangle proportional to its power and a uniformly distributed point on it from the three
+// random numbers in u. Returns the point, its face normal, the emitted radiance and the area density of the sample.
+bool SampleEmissiveTriangle(vec3 u, out vec3 position, out vec3 normal, out vec3 emission, out float pdf) {
+	if(EmissiveTriangleCount == 0) {
+		return false;
+	}
+
+	float entry = u.x * float(EmissiveTriangleCount);
+	int index = min(int(entry), EmissiveTriangleCount - 1);
+	RendererEmissiveTriangle emissive = GetEmissiveTriangle(index);
+	if(fract(entry) >= emissive.AliasProbability) {
+		emissive = GetEmissiveTriangle(int(emissive.Alias));
+	}
+
+	float r = sqrt(u.y);
+	vec2 barycentrics = vec2(r * (1.0 - u.z), r * u.z);
+	vec3 a = GetVertex(emissive.A).Position;
+	vec3 b = GetVertex(emissive.B).Position;
+	vec3 c = GetVertex(emissive.C).Position;
+	position = a * (1.0 - barycentrics.x - barycentrics.y) + b * barycentrics.x + c * barycentrics.y;
+	normal = normalize(cross(b - a, c - a));
+	pdf = emissive.Probability / emissive.Area;
+
+	RendererTriangle triangle;
+	triangle.A = emissive.A;
+	triangle.B = emissive.B;
+	triangle.C = emissive.C;
+	triangle.MaterialIndex = emissive.MaterialIndex;
+	RendererMaterial material = GetMaterial(emissive.MaterialIndex);
+	emission = material.EmissiveFactor;
+	if(HasFeature(material, MATERIAL_FEATURE_EMISSIVE_MAP)) {
+		emission *= SampleMaterialTextureLod(material.EmissiveMap, InterpolateTexCoords(triangle, barycentrics), 0.0).rgb;
+	}
+	return true;
+}
@@ -0,0 +1,62 @@
+// Light reservoir of a pixel as stored in the RGBA32F reservoir targets: light index, contribution weight,
+// number of candidates it represents and the distance to the camera it was built at.
+struct LightReservoir {
+	int LightIndex;
+	float WeightSum;
+	float M;
+	float W;
+	float TargetPdf;
+	float Distance;
+};
+
+LightReservoir CreateLightReservoir(float distance) {
+	LightReservoir reservoir;
+	reservoir.LightIndex = -1;
+	reservoir.WeightSum = 0.0;
+	reservoir.M = 0.0;
+	reservoir.W = 0.0;
+	reservoir.TargetPdf = 0.0;
+	reservoir.Distance = distance;
+	return reservoir;
+}
+
+LightReservoir LoadLightReservoir(ivec2 pixel) {
+	vec4 data = texelFetch(LightReservoirs, pixel, 0);
+	LightReservoir reservoir = CreateLightReservoir(data.w);
+	reservoir.LightIndex = int(data.x);
+	reservoir.W = data.y;
+	reservoir.M = data.z;
+	return reservoir;
+}
+
+vec4 StoreLightReservoir(LightReservoir reservoir) {
+	return vec4(float(reservoir.LightIndex), reservoir.W, reservoir.M, reservoir.Distance);
+}
+
+// Weighted reservoir sampling, the new sample replaces the current one with probability weight / WeightSum.
+void UpdateLightReservoir(inout LightReservoir reservoir, int lightIndex, float weight, float m, float targetPdf, inout Sampler rng) {
+	reservoir.WeightSum += weight;
+	reservoir.M += m;
+	if(weight > 0.0 && SampleFloat(rng) * reservoir.WeightSum <= weight) {
+		reservoir.LightIndex = lightIndex;
+		reservoir.TargetPdf = targetPdf;
+	}
+}
+
+// Merges the reservoir of another frame or pixel, its sample is weighted with the target function of this point.
+void CombineLightReservoir(inout LightReservoir reservoir, LightReservoir other, SurfacePoint point, vec3 viewDirection, inout Sampler rng) {
+	float targetPdf = 0.0;
+	if(other.LightIndex >= 0 && other.LightIndex < LightCount) {
+		targetPdf = GetLightTargetPdf(point, viewDirection, other.LightIndex);
+	}
+	UpdateLightReservoir(reservoir, other.LightIndex, targetPdf * other.W * other.M, other.M, targetPdf, rng);
+}
+
+void FinalizeLightReservoir(inout LightReservoir reservoir) {
+	reservoir.W = (reservoir.TargetPdf > 0.0 && reservoir.M > 0.0) ? reservoir.WeightSum / (reservoir.M * reservoir.TargetPdf) : 0.0;
+}
+
+// Reservoirs are only reused between surfaces at a similar distance to the camera.
+bool IsSimilarReservoirDistance(float distance, float otherDistance) {
+	return abs(distance - otherDistance) < 0.1 * distance;
+}
@@ -0,0 +1,51 @@
+#include "base.h"
+#include "random.h"
+#include "raytrace.h"
+#include "light_tree.h"
+#include "sample_variance.h"
+#include "lighting.h"
+#include "restir.h"
+
+layout(location = 0) out vec4 OUT_Reservoir;
+layout(location = 0) in vec2 INOUT_TextureCoords;
+layout(location = 1) in vec2 INOUT_GBufferTextureCoords;
+// Part of the reservoir textures the previous frame rendered to.
+uniform ivec2 RenderingSizeOld;
+
+
+// Picks a light per pixel from light tree candidates and merges it with the reservoir of the previous frame.
+// LightReservoirs holds the final reservoirs of the previous frame.
+void main() {
+	vec2 texCoord = INOUT_GBufferTextureCoords;
+	if(textureLod(GBufferDepth, texCoord, 0).r >= 1.0) {
+		OUT_Reservoir = StoreLightReservoir(CreateLightReservoir(0.0));
+		return;
+	}
+
+	SurfacePoint point;
+	GetGBufferSurfacePoint(INOUT_TextureCoords, texCoord, point);
+	vec3 viewVec = normalize(CameraPosition - point.Position);
+	float distance = length(CameraPosition - point.Position);
+	Sampler rng = GetPixelSampler(ivec2(gl_FragCoord.xy), uint(RANDOM_DIMENSION_RESTIR_INITIAL));
+
+	LightReservoir reservoir = CreateLightReservoir(distance);
+	for(int i = 0; i < RESTIR_INITIAL_CANDIDATES; ++i) {
+		float pdf;
+		int lightIndex = SampleLightTree(point.Position, rng, pdf);
+		float targetPdf = lightIndex >= 0 ? GetLightTargetPdf(point, viewVec, lightIndex) : 0.0;
+		UpdateLightReservoir(reservoir, lightIndex, lightIndex >= 0 ? targetPdf / pdf : 0.0, 1.0, targetPdf, rng);
+	}
+
+	// Temporal reuse, the history is clamped so that it can follow changes of the lighting.
+	vec2 previousCoord = INOUT_TextureCoords + textureLod(GBufferMotion, texCoord, 0).xy;
+	if(all(greaterThanEqual(previousCoord, vec2(0.0))) && all(lessThan(previousCoord, vec2(1.0)))) {
+		LightReservoir previous = LoadLightReservoir(ivec2(previousCoord * vec2(RenderingSizeOld)));
+		if(IsSimilarReservoirDistance(distance, previous.Distance)) {
+			previous.M = min(previous.M, float(RESTIR_TEMPORAL_MAX_FRAMES * RESTIR_INITIAL_CANDIDATES));
+			CombineLightReservoir(reservoir, previous, point, viewVec, rng);
+		}
+	}
+
+	FinalizeLightReservoir(reservoir);
+	OUT_Reservoir = StoreLightReservoir(reservoir);
+}
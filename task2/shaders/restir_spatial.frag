@@ -0,0 +1,59 @@
+#include "base.h"
+#include "random.h"
+#include "raytrace.h"
+#include "light_tree.h"
+#include "sample_variance.h"
+#include "lighting.h"
+#include "restir.h"
+
+layout(location = 0) out vec4 OUT_Reservoir;
+layout(location = 0) in vec2 INOUT_TextureCoords;
+layout(location = 1) in vec2 INOUT_GBufferTextureCoords;
+uniform vec2 RenderingScale;
+uniform ivec2 RenderingSize;
+
+
+// Merges the reservoir of a pixel with the ones of nearby pixels on similar surfaces.
+// LightReservoirs holds the reservoirs of the initial pass.
+void main() {
+	vec2 texCoord = INOUT_GBufferTextureCoords;
+	if(textureLod(GBufferDepth, texCoord, 0).r >= 1.0) {
+		OUT_Reservoir = StoreLightReservoir(CreateLightReservoir(0.0));
+		return;
+	}
+
+	SurfacePoint point;
+	GetGBufferSurfacePoint(INOUT_TextureCoords, texCoord, point);
+	vec3 viewVec = normalize(CameraPosition - point.Position);
+	float distance = length(CameraPosition - point.Position);
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	Sampler rng = GetPixelSampler(pixel, uint(RANDOM_DIMENSION_RESTIR_SPATIAL));
+	LightReservoir reservoir = CreateLightReservoir(distance);
+	CombineLightReservoir(reservoir, LoadLightReservoir(pixel), point, viewVec, rng);
+
+	ivec2 size = RenderingSize;
+	float phi = SampleFloat(rng) * 6.28318530718;
+	for(int i = 0; i < RESTIR_SPATIAL_NEIGHBORS; ++i) {
+		ivec2 neighbor = pixel + ivec2(round(VogelDiskSample(i, RESTIR_SPATIAL_NEIGHBORS, phi) * RESTIR_SPATIAL_RADIUS));
+		if(neighbor == pixel || any(lessThan(neighbor, ivec2(0))) || any(greaterThanEqual(neighbor, size))) {
+			continue;
+		}
+		vec2 neighborScreenCoord = (vec2(neighbor) + 0.5) / vec2(size);
+		vec2 neighborTexCoord = neighborScreenCoord * RenderingScale;
+		if(textureLod(GBufferDepth, neighborTexCoord, 0).r >= 1.0) {
+			continue;
+		}
+
+		// The reservoirs are combined without correcting for the different target functions of the pixels,
+		// which only stays close to unbiased between similar surfaces.
+		SurfacePoint neighborPoint;
+		GetGBufferSurfacePoint(neighborScreenCoord, neighborTexCoord, neighborPoint);
+		if(dot(point.Normal, neighborPoint.Normal) < 0.9 || !IsSimilarReservoirDistance(distance, length(CameraPosition - neighborPoint.Position))) {
+			continue;
+		}
+		CombineLightReservoir(reservoir, LoadLightReservoir(neighbor), point, viewVec, rng);
+	}
+
+	FinalizeLightReservoir(reservoir);
+	OUT_Reservoir = StoreLightReservoir(reservoir);
+}
@@ -0,0 +1,33 @@
+// Running mean and relative variance of the luminance of every pixel and the additional samples it wants (RGBA16F,
+// the previous frame is bound, the lighting passes write the next one). The variance is the one of a single sample, so
+// that it stays comparable between frames with different sample counts. See GetAdaptiveSampleCount in lighting.h.
+uniform sampler2D SampleVariance;
+// Relative error adaptive sampling aims for.
+uniform float AdaptiveSamplingThreshold;
+
+float GetLuminance(vec3 color) {
+	return dot(color, vec3(0.2126, 0.7152, 0.0722));
+}
+
+// Additional samples that get the relative error of a pixel with this variance below the threshold, limited to what
+// a pixel can take in one frame.
+float GetWantedSamples(float relativeVariance) {
+	float thresholdSq = max(AdaptiveSamplingThreshold * AdaptiveSamplingThreshold, 0.000001);
+	return clamp(relativeVariance / thresholdSq - 1.0, 0.0, float(RENDERING_MAX_SAMPLES - 1));
+}
+
+// Mean, relative variance and wanted samples after adding the average radiance of sampleCount samples of this frame.
+// The wanted samples are stored along so that the top mip level holds the mean the budget is compared against.
+vec3 UpdateSampleVariance(ivec2 pixel, vec3 radiance, int sampleCount) {
+	vec2 previous = texelFetch(SampleVariance, pixel, 0).rg;
+	float luminance = GetLuminance(radiance);
+	if(previous.r <= 0.0) {
+		return vec3(luminance, 0.0, 0.0);
+	}
+
+	float mean = mix(luminance, previous.r, RENDERING_SAMPLE_VARIANCE_HISTORY);
+	float difference = luminance - previous.r;
+	float relativeVariance = min(float(sampleCount) * difference * difference / max(mean * mean, 0.0001), RENDERING_SAMPLE_VARIANCE_MAX);
+	float variance = mix(relativeVariance, previous.g, RENDERING_SAMPLE_VARIANCE_HISTORY);
+	return vec3(mean, variance, GetWantedSamples(variance));
+}
@@ -0,0 +1,33 @@
+#include "base.h"
+#include "random.h"
+#include "raytrace.h"
+#include "light_tree.h"
+#include "sample_variance.h"
+#include "lighting.h"
+
+layout(location = 0) out vec4 OUT_SecondaryLighting;
+
+uniform vec2 RenderingScale;
+uniform ivec2 RenderingSize;
+
+
+// Traces the reflections and refractions of the pixels of a reduced resolution pattern. Every fragment is a texel of
+// the compact secondary lighting, so no invocation idles next to one that traces and the cost falls with the ray count.
+void main() {
+	ivec2 pixel = GetSecondaryRayPixel(SecondaryRayMode, ivec2(gl_FragCoord.xy), FrameCount);
+	if(any(greaterThanEqual(pixel, RenderingSize))) {
+		OUT_SecondaryLighting = vec4(0.0);
+		return;
+	}
+	vec2 screenCoord = (vec2(pixel) + 0.5) / vec2(RenderingSize);
+	vec2 texCoord = screenCoord * RenderingScale;
+	if(textureLod(GBufferDepth, texCoord, 0).r >= 1.0) {
+		OUT_SecondaryLighting = vec4(0.0);
+		return;
+	}
+
+	SurfacePoint point;
+	GetGBufferSurfacePoint(screenCoord, texCoord, point);
+	vec3 viewVec = normalize(CameraPosition - point.Position);
+	OUT_SecondaryLighting = vec4(ShadePointSecondary(point, viewVec, pixel), 1.0);
+}
@@ -0,0 +1,80 @@
+#include "base.h"
+
+layout(location = 0) out vec4 OUT_Color;
+
+layout(location = 0) in vec2 INOUT_TextureCoords;
+
+// Direct lighting at full resolution and the compact reflections and refractions of the pixels that traced them.
+uniform sampler2D IntermediateBuffer;
+uniform sampler2D SecondaryLighting;
+uniform sampler2D GBufferDepth;
+uniform sampler2D GBufferNormal;
+uniform mat4 CameraInvViewProjection;
+uniform vec3 CameraPosition;
+uniform int SecondaryRayMode;
+uniform uint FrameCount;
+uniform ivec2 RenderingSize;
+
+vec3 GetSecondaryLighting(ivec2 pixel) {
+	return texelFetch(SecondaryLighting, GetSecondaryRayTexel(SecondaryRayMode, pixel), 0).rgb;
+}
+
+
+// Adds the reflections and refractions to the direct lighting. Pixels that skipped the secondary rays take them from
+// the traced pixels of their 3x3 neighborhood with a joint bilateral filter guided by the gbuffer, so that the
+// bounces of one surface are not smeared onto another one.
+void main() {
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	vec3 direct = texelFetch(IntermediateBuffer, pixel, 0).rgb;
+	float depthFromBuffer = texelFetch(GBufferDepth, pixel, 0).r;
+	if(depthFromBuffer >= 1.0) {
+		OUT_Color = vec4(direct, 1.0);
+		return;
+	}
+	if(IsSecondaryRayPixel(SecondaryRayMode, pixel, FrameCount)) {
+		OUT_Color = vec4(direct + GetSecondaryLighting(pixel), 1.0);
+		return;
+	}
+
+	ivec2 size = RenderingSize;
+	vec3 position = GetWorldPosition(INOUT_TextureCoords, depthFromBuffer, CameraInvViewProjection);
+	vec3 normal = decodeNormal(texelFetch(GBufferNormal, pixel, 0).rg);
+	// Plane distance of one pixel footprint.
+	float planeSigma = distance(position, CameraPosition) * 2.0 / float(size.y);
+
+	vec3 filtered = vec3(0.0);
+	float weightSum = 0.0;
+	vec3 fallback = vec3(0.0);
+	float fallbackCount = 0.0;
+	for(int y = -1; y <= 1; ++y) {
+		for(int x = -1; x <= 1; ++x) {
+			ivec2 samplePixel = pixel + ivec2(x, y);
+			if(any(lessThan(samplePixel, ivec2(0))) || any(greaterThanEqual(samplePixel, size))) {
+				continue;
+			}
+			float sampleDepth = texelFetch(GBufferDepth, samplePixel, 0).r;
+			if(!IsSecondaryRayPixel(SecondaryRayMode, samplePixel, FrameCount) || sampleDepth >= 1.0) {
+				continue;
+			}
+			vec3 sampleSecondary = GetSecondaryLighting(samplePixel);
+
+			vec3 samplePosition = GetWorldPosition((vec2(samplePixel) + 0.5) / vec2(size), sampleDepth, CameraInvViewProjection);
+			vec3 sampleNormal = decodeNormal(texelFetch(GBufferNormal, samplePixel, 0).rg);
+			float planeDistance = abs(dot(normal, samplePosition - position));
+			float weight = pow(max(dot(normal, sampleNormal), 0.0), 32.0) * exp(-planeDistance / planeSigma) / float(abs(x) + abs(y));
+			filtered += sampleSecondary * weight;
+			weightSum += weight;
+			fallback += sampleSecondary;
+			fallbackCount += 1.0;
+		}
+	}
+
+	// Without a similar neighbor (thin geometry, silhouettes) the plain average beats a hole.
+	vec3 secondary = vec3(0.0);
+	if(weightSum > 0.0001) {
+		secondary = filtered / weightSum;
+	} else if(fallbackCount > 0.0) {
+		secondary = fallback / fallbackCount;
+	}
+	OUT_Color = vec4(direct + secondary, 1.0);
+}
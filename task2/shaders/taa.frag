@@ -0,0 +1,95 @@
+#include "base.h"
+
+layout(location = 0) out vec4 OUT_Color;
+
+layout(location = 0) in vec2 INOUT_TextureCoords;
+
+// Jittered lighting of the current frame and the resolved image of the previous one.
+uniform sampler2D IntermediateBuffer;
+uniform sampler2D TAAHistory;
+uniform sampler2D GBufferDepth;
+uniform sampler2D GBufferMotion;
+// 0 when the history was not resolved in the previous frame.
+uniform int TAAHistoryValid;
+uniform ivec2 RenderingSize;
+// Part of the history texture the previous frame rendered to.
+uniform vec2 RenderingScaleOld;
+
+
+vec3 RGBToYCoCg(vec3 color) {
+	return vec3(dot(color, vec3(0.25, 0.5, 0.25)), dot(color, vec3(0.5, 0.0, -0.5)), dot(color, vec3(-0.25, 0.5, -0.25)));
+}
+
+vec3 YCoCgToRGB(vec3 color) {
+	return vec3(color.x + color.y - color.z, color.x + color.z, color.x - color.y - color.z);
+}
+
+// Catmull-Rom filtered history from five bilinear taps (the corners of the 4x4 footprint are dropped), it keeps the
+// history sharp where a bilinear lookup would blur it a bit every frame. The taps stay inside the rendered part.
+vec3 SampleHistoryCatmullRom(vec2 texCoord) {
+	vec2 size = vec2(textureSize(TAAHistory, 0));
+	vec2 samplePosition = texCoord * size;
+	vec2 texelCenter = floor(samplePosition - 0.5) + 0.5;
+	vec2 f = samplePosition - texelCenter;
+	vec2 w0 = f * (-0.5 + f * (1.0 - 0.5 * f));
+	vec2 w1 = 1.0 + f * f * (-2.5 + 1.5 * f);
+	vec2 w2 = f * (0.5 + f * (2.0 - 1.5 * f));
+	vec2 w3 = f * f * (-0.5 + 0.5 * f);
+	vec2 w12 = w1 + w2;
+
+	vec2 minCoord = 0.5 / size;
+	vec2 maxCoord = RenderingScaleOld - 0.5 / size;
+	vec2 coord0 = clamp((texelCenter - 1.0) / size, minCoord, maxCoord);
+	vec2 coord12 = clamp((texelCenter + w2 / w12) / size, minCoord, maxCoord);
+	vec2 coord3 = clamp((texelCenter + 2.0) / size, minCoord, maxCoord);
+	vec3 result = textureLod(TAAHistory, vec2(coord12.x, coord0.y), 0).rgb * (w12.x * w0.y) +
+				  textureLod(TAAHistory, vec2(coord0.x, coord12.y), 0).rgb * (w0.x * w12.y) +
+				  textureLod(TAAHistory, coord12, 0).rgb * (w12.x * w12.y) +
+				  textureLod(TAAHistory, vec2(coord3.x, coord12.y), 0).rgb * (w3.x * w12.y) +
+				  textureLod(TAAHistory, vec2(coord12.x, coord3.y), 0).rgb * (w12.x * w3.y);
+	float weightSum = w12.x * w0.y + w0.x * w12.y + w12.x * w12.y + w3.x * w12.y + w12.x * w3.y;
+	return max(result / weightSum, vec3(0.0));
+}
+
+// Temporal anti-aliasing resolve (see Karis: "High Quality Temporal Supersampling", 2014). The history is reprojected
+// with the motion of the closest surface around the pixel, so edges keep the motion of the foreground, and clamped
+// to the color distribution of the 3x3 neighborhood of the current frame to reject stale colors.
+void main() {
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	ivec2 size = RenderingSize;
+	vec3 current = texelFetch(IntermediateBuffer, pixel, 0).rgb;
+
+	vec3 moment1 = vec3(0.0);
+	vec3 moment2 = vec3(0.0);
+	float closestDepth = 2.0;
+	ivec2 closestPixel = pixel;
+	for(int y = -1; y <= 1; ++y) {
+		for(int x = -1; x <= 1; ++x) {
+			ivec2 samplePixel = clamp(pixel + ivec2(x, y), ivec2(0), size - 1);
+			vec3 color = RGBToYCoCg(texelFetch(IntermediateBuffer, samplePixel, 0).rgb);
+			moment1 += color;
+			moment2 += color * color;
+			float depth = texelFetch(GBufferDepth, samplePixel, 0).r;
+			if(depth < closestDepth) {
+				closestDepth = depth;
+				closestPixel = samplePixel;
+			}
+		}
+	}
+
+	vec2 historyCoord = INOUT_TextureCoords + texelFetch(GBufferMotion, closestPixel, 0).xy;
+	if(TAAHistoryValid == 0 || any(lessThan(historyCoord, vec2(0.0))) || any(greaterThan(historyCoord, vec2(1.0)))) {
+		OUT_Color = vec4(current, 1.0);
+		return;
+	}
+
+	vec3 mean = moment1 / 9.0;
+	vec3 deviation = sqrt(max(moment2 / 9.0 - mean * mean, vec3(0.0))) * RENDERING_TAA_CLAMP_SIGMA;
+	vec3 history = RGBToYCoCg(SampleHistoryCatmullRom(historyCoord * RenderingScaleOld));
+	history = YCoCgToRGB(clamp(history, mean - deviation, mean + deviation));
+
+	// Weighting by the inverse luminance keeps single bright samples from flickering.
+	float currentWeight = RENDERING_TAA_CURRENT_WEIGHT / (1.0 + dot(current, vec3(0.2126, 0.7152, 0.0722)));
+	float historyWeight = (1.0 - RENDERING_TAA_CURRENT_WEIGHT) / (1.0 + dot(history, vec3(0.2126, 0.7152, 0.0722)));
+	OUT_Color = vec4(max((current * currentWeight + history * historyWeight) / (currentWeight + historyWeight), vec3(0.0)), 1.0);
+}
@@ -0,0 +1,84 @@
+#include "base.h"
+
+layout(location = 0) out vec4 OUT_Color;
+layout(location = 1) out vec4 OUT_Geometry;
+
+layout(location = 0) in vec2 INOUT_TextureCoords;
+
+uniform sampler2D IntermediateBuffer;
+uniform sampler2D GBufferDepth;
+uniform sampler2D GBufferNormal;
+uniform sampler2D GBufferMotion;
+// Lighting of the previous frame with the number of frames it holds in alpha, and the linear depth and encoded
+// normal of the surface every pixel showed.
+uniform sampler2D TemporalHistory;
+uniform sampler2D TemporalGeometryHistory;
+uniform mat4 CameraViewProjection;
+uniform mat4 CameraInvViewProjection;
+uniform mat4 CameraViewProjectionOld;
+// Longest history a pixel keeps, the current frame has a weight of at least 1 / TemporalMaxHistory.
+uniform int TemporalMaxHistory;
+// 0 when the lights or the lighting settings changed and no history is valid.
+uniform int TemporalHistoryValid;
+// Part of the history textures the previous frame rendered to.
+uniform ivec2 RenderingSizeOld;
+
+
+bool IsSameSurface(float expectedDepth, vec3 normal, vec4 geometry) {
+	return abs(geometry.r - expectedDepth) < TEMPORAL_DEPTH_TOLERANCE * expectedDepth &&
+		   dot(normal, decodeNormal(geometry.gb)) > TEMPORAL_NORMAL_TOLERANCE;
+}
+
+// Reprojects the lighting of the previous frames with the gbuffer motion and blends it with the current frame.
+// The history is filtered bilinearly from the texels that saw the same surface, without any it restarts.
+void main() {
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	vec3 current = texelFetch(IntermediateBuffer, pixel, 0).rgb;
+	float depthFromBuffer = texelFetch(GBufferDepth, pixel, 0).r;
+	if(depthFromBuffer >= 1.0) {
+		// The background has no history, a depth of 0 never matches.
+		OUT_Color = vec4(current, 1.0);
+		OUT_Geometry = vec4(0.0);
+		return;
+	}
+
+	vec4 position = vec4(GetWorldPosition(INOUT_TextureCoords, depthFromBuffer, CameraInvViewProjection), 1.0);
+	vec2 encodedNormal = texelFetch(GBufferNormal, pixel, 0).rg;
+	vec3 normal = decodeNormal(encodedNormal);
+	float depth = (position * CameraViewProjection).w;
+	OUT_Geometry = vec4(depth, encodedNormal, 0.0);
+
+	vec4 history = vec4(0.0);
+	float historyWeight = 0.0;
+	if(TemporalHistoryValid != 0) {
+		float expectedDepth = (position * CameraViewProjectionOld).w;
+		vec2 historyPosition = (INOUT_TextureCoords + texelFetch(GBufferMotion, pixel, 0).xy) * vec2(RenderingSizeOld) - 0.5;
+		ivec2 historyPixel = ivec2(floor(historyPosition));
+		vec2 bilinear = fract(historyPosition);
+		for(int i = 0; i < 4; ++i) {
+			ivec2 offset = ivec2(i & 1, i >> 1);
+			ivec2 samplePixel = historyPixel + offset;
+			if(any(lessThan(samplePixel, ivec2(0))) || any(greaterThanEqual(samplePixel, RenderingSizeOld))) {
+				continue;
+			}
+			if(!IsSameSurface(expectedDepth, normal, texelFetch(TemporalGeometryHistory, samplePixel, 0))) {
+				continue;
+			}
+			vec2 weights = mix(1.0 - bilinear, bilinear, vec2(offset));
+			float weight = weights.x * weights.y;
+			history += texelFetch(TemporalHistory, samplePixel, 0) * weight;
+			historyWeight += weight;
+		}
+	}
+
+	if(historyWeight < 0.01) {
+		// Disoccluded, the pixel starts over with the current frame.
+		OUT_Color = vec4(current, 1.0);
+		return;
+	}
+
+	// New histories converge fast with the exact mean and long ones keep a fixed share of the current frame.
+	history /= historyWeight;
+	float historyLength = min(history.a + 1.0, float(TemporalMaxHistory));
+	OUT_Color = vec4(mix(history.rgb, current, 1.0 / historyLength), historyLength);
+}
@@ -0,0 +1,67 @@
+// Lighting of the tiles of one class, the including kernel defines LIGHTING_TILE_CLASS.
+#include "base.h"
+#include "random.h"
+#include "raytrace.h"
+#include "light_tree.h"
+#include "sample_variance.h"
+#include "lighting.h"
+#include "tiles.h"
+
+layout(local_size_x = LIGHTING_TILE_SIZE, local_size_y = LIGHTING_TILE_SIZE) in;
+
+layout(rgba16f, binding = 0) writeonly uniform image2D LightingImage;
+layout(rgba32i, binding = 1) writeonly uniform iimage2D ShadowOccluderImage;
+layout(rgba16f, binding = 2) writeonly uniform image2D SampleVarianceImage;
+uniform vec2 RenderingScale;
+uniform ivec2 RenderingSize;
+
+
+// Shades the pixels of a tile like pbr.frag, but only with the parts of ShadePoint that the class of the tile needs.
+void main() {
+	uint tile = TileLists[GetTileListIndex(uint(LIGHTING_TILE_CLASS), gl_WorkGroupID.x)];
+	ivec2 pixel = ivec2(tile & 0xFFFFu, tile >> 16) * LIGHTING_TILE_SIZE + ivec2(gl_LocalInvocationID.xy);
+	if(pixel.x >= RenderingSize.x || pixel.y >= RenderingSize.y) {
+		return;
+	}
+	vec2 screenCoord = (vec2(pixel) + 0.5) / vec2(RenderingSize);
+	vec2 texCoord = screenCoord * RenderingScale;
+
+#if LIGHTING_TILE_CLASS != LIGHTING_TILE_CLASS_BACKGROUND
+	if(!IsBackgroundPixel(texCoord)) {
+		SurfacePoint point;
+		GetGBufferSurfacePoint(screenCoord, texCoord, point);
+
+		vec3 viewVec = normalize(CameraPosition - point.Position);
+		ivec4 shadowOccluders = texelFetch(ShadowOccluderCache, pixel, 0);
+		int sampleCount = GetAdaptiveSampleCount(pixel);
+		vec3 radiance = vec3(0.0);
+		for(int i = 0; i < sampleCount; ++i) {
+			PixelSample = uint(i);
+			ShadingResult result = ShadePointDirect(point, viewVec, pixel, shadowOccluders);
+			// With a reduced secondary ray resolution the reflections and refractions are traced by a separate pass.
+			if(SecondaryRayMode == SECONDARY_RAYS_FULL) {
+		#if LIGHTING_TILE_CLASS == LIGHTING_TILE_CLASS_GLOSSY || LIGHTING_TILE_CLASS == LIGHTING_TILE_CLASS_TRANSPARENT
+				AddReflections(point, viewVec, pixel, result);
+		#endif
+		#if LIGHTING_TILE_CLASS == LIGHTING_TILE_CLASS_TRANSPARENT
+				AddRefractions(point, viewVec, pixel, result);
+		#endif
+			}
+
+			// Add some ambient.
+			result.Diffuse += GetDiffuseColor(point) * AmbientLight;
+			radiance += result.Diffuse + result.Specular;
+		}
+		radiance /= float(sampleCount);
+
+		imageStore(LightingImage, pixel, vec4(radiance, 1.0));
+		imageStore(ShadowOccluderImage, pixel, shadowOccluders);
+		imageStore(SampleVarianceImage, pixel, vec4(UpdateSampleVariance(pixel, radiance, sampleCount), 0.0));
+		return;
+	}
+#endif
+
+	imageStore(LightingImage, pixel, vec4(0.0, 0.0, 0.0, 1.0));
+	imageStore(ShadowOccluderImage, pixel, ivec4(-1));
+	imageStore(SampleVarianceImage, pixel, vec4(0.0));
+}
@@ -0,0 +1,21 @@
+// Tile lists of the tiled lighting kernels. tiled_classify.comp appends every tile to the list of its class
+// and counts it in the indirect dispatch of that class. Tiles are stored as x | (y << 16).
+layout(std430, binding = 0) buffer LightingTileDispatchBuffer {
+	RendererTileDispatch TileDispatches[LIGHTING_TILE_CLASS_COUNT];
+};
+
+layout(std430, binding = 1) buffer LightingTileListBuffer {
+	uint TileLists[];
+};
+
+// Number of tiles every class list has room for.
+uniform int TileListCapacity;
+
+uint GetTileListIndex(uint tileClass, uint index) {
+	return tileClass * uint(TileListCapacity) + index;
+}
+
+// Pixels with the cleared depth show no geometry.
+bool IsBackgroundPixel(vec2 texCoord) {
+	return textureLod(GBufferDepth, texCoord, 0).r >= 1.0;
+}
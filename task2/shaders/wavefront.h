@@ -0,0 +1,44 @@
+// Ray queues of the wavefront lighting kernels. Kernels append rays to the emitted queue and count them
+// per bin, wavefront_bin.comp and wavefront_scatter.comp then sort them by bin into the sorted queue.
+layout(std430, binding = 0) buffer WavefrontCounterBuffer {
+	RendererWavefrontCounters Counters;
+};
+
+layout(std430, binding = 1) buffer WavefrontEmittedRayBuffer {
+	RendererWavefrontRay EmittedRays[];
+};
+
+layout(std430, binding = 2) buffer WavefrontSortedRayBuffer {
+	RendererWavefrontRay SortedRays[];
+};
+
+// Three entries per pixel: direct lighting, reflections and refractions. Only one ray
+// per pixel and entry is alive at a time, so no atomics are needed to accumulate them.
+layout(std430, binding = 3) buffer WavefrontRadianceBuffer {
+	vec4 PathRadiance[];
+};
+
+#define WAVEFRONT_RADIANCE_DIRECT 0u
+#define WAVEFRONT_RADIANCE_REFLECTION 1u
+#define WAVEFRONT_RADIANCE_REFRACTION 2u
+
+// Rays are traced towards a target like CastSurfaceRay does, which keeps both lighting paths bit identical.
+vec3 GetWavefrontRayVector(RendererWavefrontRay ray) {
+	return (ray.Origin + ray.Direction * 40.0) - ray.Origin;
+}
+
+// Rays that are about to be traced are binned by direction octant so that a group traverses similar nodes.
+uint GetWavefrontDirectionBin(vec3 direction) {
+	return (direction.x < 0.0 ? 1u : 0u) | (direction.y < 0.0 ? 2u : 0u) | (direction.z < 0.0 ? 4u : 0u);
+}
+
+// Hits that are about to be shaded are binned by material so that a group evaluates the same material.
+uint GetWavefrontMaterialBin(uint materialIndex) {
+	return materialIndex % uint(WAVEFRONT_BIN_COUNT);
+}
+
+void EmitWavefrontRay(RendererWavefrontRay ray) {
+	uint index = atomicAdd(Counters.EmittedRayCount, 1u);
+	atomicAdd(Counters.BinCounts[ray.Bin], 1u);
+	EmittedRays[index] = ray;
+}
@@ -0,0 +1,39 @@
+// Emission of reflection and refraction rays, needs lighting.h and wavefront.h.
+void EmitWavefrontBounce(vec3 origin, vec3 direction, uint pixelIndex, uint flags, float throughput, float weight) {
+	RendererWavefrontRay ray;
+	ray.Origin = origin;
+	ray.PixelIndex = pixelIndex;
+	ray.Direction = direction;
+	ray.Flags = flags;
+	ray.HitBarycentrics = vec2(0.0);
+	ray.HitT = 0.0;
+	ray.HitTriangle = -1;
+	ray.Padding0 = 0u;
+	ray.Bin = GetWavefrontDirectionBin(direction);
+	ray.Throughput = throughput;
+	ray.Weight = weight;
+	EmitWavefrontRay(ray);
+}
+
+// Emits the next reflection ray of a path, the counterpart of one iteration of the reflection loop in ShadePoint.
+// The throughput and weight continue the ones of the path like the variables of the loop, the random numbers
+// come from the same bounce sampler.
+void EmitWavefrontReflection(SurfacePoint point, vec3 viewDirection, ivec2 pixel, uint pixelIndex, uint bounce, float throughput, float weight) {
+	if(bounce < uint(RENDERING_MAX_RECURSIONS) && ContinuesReflection(point)) {
+		Sampler rng = GetBounceSampler(pixel, false, int(bounce));
+		if(ContinuesPath(int(bounce), GetReflectance(point), throughput, weight, rng)) {
+			vec3 direction = GetReflectionDirection(point, viewDirection, rng);
+			EmitWavefrontBounce(GetReflectionOrigin(point), direction, pixelIndex, bounce << 1, throughput, weight);
+		}
+	}
+}
+
+void EmitWavefrontRefraction(SurfacePoint point, vec3 viewDirection, ivec2 pixel, uint pixelIndex, uint bounce, float throughput, float weight) {
+	if(bounce < uint(RENDERING_MAX_REFRACTIONS) && ContinuesRefraction(point)) {
+		Sampler rng = GetBounceSampler(pixel, true, int(bounce));
+		if(ContinuesPath(int(bounce), GetTransmittance(point), throughput, weight, rng)) {
+			vec3 direction = GetRefractionDirection(point, viewDirection);
+			EmitWavefrontBounce(GetRefractionOrigin(point), direction, pixelIndex, (bounce << 1) | uint(WAVEFRONT_RAY_REFRACTION), throughput, weight);
+		}
+	}
+}
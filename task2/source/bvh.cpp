@@ -1,16 +1,20 @@
+// World space vertex shared by all triangles of a mesh instance.
+struct BVHVertex {
+    glm::vec3 Position;
+    uint32_t TexCoord;
+};
+
+// Triangle as stored in the flattened BVH, indexing into the shared vertex pool.
+struct BVHTriangle {
+    uint32_t Indices[3];
+    uint32_t MaterialIndex;
+};
+
+// Triangle with its bounds, only needed while building.
 struct BVHBuildTriangle {
     glm::vec3 Min;
     glm::vec3 Max;
-
-    glm::vec3 A;
-    glm::vec3 B;
-    glm::vec3 C;
-
-    uint32_t TexCoordA;
-    uint32_t TexCoordB;
-    uint32_t TexCoordC;
-
-    uint32_t MaterialIndex;
+    BVHTriangle Triangle;
 };
 
 struct BVHBuildNode {
@@ -19,6 +23,9 @@ struct BVHBuildNode {
     std::vector<BVHBuildTriangle>* Triangles;
     std::vector<BVHBuildNode*> Nodes;
     float Cost;
+    int SplitAxis;
+    // Key of the random split stream of the node when BVH_USE_RANDOM is set, see CPURandom.
+    uint32_t RandomKey;
 
     bool Intersects(glm::vec3 minA, glm::vec3 maxA, glm::vec3 minB, glm::vec3 maxB) {
         if (minA.x > maxB.x || minA.y > maxB.y || minA.z > maxB.z) return false;
@@ -30,6 +37,8 @@ struct BVHBuildNode {
         Min = glm::vec3(FLT_MAX, FLT_MAX, FLT_MAX);
         Max = glm::vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
         Triangles = new std::vector<BVHBuildTriangle>();
+        SplitAxis = 0;
+        RandomKey = 0;
     }
 
     void ComputeCost() {
@@ -53,6 +62,9 @@ struct BVHBuildNode {
         }
         float splitAlpha[BVH_MAX_CHILD_NODES];
         float bestCost = FLT_MAX;
+        #if BVH_USE_RANDOM
+        CPURandom random(RandomKey, 0);
+        #endif
         for (int axis = 0; axis < 3; ++axis) {
             const int maxSplits = 10;
             for (int split = 1; split < maxSplits; ++split) {
@@ -60,7 +72,7 @@ struct BVHBuildNode {
                 #if BVH_USE_RANDOM
                 // Compute random splits.
                 for (int c = 0; c < BVH_MAX_CHILD_NODES - 1; ++c) {
-                    splitAlpha[c] = glm::linearRand(0.0f, 0.99f);
+                    splitAlpha[c] = random.NextFloat() * 0.99f;
                 }
 
                 // Sort splits.
@@ -106,6 +118,7 @@ struct BVHBuildNode {
 
                 if (costOverall < bestCost) {
                     bestCost = costOverall;
+                    SplitAxis = axis;
                     for (int c = 0; c < BVH_MAX_CHILD_NODES; ++c) {
                         BVHBuildNode* newCandidate = 0;
                         if (children[c]) {
@@ -123,6 +136,8 @@ struct BVHBuildNode {
 
         // No improvement, randomly split.
         if (bestCost > Cost) {
+            // Children are not ordered along an axis, the longest one is the best guess for traversal order.
+            SplitAxis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
             for (int c = 0; c < BVH_MAX_CHILD_NODES; ++c) {
                 candidates[c]->Triangles->clear();
             }
@@ -157,6 +172,10 @@ struct BVHBuildNode {
         }
 
         for (int c = 0; c < BVH_MAX_CHILD_NODES; ++c) {
+            #if BVH_USE_RANDOM
+            // The streams of the children derive from the one of the parent, so the splits don't depend on the order the nodes are built in.
+            children[c]->RandomKey = CPURandom(RandomKey, 1).GetUInt((uint32_t)c);
+            #endif
             if (children[c]->Triangles && children[c]->Triangles->size() > BVH_MAX_TRIANGLES_PER_NODE) {
                 children[c]->Split();
             }
@@ -199,6 +218,15 @@ struct BVHBuildNode {
         }
     }
 
+    // Frees the leaf triangles once they have been copied into the flattened BVH.
+    void ReleaseTriangles() {
+        delete Triangles;
+        Triangles = 0;
+        for (int i = 0; i < Nodes.size(); ++i) {
+            Nodes[i]->ReleaseTriangles();
+        }
+    }
+
     ~BVHBuildNode() {
         for (int i = 0; i < Nodes.size(); ++i) {
             delete Nodes[i];
@@ -217,6 +245,182 @@ struct BVHBuildNode {
 
 };
 
+// Ray with the per-ray constants of the watertight ray/triangle test precomputed.
+// See Woop, Benthin, Wald: "Watertight Ray/Triangle Intersection" (JCGT 2013).
+struct BVHRay {
+    glm::vec3 Origin;
+    glm::vec3 Direction;
+    glm::vec3 InvDirection;
+    float MaxDistance;
+
+    // Permuted axes so that the largest direction component becomes z.
+    int AxisX;
+    int AxisY;
+    int AxisZ;
+    glm::vec3 Shear;
+
+    BVHRay(glm::vec3 origin, glm::vec3 direction, float maxDistance = FLT_MAX) {
+        Origin = origin;
+        Direction = direction;
+        InvDirection = 1.0f / direction;
+        MaxDistance = maxDistance;
+
+        glm::vec3 absDirection = glm::abs(direction);
+        AxisZ = 0;
+        if (absDirection.y > absDirection[AxisZ]) AxisZ = 1;
+        if (absDirection.z > absDirection[AxisZ]) AxisZ = 2;
+        AxisX = (AxisZ + 1) % 3;
+        AxisY = (AxisX + 1) % 3;
+
+        // Swap x and y to preserve the winding direction of triangles.
+        if (direction[AxisZ] < 0.0f) {
+            int swap = AxisX;
+            AxisX = AxisY;
+            AxisY = swap;
+        }
+
+        Shear.x = direction[AxisX] / direction[AxisZ];
+        Shear.y = direction[AxisY] / direction[AxisZ];
+        Shear.z = 1.0f / direction[AxisZ];
+    }
+};
+
+struct BVHHit {
+    float Distance;
+    float U;
+    float V;
+    uint32_t TriangleIndex;
+};
+
+// Affine transform that maps a triangle onto the unit triangle (0,0,0), (1,0,0), (0,1,0).
+// Trades 48 bytes per triangle for a cheaper test, see Baldwin, Weber: "Fast Ray-Triangle
+// Intersections by Coordinate Transformation" (JCGT 2016). The test is not watertight.
+struct BVHTriangleTransform {
+    glm::vec4 Rows[3];
+};
+
+BVHTriangleTransform ComputeTriangleTransform(glm::vec3 a, glm::vec3 b, glm::vec3 c) {
+    glm::vec3 e1 = b - a;
+    glm::vec3 e2 = c - a;
+    glm::vec3 n = glm::abs(glm::cross(e1, e2));
+
+    // The third basis vector is the axis of the largest normal component so it never lies in the plane.
+    glm::vec3 axis = glm::vec3(0, 0, 1);
+    if (n.x > n.y && n.x > n.z) {
+        axis = glm::vec3(1, 0, 0);
+    } else if (n.y > n.z) {
+        axis = glm::vec3(0, 1, 0);
+    }
+
+    BVHTriangleTransform transform;
+    glm::mat3 basis = glm::mat3(e1, e2, axis);
+    if (glm::abs(glm::determinant(basis)) < FLT_MIN) {
+        // Degenerate triangle, make the plane test always fail.
+        transform.Rows[0] = glm::vec4(0, 0, 0, -1);
+        transform.Rows[1] = glm::vec4(0, 0, 0, -1);
+        transform.Rows[2] = glm::vec4(0, 0, 0, 1);
+        return transform;
+    }
+
+    glm::mat3 inverse = glm::inverse(basis);
+    glm::vec3 translation = -(inverse * a);
+    for (int row = 0; row < 3; ++row) {
+        transform.Rows[row] = glm::vec4(inverse[0][row], inverse[1][row], inverse[2][row], translation[row]);
+    }
+    return transform;
+}
+
+bool IntersectTriangleTransformed(const BVHRay& ray, const BVHTriangleTransform& transform, float maxDistance, float* distance, float* u, float* v) {
+    glm::vec4 origin = glm::vec4(ray.Origin, 1.0f);
+    glm::vec4 direction = glm::vec4(ray.Direction, 0.0f);
+
+    float originZ = glm::dot(transform.Rows[2], origin);
+    float directionZ = glm::dot(transform.Rows[2], direction);
+    float t = -originZ / directionZ;
+    if (!(t >= 0.0f && t <= maxDistance)) {
+        return false;
+    }
+
+    float hitU = glm::dot(transform.Rows[0], origin) + t * glm::dot(transform.Rows[0], direction);
+    float hitV = glm::dot(transform.Rows[1], origin) + t * glm::dot(transform.Rows[1], direction);
+    if (hitU < 0.0f || hitV < 0.0f || hitU + hitV > 1.0f) {
+        return false;
+    }
+
+    *distance = t;
+    *u = hitU;
+    *v = hitV;
+    return true;
+}
+
+bool IntersectTriangleWatertight(const BVHRay& ray, glm::vec3 a, glm::vec3 b, glm::vec3 c, float maxDistance, float* distance, float* u, float* v) {
+    const int kx = ray.AxisX;
+    const int ky = ray.AxisY;
+    const int kz = ray.AxisZ;
+
+    glm::vec3 A = a - ray.Origin;
+    glm::vec3 B = b - ray.Origin;
+    glm::vec3 C = c - ray.Origin;
+
+    // Shear the vertices into ray space.
+    float ax = A[kx] - ray.Shear.x * A[kz];
+    float ay = A[ky] - ray.Shear.y * A[kz];
+    float bx = B[kx] - ray.Shear.x * B[kz];
+    float by = B[ky] - ray.Shear.y * B[kz];
+    float cx = C[kx] - ray.Shear.x * C[kz];
+    float cy = C[ky] - ray.Shear.y * C[kz];
+
+    // Scaled barycentric coordinates as 2D edge functions.
+    float U = cx * by - cy * bx;
+    float V = ax * cy - ay * cx;
+    float W = bx * ay - by * ax;
+
+    // Fall back to double precision when the ray passes exactly through an edge.
+    if (U == 0.0f || V == 0.0f || W == 0.0f) {
+        U = (float)((double)cx * (double)by - (double)cy * (double)bx);
+        V = (float)((double)ax * (double)cy - (double)ay * (double)cx);
+        W = (float)((double)bx * (double)ay - (double)by * (double)ax);
+    }
+
+    if ((U < 0.0f || V < 0.0f || W < 0.0f) && (U > 0.0f || V > 0.0f || W > 0.0f)) {
+        return false;
+    }
+
+    float det = U + V + W;
+    if (det == 0.0f) {
+        return false;
+    }
+
+    float az = ray.Shear.z * A[kz];
+    float bz = ray.Shear.z * B[kz];
+    float cz = ray.Shear.z * C[kz];
+    float T = U * az + V * bz + W * cz;
+
+    // Depth test without dividing by the determinant.
+    float detSign = det < 0.0f ? -1.0f : 1.0f;
+    if (T * detSign < 0.0f || T * detSign > maxDistance * det * detSign) {
+        return false;
+    }
+
+    float invDet = 1.0f / det;
+    *distance = T * invDet;
+    *u = V * invDet;
+    *v = W * invDet;
+    return true;
+}
+
+bool IntersectAABB(const BVHRay& ray, glm::vec3 aabbMin, glm::vec3 aabbMax, float maxDistance, float* entryDistance) {
+    glm::vec3 t0 = (aabbMin - ray.Origin) * ray.InvDirection;
+    glm::vec3 t1 = (aabbMax - ray.Origin) * ray.InvDirection;
+    glm::vec3 tNear = glm::min(t0, t1);
+    glm::vec3 tFar = glm::max(t0, t1);
+    float entry = glm::max(glm::max(tNear.x, tNear.y), glm::max(tNear.z, 0.0f));
+    float exit = glm::min(glm::min(tFar.x, tFar.y), glm::min(tFar.z, maxDistance));
+
+    *entryDistance = entry;
+    return entry <= exit;
+}
+
 struct IterativeNode {
     size_t childrenStart;
     size_t childCount;
@@ -224,15 +428,35 @@ struct IterativeNode {
     size_t triangleStart;
     glm::vec3 aabbMin;
     glm::vec3 aabbMax;
+    // The first child lies on the lower side of this axis.
+    int splitAxis;
+    // Next node in depth-first order after this subtree, 0 ends the traversal.
+    size_t skipIndex;
 };
 
+struct BVHTraversalStats {
+    uint64_t VisitedNodes = 0;
+    uint64_t TestedTriangles = 0;
+    uint64_t Rays = 0;
+};
+
+// Decides whether a triangle hit blocks the ray, like the IsTriangleOpaque test in RayHitsBVHTriangle on the GPU.
+// The traversal ignores rejected hits and keeps looking behind them.
+typedef bool (*BVHHitFilter)(const BVHHit& hit, void* context);
+
 struct IterativeBVH {
     std::vector<IterativeNode> nodes;
-    std::vector<BVHBuildTriangle*> triangles;
+    std::vector<BVHVertex> vertices;
+    std::vector<BVHTriangle> triangles;
+    std::vector<BVHTriangleTransform> triangleTransforms;
+    size_t maxDepth;
 
     IterativeBVH() {
+        maxDepth = 0;
         nodes = std::vector<IterativeNode>();
-        triangles = std::vector<BVHBuildTriangle*>();
+        vertices = std::vector<BVHVertex>();
+        triangles = std::vector<BVHTriangle>();
+        triangleTransforms = std::vector<BVHTriangleTransform>();
     }
 
     void flatten(BVHBuildNode* root) {
@@ -244,12 +468,176 @@ struct IterativeBVH {
         nodes.resize(root->GetNodeCount());
         triangles.reserve(root->GetTriangleCount());
         size_t offset = 0;
+        maxDepth = 0;
         convertBvhToIterative(root, &offset);
+
+        #if BVH_PRECOMPUTE_TRIANGLE_TRANSFORMS
+        triangleTransforms.resize(triangles.size());
+        for (size_t i = 0; i < triangles.size(); ++i) {
+            triangleTransforms[i] = ComputeTriangleTransform(vertices[triangles[i].Indices[0]].Position,
+                                                             vertices[triangles[i].Indices[1]].Position,
+                                                             vertices[triangles[i].Indices[2]].Position);
+        }
+        #endif
+    }
+
+    // Bytes used by the vertex pool, triangles and optional transforms.
+    size_t getPrimitiveMemory() {
+        return vertices.size() * sizeof(BVHVertex) + triangles.size() * sizeof(BVHTriangle) + triangleTransforms.size() * sizeof(BVHTriangleTransform);
+    }
+
+    bool intersectTriangle(const BVHRay& ray, size_t triangleIndex, float maxDistance, BVHHit* hit, BVHHitFilter filter, void* filterContext) {
+        float distance, u, v;
+        #if BVH_PRECOMPUTE_TRIANGLE_TRANSFORMS
+        bool hasHit = IntersectTriangleTransformed(ray, triangleTransforms[triangleIndex], maxDistance, &distance, &u, &v);
+        #else
+        const BVHTriangle& triangle = triangles[triangleIndex];
+        bool hasHit = IntersectTriangleWatertight(ray, vertices[triangle.Indices[0]].Position, vertices[triangle.Indices[1]].Position,
+                                                  vertices[triangle.Indices[2]].Position, maxDistance, &distance, &u, &v);
+        #endif
+        if (!hasHit) {
+            return false;
+        }
+
+        BVHHit candidate;
+        candidate.Distance = distance;
+        candidate.U = u;
+        candidate.V = v;
+        candidate.TriangleIndex = (uint32_t)triangleIndex;
+        if (filter && !filter(candidate, filterContext)) {
+            return false;
+        }
+        *hit = candidate;
+        return true;
+    }
+
+    // Stackless traversal following the skip links, mirrors the BVH_STACKLESS_TRAVERSAL path in raytrace.h.
+    // Children are always visited in memory order, so closest-hit rays visit more nodes than castRay.
+    bool castRayStackless(const BVHRay& ray, BVHHit* hit, bool anyHit = false, BVHTraversalStats* stats = 0, BVHHitFilter filter = 0, void* filterContext = 0) {
+        if (nodes.empty()) {
+            return false;
+        }
+
+        bool hasHit = false;
+        float closestDistance = ray.MaxDistance;
+        uint64_t visitedNodes = 0;
+        uint64_t testedTriangles = 0;
+        size_t nodeIndex = 0;
+        do {
+            const IterativeNode& node = nodes[nodeIndex];
+            ++visitedNodes;
+            size_t nextIndex = node.skipIndex;
+
+            float entryDistance;
+            if (IntersectAABB(ray, node.aabbMin, node.aabbMax, closestDistance, &entryDistance)) {
+                if (node.childCount == 0) {
+                    for (size_t i = node.triangleStart; i < node.triangleStart + node.triangleCount; ++i) {
+                        ++testedTriangles;
+                        if (intersectTriangle(ray, i, closestDistance, hit, filter, filterContext)) {
+                            hasHit = true;
+                            closestDistance = hit->Distance;
+                            if (anyHit) {
+                                nextIndex = 0;
+                                break;
+                            }
+                        }
+                    }
+                } else {
+                    nextIndex = nodeIndex + 1;
+                }
+            }
+            nodeIndex = nextIndex;
+        } while (nodeIndex != 0);
+
+        if (stats) {
+            stats->VisitedNodes += visitedNodes;
+            stats->TestedTriangles += testedTriangles;
+            stats->Rays++;
+        }
+        return hasHit;
+    }
+
+    // Finds the closest hit along the ray, or any hit if anyHit is set (for visibility rays). Hits rejected by the
+    // optional filter do not count. Children are visited front to back based on the split axis and the ray direction sign,
+    // the far child is skipped if its entry distance is behind the closest hit found so far.
+    bool castRay(const BVHRay& ray, BVHHit* hit, bool anyHit = false, bool ordered = true, BVHTraversalStats* stats = 0,
+                 BVHHitFilter filter = 0, void* filterContext = 0) {
+        float rootEntry;
+        if (nodes.empty() || !IntersectAABB(ray, nodes[0].aabbMin, nodes[0].aabbMax, ray.MaxDistance, &rootEntry)) {
+            return false;
+        }
+
+        size_t stack[BVH_MAX_STACK_SIZE];
+        float stackEntry[BVH_MAX_STACK_SIZE];
+        int stackSize = 0;
+        stack[stackSize] = 0;
+        stackEntry[stackSize++] = rootEntry;
+
+        bool hasHit = false;
+        float closestDistance = ray.MaxDistance;
+        uint64_t visitedNodes = 0;
+        uint64_t testedTriangles = 0;
+        while (stackSize > 0) {
+            --stackSize;
+            if (stackEntry[stackSize] > closestDistance) {
+                continue;
+            }
+            size_t nodeIndex = stack[stackSize];
+            const IterativeNode& node = nodes[nodeIndex];
+            ++visitedNodes;
+
+            if (node.childCount == 0) {
+                for (size_t i = node.triangleStart; i < node.triangleStart + node.triangleCount; ++i) {
+                    ++testedTriangles;
+                    if (intersectTriangle(ray, i, closestDistance, hit, filter, filterContext)) {
+                        hasHit = true;
+                        closestDistance = hit->Distance;
+                        if (anyHit) {
+                            stackSize = 0;
+                            break;
+                        }
+                    }
+                }
+                continue;
+            }
+
+            size_t nearChild = nodeIndex + 1;
+            size_t farChild = node.childrenStart;
+            if (ordered && ray.Direction[node.splitAxis] < 0.0f) {
+                nearChild = node.childrenStart;
+                farChild = nodeIndex + 1;
+            }
+
+            // Push the far child first so the near child is popped first.
+            float nearEntry, farEntry;
+            bool hitsNear = IntersectAABB(ray, nodes[nearChild].aabbMin, nodes[nearChild].aabbMax, closestDistance, &nearEntry);
+            bool hitsFar = IntersectAABB(ray, nodes[farChild].aabbMin, nodes[farChild].aabbMax, closestDistance, &farEntry);
+            // Deeper trees than the stack holds restart with the stackless walk, like TraceBVH in raytrace.h.
+            if (stackSize + (int)hitsFar + (int)hitsNear > BVH_MAX_STACK_SIZE) {
+                return castRayStackless(ray, hit, anyHit, stats, filter, filterContext);
+            }
+            if (hitsFar) {
+                stack[stackSize] = farChild;
+                stackEntry[stackSize++] = farEntry;
+            }
+            if (hitsNear) {
+                stack[stackSize] = nearChild;
+                stackEntry[stackSize++] = nearEntry;
+            }
+        }
+
+        if (stats) {
+            stats->VisitedNodes += visitedNodes;
+            stats->TestedTriangles += testedTriangles;
+            stats->Rays++;
+        }
+        return hasHit;
     }
 
-    size_t convertBvhToIterative(const BVHBuildNode* bvhNode, size_t* offset) {
+    size_t convertBvhToIterative(const BVHBuildNode* bvhNode, size_t* offset, size_t depth = 0) {
         auto currentNode = &nodes[*offset];
         auto oldOffset = (*offset)++;
+        maxDepth = glm::max(maxDepth, depth);
 
         if (bvhNode == nullptr) {
             return oldOffset;
@@ -260,46 +648,78 @@ struct IterativeBVH {
         currentNode->childCount = bvhNode->Nodes.size();
         currentNode->triangleCount = bvhNode->Triangles ? bvhNode->Triangles->size() : 0;
         currentNode->triangleStart = triangles.size();
+        currentNode->splitAxis = bvhNode->SplitAxis;
 
         if (bvhNode->Triangles) {
             for (uint32_t i = 0; i < bvhNode->Triangles->size(); ++i) {
-                triangles.push_back(&bvhNode->Triangles->at(i));
+                triangles.push_back(bvhNode->Triangles->at(i).Triangle);
             }
-            return oldOffset;
+        } else {
+            convertBvhToIterative(bvhNode->Nodes[0], offset, depth + 1);
+            currentNode->childrenStart = convertBvhToIterative(bvhNode->Nodes[1], offset, depth + 1);
         }
 
-        convertBvhToIterative(bvhNode->Nodes[0], offset);
-        currentNode->childrenStart = convertBvhToIterative(bvhNode->Nodes[1], offset);
+        // Nodes are stored in depth-first order, so the subtree ends right before the next free slot.
+        currentNode->skipIndex = *offset < nodes.size() ? *offset : 0;
         return oldOffset;
     }
 };
 
+// GPU leaf nodes pack the triangle count into the upper 8 bits of RendererBVHNode::Data.
+#if BVH_MAX_TRIANGLES_PER_NODE > 255
+#error "BVH_MAX_TRIANGLES_PER_NODE does not fit into the GPU node layout."
+#endif
+
 struct BVH {
     BVHBuildNode* BVHRoot;
+    IterativeBVH FlatBVH;
     uint32_t SceneTriangleCount;
     uint32_t BVHNodeCount;
 
+    uint32_t NodeBuffer = 0;
+    uint32_t NodeBufferTexture = 0;
+    uint32_t VertexBuffer = 0;
+    uint32_t VertexBufferTexture = 0;
+    uint32_t TriangleBuffer = 0;
+    uint32_t TriangleBufferTexture = 0;
+    uint32_t TriangleTransformBuffer = 0;
+    uint32_t TriangleTransformBufferTexture = 0;
+
+    // Alias table over the emissive triangles weighted by their emitted power, the lighting samples them as
+    // area lights (see SampleEmissiveTriangle in raytrace.h).
+    std::vector<RendererEmissiveTriangle> EmissiveTriangles;
+    float EmissivePower = 0.0f;
+    uint32_t EmissiveTriangleBuffer = 0;
+    uint32_t EmissiveTriangleBufferTexture = 0;
+
     BVH() {}
 
-    void AddTrianglesToRoot(Node* node) {
+    void AddTrianglesToRoot(Scene* scene, Node* node) {
         if (node->LinkedMesh) {
             Mesh* mesh = node->LinkedMesh;
             glm::mat4 transform = node->WorldMatrix;
 
+            // Every instance gets its own pre-transformed copy of the mesh vertices.
+            uint32_t vertexOffset = (uint32_t)FlatBVH.vertices.size();
+            for (size_t v = 0; v < mesh->Vertices.size(); ++v) {
+                BVHVertex vertex;
+                vertex.Position = glm::vec3(transform * glm::vec4(mesh->Vertices[v].Position, 1));
+                vertex.TexCoord = glm::packHalf2x16(mesh->Vertices[v].TextureCoordinates);
+                FlatBVH.vertices.push_back(vertex);
+            }
+
             for (int g = 0; g < mesh->Groups.size(); ++g) {
                 Group group = mesh->Groups[g];
                 for (uint32_t i = group.IndexStart; i < group.IndexStart + group.IndexCount; i += 3) {
-                    uint32_t i0 = mesh->Indices[i + 0];
-                    uint32_t i1 = mesh->Indices[i + 1];
-                    uint32_t i2 = mesh->Indices[i + 2];
-
-                    Vertex v0 = mesh->Vertices[i0];
-                    Vertex v1 = mesh->Vertices[i1];
-                    Vertex v2 = mesh->Vertices[i2];
-
                     BVHBuildTriangle bvhTriangle;
-                    bvhTriangle.MaterialIndex = group.MaterialIndex;
-                    buildTriangle(&bvhTriangle, transform, v0, v1, v2);
+                    bvhTriangle.Triangle.Indices[0] = vertexOffset + mesh->Indices[i + 0];
+                    bvhTriangle.Triangle.Indices[1] = vertexOffset + mesh->Indices[i + 1];
+                    bvhTriangle.Triangle.Indices[2] = vertexOffset + mesh->Indices[i + 2];
+                    bvhTriangle.Triangle.MaterialIndex = group.MaterialIndex != -1 ? group.MaterialIndex : 0;
+                    buildTriangle(&bvhTriangle);
+                    if (bvhTriangle.Triangle.MaterialIndex < scene->Materials.size()) {
+                        addEmissiveTriangle(bvhTriangle.Triangle, scene->Materials[bvhTriangle.Triangle.MaterialIndex]);
+                    }
                     BVHRoot->Min = glm::min(BVHRoot->Min, bvhTriangle.Min);
                     BVHRoot->Max = glm::max(BVHRoot->Max, bvhTriangle.Max);
                     BVHRoot->Triangles->push_back(bvhTriangle);
@@ -307,32 +727,97 @@ struct BVH {
             }
         }
         for (size_t i = 0; i < node->Children.size(); i++) {
-            AddTrianglesToRoot(node->Children[i]);
+            AddTrianglesToRoot(scene, node->Children[i]);
         }
     }
 
-    void buildTriangle(BVHBuildTriangle* bvhTriangle, glm::mat4 transform, Vertex v0, Vertex v1, Vertex v2) {
-        bvhTriangle->A = glm::vec3(transform * glm::vec4(v0.Position, 1));
-        bvhTriangle->B = glm::vec3(transform * glm::vec4(v1.Position, 1));
-        bvhTriangle->C = glm::vec3(transform * glm::vec4(v2.Position, 1));
+    // Keeps the power of the triangle in Probability until buildEmissiveAliasTable normalizes it. The emissive map
+    // is not part of the power, the factor bounds what the map can emit.
+    void addEmissiveTriangle(const BVHTriangle& triangle, const RendererMaterial& material) {
+        float luminance = glm::dot(material.EmissiveFactor, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+        if (luminance <= 0.0f) {
+            return;
+        }
+
+        glm::vec3 a = FlatBVH.vertices[triangle.Indices[0]].Position;
+        glm::vec3 b = FlatBVH.vertices[triangle.Indices[1]].Position;
+        glm::vec3 c = FlatBVH.vertices[triangle.Indices[2]].Position;
+        float area = glm::length(glm::cross(b - a, c - a)) * 0.5f;
+        if (area <= 0.0f) {
+            return;
+        }
+
+        RendererEmissiveTriangle emissive = {};
+        emissive.A = triangle.Indices[0];
+        emissive.B = triangle.Indices[1];
+        emissive.C = triangle.Indices[2];
+        emissive.MaterialIndex = triangle.MaterialIndex;
+        emissive.Probability = luminance * area;
+        emissive.Area = area;
+        EmissiveTriangles.push_back(emissive);
+    }
+
+    // Alias table with Vose's method, every entry keeps its own triangle with AliasProbability and takes the one
+    // at Alias otherwise, so the shader picks a triangle proportional to its power with a single lookup.
+    void buildEmissiveAliasTable() {
+        double power = 0.0;
+        for (size_t i = 0; i < EmissiveTriangles.size(); ++i) {
+            power += EmissiveTriangles[i].Probability;
+        }
+        EmissivePower = (float)power;
+
+        std::vector<double> scaled(EmissiveTriangles.size());
+        std::vector<uint32_t> small;
+        std::vector<uint32_t> large;
+        for (uint32_t i = 0; i < (uint32_t)EmissiveTriangles.size(); ++i) {
+            scaled[i] = EmissiveTriangles[i].Probability / power * (double)EmissiveTriangles.size();
+            EmissiveTriangles[i].Probability = (float)(EmissiveTriangles[i].Probability / power);
+            EmissiveTriangles[i].AliasProbability = 1.0f;
+            EmissiveTriangles[i].Alias = i;
+            if (scaled[i] < 1.0) {
+                small.push_back(i);
+            } else {
+                large.push_back(i);
+            }
+        }
+
+        // Whatever is left over is 1 up to rounding errors and keeps its own triangle.
+        while (!small.empty() && !large.empty()) {
+            uint32_t less = small.back();
+            small.pop_back();
+            uint32_t more = large.back();
+            EmissiveTriangles[less].AliasProbability = (float)scaled[less];
+            EmissiveTriangles[less].Alias = more;
+            scaled[more] -= 1.0 - scaled[less];
+            if (scaled[more] < 1.0) {
+                large.pop_back();
+                small.push_back(more);
+            }
+        }
+    }
 
-        bvhTriangle->TexCoordA = glm::packHalf2x16(v0.TextureCoordinates);
-        bvhTriangle->TexCoordB = glm::packHalf2x16(v1.TextureCoordinates);
-        bvhTriangle->TexCoordC = glm::packHalf2x16(v2.TextureCoordinates);
+    void buildTriangle(BVHBuildTriangle* bvhTriangle) {
+        glm::vec3 a = FlatBVH.vertices[bvhTriangle->Triangle.Indices[0]].Position;
+        glm::vec3 b = FlatBVH.vertices[bvhTriangle->Triangle.Indices[1]].Position;
+        glm::vec3 c = FlatBVH.vertices[bvhTriangle->Triangle.Indices[2]].Position;
 
-        bvhTriangle->Min = bvhTriangle->A;
-        bvhTriangle->Max = bvhTriangle->A;
-        bvhTriangle->Min = glm::min(bvhTriangle->Min, bvhTriangle->B);
-        bvhTriangle->Min = glm::min(bvhTriangle->Min, bvhTriangle->C);
-        bvhTriangle->Max = glm::max(bvhTriangle->Max, bvhTriangle->B);
-        bvhTriangle->Max = glm::max(bvhTriangle->Max, bvhTriangle->C);
+        bvhTriangle->Min = glm::min(a, glm::min(b, c));
+        bvhTriangle->Max = glm::max(a, glm::max(b, c));
     }
 
     void GenerateBVH(Scene* scene) {
         SceneTriangleCount = 0;
         BVHRoot = new BVHBuildNode();
+        FlatBVH = IterativeBVH();
+        EmissiveTriangles.clear();
 
-        AddTrianglesToRoot(scene->RootNode);
+        AddTrianglesToRoot(scene, scene->RootNode);
+        buildEmissiveAliasTable();
+        if (EmissiveTriangles.size() > 0) {
+            LogMessage("%i emissive triangles are sampled as area lights.", (int)EmissiveTriangles.size());
+        }
+        SceneTriangleCount = (uint32_t)BVHRoot->GetTriangleCount();
+        size_t buildMemory = BVHRoot->GetTriangleCount() * sizeof(BVHBuildTriangle);
 
         QueryCPU* querySplit = GlobalProfiler.StartCPUQuery("Renderer::Build BVH (Split)");
         BVHRoot->ComputeCost();
@@ -340,8 +825,120 @@ struct BVH {
         BVHNodeCount = BVHRoot->GetNodeCount();
         GlobalProfiler.StopCPUQuery(querySplit);
 
-        auto iterativeBvh = IterativeBVH();
-        iterativeBvh.flatten(BVHRoot);
+        FlatBVH.flatten(BVHRoot);
+        BVHRoot->ReleaseTriangles();
+        LogMessage("BVH primitives use %.2f MB (%.2f MB while building).", FlatBVH.getPrimitiveMemory() / (1024.0f * 1024.0f), buildMemory / (1024.0f * 1024.0f));
+        if (FlatBVH.maxDepth >= BVH_MAX_STACK_SIZE) {
+            LogWarning("BVH depth %i exceeds the traversal stack size %i, deep rays fall back to the stackless traversal.", (int)FlatBVH.maxDepth, BVH_MAX_STACK_SIZE);
+        }
+
+        if (scene->UploadToGPU) {
+            UpdateGPUBuffers();
+        }
+    }
+
+    // Uploads the flattened BVH for the traversal in raytrace.h.
+    void UpdateGPUBuffers() {
+        if (NodeBuffer) {
+            glDeleteBuffers(1, &NodeBuffer);
+            glDeleteTextures(1, &NodeBufferTexture);
+            glDeleteBuffers(1, &VertexBuffer);
+            glDeleteTextures(1, &VertexBufferTexture);
+            glDeleteBuffers(1, &TriangleBuffer);
+            glDeleteTextures(1, &TriangleBufferTexture);
+        }
+        if (TriangleTransformBuffer) {
+            glDeleteBuffers(1, &TriangleTransformBuffer);
+            glDeleteTextures(1, &TriangleTransformBufferTexture);
+            TriangleTransformBuffer = 0;
+        }
+        if (EmissiveTriangleBuffer) {
+            glDeleteBuffers(1, &EmissiveTriangleBuffer);
+            glDeleteTextures(1, &EmissiveTriangleBufferTexture);
+            EmissiveTriangleBuffer = 0;
+            EmissiveTriangleBufferTexture = 0;
+        }
+
+        if (FlatBVH.triangles.size() > 0xFFFFFF) {
+            LogError("BVH has %i triangles, but leaf nodes can only address %i on the GPU.", (int)FlatBVH.triangles.size(), 0xFFFFFF);
+        }
+
+        std::vector<RendererBVHNode> gpuNodes(FlatBVH.nodes.size());
+        for (size_t i = 0; i < FlatBVH.nodes.size(); ++i) {
+            const IterativeNode& node = FlatBVH.nodes[i];
+            RendererBVHNode& gpuNode = gpuNodes[i];
+            gpuNode.AABBMin = node.aabbMin;
+            gpuNode.AABBMax = node.aabbMax;
+            if (node.childCount == 0) {
+                gpuNode.Data = (uint32_t)node.triangleStart | ((uint32_t)node.triangleCount << 24);
+                gpuNode.Links = ((uint32_t)node.skipIndex << 2) | 3;
+            } else {
+                gpuNode.Data = (uint32_t)node.childrenStart;
+                gpuNode.Links = ((uint32_t)node.skipIndex << 2) | (uint32_t)node.splitAxis;
+            }
+        }
+
+        // Vertices and triangles already have the GPU layout and are uploaded as they are.
+        static_assert(sizeof(BVHVertex) == sizeof(RendererVertex), "BVHVertex must match RendererVertex");
+        static_assert(sizeof(BVHTriangle) == sizeof(RendererTriangle), "BVHTriangle must match RendererTriangle");
+
+        createTextureBuffer(&NodeBuffer, &NodeBufferTexture, GL_RGBA32UI, gpuNodes.size() * sizeof(RendererBVHNode), gpuNodes.data());
+        createTextureBuffer(&VertexBuffer, &VertexBufferTexture, GL_RGBA32UI, FlatBVH.vertices.size() * sizeof(BVHVertex), FlatBVH.vertices.data());
+        createTextureBuffer(&TriangleBuffer, &TriangleBufferTexture, GL_RGBA32UI, FlatBVH.triangles.size() * sizeof(BVHTriangle), FlatBVH.triangles.data());
+        if (EmissiveTriangles.size() > 0) {
+            createTextureBuffer(&EmissiveTriangleBuffer, &EmissiveTriangleBufferTexture, GL_RGBA32UI, EmissiveTriangles.size() * sizeof(RendererEmissiveTriangle), EmissiveTriangles.data());
+        }
+        #if BVH_PRECOMPUTE_TRIANGLE_TRANSFORMS
+        createTextureBuffer(&TriangleTransformBuffer, &TriangleTransformBufferTexture, GL_RGBA32F, FlatBVH.triangleTransforms.size() * sizeof(BVHTriangleTransform), FlatBVH.triangleTransforms.data());
+        #endif
+    }
+
+    void createTextureBuffer(uint32_t* buffer, uint32_t* texture, GLenum format, size_t size, const void* data) {
+        glGenBuffers(1, buffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, *buffer);
+        glBufferData(GL_TEXTURE_BUFFER, size, data, GL_STATIC_DRAW);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+        glGenTextures(1, texture);
+        glBindTexture(GL_TEXTURE_BUFFER, *texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, format, *buffer);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+    }
+
+    // CPU counterparts of CastVisRay and CastSurfaceRay in raytrace.h.
+    bool CastVisRay(glm::vec3 origin, glm::vec3 target) {
+        BVHHit hit;
+        #if BVH_STACKLESS_TRAVERSAL
+        return FlatBVH.castRayStackless(BVHRay(origin, target - origin, 1.0f), &hit, true);
+        #else
+        return FlatBVH.castRay(BVHRay(origin, target - origin, 1.0f), &hit, true);
+        #endif
+    }
+
+    bool CastRay(glm::vec3 origin, glm::vec3 direction, float maxDistance, BVHHit* hit) {
+        #if BVH_STACKLESS_TRAVERSAL
+        return FlatBVH.castRayStackless(BVHRay(origin, direction, maxDistance), hit);
+        #else
+        return FlatBVH.castRay(BVHRay(origin, direction, maxDistance), hit);
+        #endif
+    }
+
+    // Casts a grid of closest-hit rays through the camera to compare traversal orders.
+    BVHTraversalStats MeasureTraversal(Camera* camera, bool ordered, int resolution = 64) {
+        BVHTraversalStats stats;
+        float tanHalfFov = glm::tan(camera->FieldOfView * 0.5f);
+        glm::vec3 right = camera->GetRight() * tanHalfFov * camera->AspectRatio;
+        glm::vec3 up = camera->GetUp() * tanHalfFov;
+        for (int y = 0; y < resolution; ++y) {
+            for (int x = 0; x < resolution; ++x) {
+                float u = ((float)x + 0.5f) / (float)resolution * 2.0f - 1.0f;
+                float v = ((float)y + 0.5f) / (float)resolution * 2.0f - 1.0f;
+                glm::vec3 direction = glm::normalize(camera->Direction + right * u + up * v);
+                BVHHit hit;
+                FlatBVH.castRay(BVHRay(camera->Position, direction, camera->Farplane), &hit, false, ordered, &stats);
+            }
+        }
+        return stats;
     }
 
     void Draw(int maxNodeLevel) {
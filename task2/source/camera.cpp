@@ -115,6 +115,7 @@ struct Camera
             JitterOld = Jitter;
             Jitter = glm::vec2((2.0f * JitterSamples[CurrentJitterSample].x - 1.0f) / (float)(width), (2.0f * JitterSamples[CurrentJitterSample].y - 1.0f) / (float)(height));
         } else {
+            JitterOld = Jitter;
             Jitter = glm::vec2();   
         }
         UpdateProjectionMatrix();
@@ -0,0 +1,903 @@
+// Headless CPU counterpart of the lighting pass. It casts the primary rays itself instead of reading a
+// gbuffer and evaluates the same shading as shaders/lighting.h, so it runs without an OpenGL context.
+
+#define CPU_RENDERER_DEFAULT_TILE_SIZE 32
+#define CPU_RENDERER_PARALLEL_CHUNK_SIZE 256
+
+enum CPUIntegrator {
+    // Every pixel sample runs the complete ShadePoint loop on one thread.
+    CPUIntegratorPerPixel,
+    // All samples advance one stage at a time over image sized ray queues.
+    CPUIntegratorWavefront
+};
+
+// Rays traced by the current thread, summed up into CPURenderer::TracedRays when a worker finishes.
+static thread_local uint64_t CPUThreadTracedRays = 0;
+
+struct CPUTile {
+    int X;
+    int Y;
+    int Width;
+    int Height;
+};
+
+// Every worker owns a queue of tiles and takes work from its back. Once it runs dry it steals from
+// the front of the other queues, so expensive regions of the image get spread over all threads.
+struct TileScheduler {
+    struct TileQueue {
+        std::mutex Lock;
+        std::deque<CPUTile> Tiles;
+    };
+
+    std::vector<TileQueue*> Queues;
+    std::atomic<uint32_t> StolenTiles;
+
+    TileScheduler(int threadCount, const std::vector<CPUTile>& tiles) {
+        StolenTiles = 0;
+        for (int i = 0; i < threadCount; ++i) {
+            Queues.push_back(new TileQueue());
+        }
+        // Interleave tiles so neighbouring (similarly expensive) tiles end up in different queues.
+        for (size_t i = 0; i < tiles.size(); ++i) {
+            Queues[i % threadCount]->Tiles.push_back(tiles[i]);
+        }
+    }
+
+    bool NextTile(int threadIndex, CPUTile* tile) {
+        TileQueue* ownQueue = Queues[threadIndex];
+        {
+            std::lock_guard<std::mutex> lock(ownQueue->Lock);
+            if (!ownQueue->Tiles.empty()) {
+                *tile = ownQueue->Tiles.back();
+                ownQueue->Tiles.pop_back();
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i < Queues.size(); ++i) {
+            TileQueue* victim = Queues[(threadIndex + i) % Queues.size()];
+            std::lock_guard<std::mutex> lock(victim->Lock);
+            if (!victim->Tiles.empty()) {
+                *tile = victim->Tiles.front();
+                victim->Tiles.pop_front();
+                ++StolenTiles;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    ~TileScheduler() {
+        for (size_t i = 0; i < Queues.size(); ++i) {
+            delete Queues[i];
+        }
+    }
+};
+
+struct CPUShadingResult {
+    glm::vec3 Diffuse;
+    glm::vec3 Specular;
+};
+
+// Spreads the lower 7 bits of a value so that two zero bits follow each of them.
+static uint32_t ExpandMortonBits(uint32_t value) {
+    value &= 0x7F;
+    value = (value | (value << 8)) & 0x0000F00F;
+    value = (value | (value << 4)) & 0x000C30C3;
+    value = (value | (value << 2)) & 0x00249249;
+    return value;
+}
+
+// Sort key of a ray: the direction octant first, then the Morton code of the origin inside the
+// scene bounds and finally a coarse Morton code of the direction.
+static uint32_t GetRaySortKey(glm::vec3 origin, glm::vec3 direction, glm::vec3 sceneMin, glm::vec3 sceneInvExtent) {
+    uint32_t octant = (direction.x < 0.0f ? 1 : 0) | (direction.y < 0.0f ? 2 : 0) | (direction.z < 0.0f ? 4 : 0);
+
+    glm::vec3 position = glm::clamp((origin - sceneMin) * sceneInvExtent, 0.0f, 1.0f) * 127.0f;
+    uint32_t originKey = ExpandMortonBits((uint32_t)position.x) | (ExpandMortonBits((uint32_t)position.y) << 1) | (ExpandMortonBits((uint32_t)position.z) << 2);
+
+    float maxComponent = glm::max(glm::max(glm::abs(direction.x), glm::abs(direction.y)), glm::abs(direction.z));
+    uint32_t directionKey = 0;
+    if (maxComponent > 0.0f) {
+        glm::vec3 quantized = glm::clamp(direction / maxComponent * 0.5f + 0.5f, 0.0f, 1.0f) * 3.0f;
+        directionKey = ExpandMortonBits((uint32_t)quantized.x) | (ExpandMortonBits((uint32_t)quantized.y) << 1) | (ExpandMortonBits((uint32_t)quantized.z) << 2);
+    }
+    return (octant << 27) | (originKey << 6) | (directionKey & 0x3F);
+}
+
+// Rays of one wavefront stage, one array per field. Every ray is a segment from Origin to
+// Origin + Direction like in CastVisRay and CastSurfaceRay.
+struct CPURayQueue {
+    std::vector<glm::vec3> Origins;
+    std::vector<glm::vec3> Directions;
+    // Path (or path and light for shadow rays) the ray belongs to.
+    std::vector<uint32_t> Owners;
+    std::vector<uint32_t> SortKeys;
+    std::vector<uint32_t> Order;
+
+    std::vector<BVHHit> Hits;
+    std::vector<uint8_t> HasHit;
+
+    void Clear() {
+        Origins.clear();
+        Directions.clear();
+        Owners.clear();
+    }
+
+    void Push(glm::vec3 origin, glm::vec3 direction, uint32_t owner) {
+        Origins.push_back(origin);
+        Directions.push_back(direction);
+        Owners.push_back(owner);
+    }
+
+    size_t Size() {
+        return Owners.size();
+    }
+
+    // Orders the rays by their sort keys with a least significant digit radix sort.
+    void Sort(glm::vec3 sceneMin, glm::vec3 sceneMax) {
+        size_t count = Size();
+        glm::vec3 sceneInvExtent = 1.0f / glm::max(sceneMax - sceneMin, glm::vec3(1e-6f));
+        SortKeys.resize(count);
+        Order.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            SortKeys[i] = GetRaySortKey(Origins[i], Directions[i], sceneMin, sceneInvExtent);
+            Order[i] = (uint32_t)i;
+        }
+
+        std::vector<uint32_t> keys(count);
+        std::vector<uint32_t> order(count);
+        for (int shift = 0; shift < 32; shift += 8) {
+            size_t offsets[257] = {};
+            for (size_t i = 0; i < count; ++i) {
+                ++offsets[((SortKeys[i] >> shift) & 0xFF) + 1];
+            }
+            for (int b = 0; b < 256; ++b) {
+                offsets[b + 1] += offsets[b];
+            }
+            for (size_t i = 0; i < count; ++i) {
+                size_t target = offsets[(SortKeys[i] >> shift) & 0xFF]++;
+                keys[target] = SortKeys[i];
+                order[target] = Order[i];
+            }
+            SortKeys.swap(keys);
+            Order.swap(order);
+        }
+    }
+};
+
+// State of one pixel sample while it moves through the wavefront stages.
+struct CPUPathState {
+    CPURandom Random;
+    SurfacePoint Primary;
+    glm::vec3 PrimaryViewDirection;
+    // Surface of the current bounce, the next ray starts at RayOrigin.
+    SurfacePoint Current;
+    glm::vec3 ViewDirection;
+    glm::vec3 RayOrigin;
+    CPUShadingResult Result;
+    bool HasPrimary;
+    bool Active;
+};
+
+struct CPURenderer {
+    Scene* RenderScene;
+    BVH* SceneBVH;
+    std::vector<RendererLight> Lights;
+
+    int Width;
+    int Height;
+    int SamplesPerPixel;
+    int TileSize;
+    int ThreadCount;
+    CPUIntegrator Integrator;
+
+    // Average linear radiance per pixel.
+    std::vector<glm::vec3> Image;
+
+    double RenderSeconds;
+    uint64_t RenderedSamples;
+    uint32_t StolenTiles;
+    std::atomic<uint64_t> TracedRays;
+
+    // Wavefront traversal statistics, camera rays and all other rays (bounces and shadow rays).
+    uint64_t PrimaryRays;
+    uint64_t SecondaryRays;
+    double PrimaryTraceSeconds;
+    double SecondaryTraceSeconds;
+
+    std::vector<CPUPathState> paths;
+    std::vector<uint8_t> lightVisibility;
+    CPURayQueue rayQueue;
+
+    CPURenderer(Scene* scene, BVH* bvh, int width, int height) {
+        RenderScene = scene;
+        SceneBVH = bvh;
+        Width = width;
+        Height = height;
+        SamplesPerPixel = RENDERING_MAX_SAMPLES;
+        TileSize = CPU_RENDERER_DEFAULT_TILE_SIZE;
+        ThreadCount = glm::max(1, (int)std::thread::hardware_concurrency());
+        Integrator = CPUIntegratorPerPixel;
+        RenderSeconds = 0.0;
+        RenderedSamples = 0;
+        StolenTiles = 0;
+        TracedRays = 0;
+        PrimaryRays = 0;
+        SecondaryRays = 0;
+        PrimaryTraceSeconds = 0.0;
+        SecondaryTraceSeconds = 0.0;
+    }
+
+    void Render(Camera* camera) {
+        Lights.clear();
+        for (size_t i = 0; i < RenderScene->Lights.size(); ++i) {
+            Lights.push_back(GetRendererLight(RenderScene->Lights[i]));
+        }
+        Image.assign((size_t)Width * Height, glm::vec3(0.0f));
+        TracedRays = 0;
+        StolenTiles = 0;
+
+        auto startTime = std::chrono::steady_clock::now();
+        if (Integrator == CPUIntegratorWavefront) {
+            renderWavefront(camera);
+        } else {
+            renderTiles(camera);
+        }
+        RenderSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        RenderedSamples = (uint64_t)Width * Height * SamplesPerPixel;
+    }
+
+    void renderTiles(Camera* camera) {
+        std::vector<CPUTile> tiles;
+        for (int y = 0; y < Height; y += TileSize) {
+            for (int x = 0; x < Width; x += TileSize) {
+                CPUTile tile;
+                tile.X = x;
+                tile.Y = y;
+                tile.Width = glm::min(TileSize, Width - x);
+                tile.Height = glm::min(TileSize, Height - y);
+                tiles.push_back(tile);
+            }
+        }
+
+        TileScheduler scheduler(ThreadCount, tiles);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < ThreadCount; ++t) {
+            workers.push_back(std::thread([this, camera, &scheduler, t]() {
+                CPUThreadTracedRays = 0;
+                CPUTile tile;
+                while (scheduler.NextTile(t, &tile)) {
+                    renderTile(camera, tile);
+                }
+                TracedRays += CPUThreadTracedRays;
+            }));
+        }
+        for (size_t t = 0; t < workers.size(); ++t) {
+            workers[t].join();
+        }
+        StolenTiles = scheduler.StolenTiles;
+    }
+
+    // Runs function(i) for all i < count on all threads, handing out the indices in chunks.
+    template<typename Function>
+    void parallelFor(size_t count, Function function) {
+        std::atomic<size_t> nextIndex(0);
+        auto worker = [this, count, &nextIndex, &function]() {
+            CPUThreadTracedRays = 0;
+            size_t start;
+            while ((start = nextIndex.fetch_add(CPU_RENDERER_PARALLEL_CHUNK_SIZE)) < count) {
+                size_t end = glm::min(start + CPU_RENDERER_PARALLEL_CHUNK_SIZE, count);
+                for (size_t i = start; i < end; ++i) {
+                    function(i);
+                }
+            }
+            TracedRays += CPUThreadTracedRays;
+        };
+
+        std::vector<std::thread> workers;
+        for (int t = 1; t < ThreadCount; ++t) {
+            workers.push_back(std::thread(worker));
+        }
+        worker();
+        for (size_t t = 0; t < workers.size(); ++t) {
+            workers[t].join();
+        }
+    }
+
+    // Sorts and traces all rays in the queue. Closest hit rays can pass through alpha tested surfaces
+    // like in castRay, so the result is the same as tracing them one by one.
+    void traceQueue(CPURayQueue* queue, bool anyHit, bool primary) {
+        auto startTime = std::chrono::steady_clock::now();
+        size_t count = queue->Size();
+        queue->Sort(SceneBVH->FlatBVH.nodes[0].aabbMin, SceneBVH->FlatBVH.nodes[0].aabbMax);
+        queue->Hits.resize(count);
+        queue->HasHit.resize(count);
+        parallelFor(count, [this, queue, anyHit](size_t i) {
+            uint32_t rayIndex = queue->Order[i];
+            queue->HasHit[rayIndex] = castRay(queue->Origins[rayIndex], queue->Directions[rayIndex], 1.0f, anyHit, &queue->Hits[rayIndex]) ? 1 : 0;
+        });
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        if (primary) {
+            PrimaryRays += count;
+            PrimaryTraceSeconds += seconds;
+        } else {
+            SecondaryRays += count;
+            SecondaryTraceSeconds += seconds;
+        }
+    }
+
+    // Traces the shadow rays of every active path from the lights to its current surface, the
+    // counterpart of the CastVisRay calls in ShadePoint and ShadePointSimple.
+    void traceShadowRays() {
+        size_t lightCount = Lights.size();
+        lightVisibility.assign(paths.size() * lightCount, 0);
+        rayQueue.Clear();
+        for (size_t p = 0; p < paths.size(); ++p) {
+            const CPUPathState& path = paths[p];
+            if (!path.Active) {
+                continue;
+            }
+            glm::vec3 surfacePos = GetReflectionOrigin(path.Current);
+            for (size_t l = 0; l < lightCount; ++l) {
+                RendererLight light = Lights[l];
+                glm::vec3 lightVec;
+                if (GetLightAttenuationAndLightVec(path.Current.Position, &light, &lightVec) > 0.0f) {
+                    rayQueue.Push(light.Position, surfacePos - light.Position, (uint32_t)(p * lightCount + l));
+                }
+            }
+        }
+
+        traceQueue(&rayQueue, true, false);
+        for (size_t i = 0; i < rayQueue.Size(); ++i) {
+            lightVisibility[rayQueue.Owners[i]] = rayQueue.HasHit[i] ? 0 : 1;
+        }
+    }
+
+    // Adds ShadePointSimple of the current surface to the specular result of every active path.
+    void shadeBounce() {
+        traceShadowRays();
+        size_t lightCount = Lights.size();
+        parallelFor(paths.size(), [this, lightCount](size_t p) {
+            CPUPathState& path = paths[p];
+            if (!path.Active) {
+                return;
+            }
+            CPUShadingResult bounce;
+            bounce.Diffuse = glm::vec3(0.0f);
+            bounce.Specular = glm::vec3(0.0f);
+            for (size_t l = 0; l < lightCount; ++l) {
+                RendererLight light = Lights[l];
+                glm::vec3 lightVec;
+                float attenuation = GetLightAttenuationAndLightVec(path.Current.Position, &light, &lightVec);
+                AddLightSimple(path.Current, light, lightVec, attenuation, lightVisibility[p * lightCount + l] != 0, &bounce);
+            }
+            bounce.Diffuse += GetDiffuseColor(path.Current) * GetAmbientLight();
+            path.Result.Specular += bounce.Diffuse + bounce.Specular;
+        });
+    }
+
+    // Extends every active path by one reflection or refraction ray and shades the surfaces that were hit.
+    void extendPaths(bool refraction) {
+        rayQueue.Clear();
+        for (size_t p = 0; p < paths.size(); ++p) {
+            CPUPathState& path = paths[p];
+            if (!path.Active) {
+                continue;
+            }
+            if (refraction ? !ContinuesRefraction(path.Current) : !ContinuesReflection(path.Current)) {
+                path.Active = false;
+                continue;
+            }
+            glm::vec3 direction = refraction ? GetRefractionDirection(path.Current, path.ViewDirection) : GetReflectionDirection(path.Current, path.ViewDirection, &path.Random);
+            path.ViewDirection = -direction;
+            rayQueue.Push(path.RayOrigin, (path.RayOrigin + direction * 40.0f) - path.RayOrigin, (uint32_t)p);
+        }
+        if (rayQueue.Size() == 0) {
+            return;
+        }
+
+        traceQueue(&rayQueue, false, false);
+        parallelFor(rayQueue.Size(), [this, refraction](size_t i) {
+            CPUPathState& path = paths[rayQueue.Owners[i]];
+            if (!rayQueue.HasHit[i]) {
+                path.Active = false;
+                return;
+            }
+            GetSurfacePoint(rayQueue.Origins[i], rayQueue.Directions[i], rayQueue.Hits[i], &path.Current);
+            path.RayOrigin = refraction ? GetRefractionOrigin(path.Current) : GetReflectionOrigin(path.Current);
+        });
+        shadeBounce();
+    }
+
+    // Produces the same image as renderTiles, but runs every stage of ShadePoint for all pixels
+    // before moving on to the next one, so the traversal works on large sorted batches of rays.
+    void renderWavefront(Camera* camera) {
+        PrimaryRays = 0;
+        SecondaryRays = 0;
+        PrimaryTraceSeconds = 0.0;
+        SecondaryTraceSeconds = 0.0;
+
+        size_t pixelCount = (size_t)Width * Height;
+        size_t lightCount = Lights.size();
+        paths.resize(pixelCount);
+        std::vector<glm::vec3> accumulation(pixelCount, glm::vec3(0.0f));
+
+        for (int s = 0; s < SamplesPerPixel; ++s) {
+            // Generate camera rays.
+            rayQueue.Clear();
+            for (size_t p = 0; p < pixelCount; ++p) {
+                CPUPathState& path = paths[p];
+                int x = (int)(p % Width);
+                int y = (int)(p / Width);
+                path.Random = CPURandom((uint32_t)p, (uint32_t)s);
+                glm::vec2 screenPosition = glm::vec2(((float)x + path.Random.NextFloat()) / (float)Width, ((float)y + path.Random.NextFloat()) / (float)Height);
+                glm::vec3 origin, direction;
+                GetCameraRay(camera, screenPosition, &origin, &direction);
+                path.PrimaryViewDirection = -direction;
+                path.Result.Diffuse = glm::vec3(0.0f);
+                path.Result.Specular = glm::vec3(0.0f);
+                rayQueue.Push(origin, (origin + direction * camera->Farplane) - origin, (uint32_t)p);
+            }
+
+            // Extend to the primary surfaces.
+            traceQueue(&rayQueue, false, true);
+            parallelFor(pixelCount, [this](size_t p) {
+                CPUPathState& path = paths[p];
+                path.HasPrimary = rayQueue.HasHit[p] != 0;
+                path.Active = path.HasPrimary;
+                if (path.HasPrimary) {
+                    GetSurfacePoint(rayQueue.Origins[p], rayQueue.Directions[p], rayQueue.Hits[p], &path.Primary);
+                    path.Current = path.Primary;
+                }
+            });
+
+            // Direct lighting of the primary surfaces.
+            traceShadowRays();
+            parallelFor(pixelCount, [this, lightCount](size_t p) {
+                CPUPathState& path = paths[p];
+                if (!path.HasPrimary) {
+                    return;
+                }
+                for (size_t l = 0; l < lightCount; ++l) {
+                    RendererLight light = Lights[l];
+                    glm::vec3 lightVec;
+                    float attenuation = GetLightAttenuationAndLightVec(path.Primary.Position, &light, &lightVec);
+                    AddLight(path.Primary, path.PrimaryViewDirection, light, lightVec, attenuation, lightVisibility[p * lightCount + l] != 0, &path.Result);
+                }
+                path.Current = path.Primary;
+                path.ViewDirection = path.PrimaryViewDirection;
+                path.RayOrigin = GetReflectionOrigin(path.Primary);
+            });
+
+            // Reflection bounces.
+            for (int i = 0; i < RENDERING_MAX_RECURSIONS; ++i) {
+                extendPaths(false);
+            }
+
+            // Refraction bounces.
+            for (size_t p = 0; p < pixelCount; ++p) {
+                CPUPathState& path = paths[p];
+                path.Active = path.HasPrimary;
+                path.Current = path.Primary;
+                path.ViewDirection = path.PrimaryViewDirection;
+                path.RayOrigin = GetRefractionOrigin(path.Primary);
+            }
+            for (int i = 0; i < RENDERING_MAX_REFRACTIONS; ++i) {
+                extendPaths(true);
+            }
+
+            // Accumulate.
+            for (size_t p = 0; p < pixelCount; ++p) {
+                CPUPathState& path = paths[p];
+                if (path.HasPrimary) {
+                    path.Result.Diffuse += GetDiffuseColor(path.Primary) * GetAmbientLight();
+                    accumulation[p] += path.Result.Diffuse + path.Result.Specular;
+                } else {
+                    accumulation[p] += glm::vec3(0.0f);
+                }
+            }
+        }
+
+        float invSamples = 1.0f / (float)SamplesPerPixel;
+        for (size_t p = 0; p < pixelCount; ++p) {
+            Image[p] = accumulation[p] * invSamples;
+        }
+    }
+
+    // Camera ray through a point in normalized screen coordinates (0,0 is the top left corner).
+    void GetCameraRay(Camera* camera, glm::vec2 screenPosition, glm::vec3* origin, glm::vec3* direction) {
+        glm::vec2 clip = glm::vec2(screenPosition.x * 2.0f - 1.0f, 1.0f - screenPosition.y * 2.0f);
+        glm::vec4 nearPoint = glm::vec4(clip, 0.0f, 1.0f) * camera->ViewProjectionInv;
+        glm::vec4 farPoint = glm::vec4(clip, 1.0f, 1.0f) * camera->ViewProjectionInv;
+        *origin = camera->Position;
+        *direction = glm::normalize(glm::vec3(farPoint) / farPoint.w - glm::vec3(nearPoint) / nearPoint.w);
+    }
+
+    void renderTile(Camera* camera, CPUTile tile) {
+        float invSamples = 1.0f / (float)SamplesPerPixel;
+        for (int y = tile.Y; y < tile.Y + tile.Height; ++y) {
+            for (int x = tile.X; x < tile.X + tile.Width; ++x) {
+                uint32_t pixelIndex = (uint32_t)(y * Width + x);
+                glm::vec3 color = glm::vec3(0.0f);
+                for (int s = 0; s < SamplesPerPixel; ++s) {
+                    CPURandom random(pixelIndex, (uint32_t)s);
+                    glm::vec2 screenPosition = glm::vec2(((float)x + random.NextFloat()) / (float)Width, ((float)y + random.NextFloat()) / (float)Height);
+                    glm::vec3 origin, direction;
+                    GetCameraRay(camera, screenPosition, &origin, &direction);
+                    color += ShadePixel(origin, direction, camera->Farplane, &random);
+                }
+                Image[pixelIndex] = color * invSamples;
+            }
+        }
+    }
+
+    glm::vec3 ShadePixel(glm::vec3 origin, glm::vec3 direction, float maxDistance, CPURandom* random) {
+        SurfacePoint point;
+        if (!CastSurfaceRay(origin, origin + direction * maxDistance, &point)) {
+            return glm::vec3(0.0f);
+        }
+        CPUShadingResult result = ShadePoint(point, -direction, random);
+        return result.Diffuse + result.Specular;
+    }
+
+    glm::vec4 SampleMaterialTexture(int textureIndex, glm::vec2 texCoords) {
+        if (textureIndex < 0 || textureIndex >= (int)RenderScene->GLTFModel.textures.size()) {
+            return glm::vec4(0.0f);
+        }
+        const tinygltf::Image& image = RenderScene->GLTFModel.images[RenderScene->GLTFModel.textures[textureIndex].source];
+        if (image.width <= 0 || image.height <= 0 || image.bits != 8) {
+            return glm::vec4(1.0f);
+        }
+
+        // Bilinear filtering with repeat wrapping like the texture array (but without mip maps).
+        float fx = (texCoords.x - glm::floor(texCoords.x)) * (float)image.width - 0.5f;
+        float fy = (texCoords.y - glm::floor(texCoords.y)) * (float)image.height - 0.5f;
+        int x0 = (int)glm::floor(fx);
+        int y0 = (int)glm::floor(fy);
+        float tx = fx - (float)x0;
+        float ty = fy - (float)y0;
+
+        glm::vec4 texels[4];
+        for (int i = 0; i < 4; ++i) {
+            int x = (x0 + (i & 1) + image.width) % image.width;
+            int y = (y0 + (i >> 1) + image.height) % image.height;
+            const unsigned char* texel = &image.image[((size_t)y * image.width + x) * image.component];
+            texels[i] = glm::vec4(0.0f, 0.0f, 0.0f, 255.0f);
+            for (int c = 0; c < image.component && c < 4; ++c) {
+                texels[i][c] = (float)texel[c];
+            }
+        }
+        glm::vec4 top = glm::mix(texels[0], texels[1], tx);
+        glm::vec4 bottom = glm::mix(texels[2], texels[3], tx);
+        return glm::mix(top, bottom, ty) * (1.0f / 255.0f);
+    }
+
+    glm::vec2 InterpolateTexCoords(const BVHTriangle& triangle, float u, float v) {
+        const std::vector<BVHVertex>& vertices = SceneBVH->FlatBVH.vertices;
+        glm::vec2 texCoordA = glm::unpackHalf2x16(vertices[triangle.Indices[0]].TexCoord);
+        glm::vec2 texCoordB = glm::unpackHalf2x16(vertices[triangle.Indices[1]].TexCoord);
+        glm::vec2 texCoordC = glm::unpackHalf2x16(vertices[triangle.Indices[2]].TexCoord);
+        return texCoordA * (1.0f - u - v) + texCoordB * u + texCoordC * v;
+    }
+
+    bool IsTriangleOpaque(const BVHHit& hit) {
+        const BVHTriangle& triangle = SceneBVH->FlatBVH.triangles[hit.TriangleIndex];
+        if (triangle.MaterialIndex >= RenderScene->Materials.size()) {
+            return true;
+        }
+        const RendererMaterial& material = RenderScene->Materials[triangle.MaterialIndex];
+        if (!HasFeature(material, MATERIAL_FEATURE_OPACITY_CUTOUT)) {
+            return true;
+        }
+
+        float alpha = material.AlbedoFactor.a;
+        if (HasFeature(material, MATERIAL_FEATURE_ALBEDO_MAP)) {
+            alpha *= SampleMaterialTexture(material.AlbedoMap, InterpolateTexCoords(triangle, hit.U, hit.V)).a;
+        }
+        return alpha >= material.AlphaCutoff;
+    }
+
+    static bool isHitOpaque(const BVHHit& hit, void* context) {
+        return ((CPURenderer*)context)->IsTriangleOpaque(hit);
+    }
+
+    // Closest opaque hit along origin + direction * t, t in [0, maxDistance]. Alpha tested hits are rejected
+    // inside the traversal like on the GPU, so visibility rays never stop at a cutout in front of an occluder.
+    bool castRay(glm::vec3 origin, glm::vec3 direction, float maxDistance, bool anyHit, BVHHit* hit) {
+        BVHRay ray(origin, direction, maxDistance);
+        ++CPUThreadTracedRays;
+        #if BVH_STACKLESS_TRAVERSAL
+        return SceneBVH->FlatBVH.castRayStackless(ray, hit, anyHit, 0, isHitOpaque, this);
+        #else
+        return SceneBVH->FlatBVH.castRay(ray, hit, anyHit, true, 0, isHitOpaque, this);
+        #endif
+    }
+
+    bool CastVisRay(glm::vec3 origin, glm::vec3 target) {
+        BVHHit hit;
+        return castRay(origin, target - origin, 1.0f, true, &hit);
+    }
+
+    bool CastSurfaceRay(glm::vec3 origin, glm::vec3 target, SurfacePoint* point) {
+        glm::vec3 direction = target - origin;
+        BVHHit hit;
+        if (!castRay(origin, direction, 1.0f, false, &hit)) {
+            return false;
+        }
+        GetSurfacePoint(origin, direction, hit, point);
+        return true;
+    }
+
+    void GetSurfacePoint(glm::vec3 origin, glm::vec3 direction, const BVHHit& hit, SurfacePoint* point) {
+        const BVHTriangle& triangle = SceneBVH->FlatBVH.triangles[hit.TriangleIndex];
+        const std::vector<BVHVertex>& vertices = SceneBVH->FlatBVH.vertices;
+        glm::vec3 a = vertices[triangle.Indices[0]].Position;
+        glm::vec3 b = vertices[triangle.Indices[1]].Position;
+        glm::vec3 c = vertices[triangle.Indices[2]].Position;
+        glm::vec3 normal = glm::normalize(glm::cross(b - a, c - a));
+        if (glm::dot(normal, direction) > 0.0f) {
+            normal = -normal;
+        }
+        glm::vec2 texCoords = InterpolateTexCoords(triangle, hit.U, hit.V);
+
+        glm::vec4 albedo = glm::vec4(1.0f);
+        float metallic = 0.0f;
+        float roughness = 1.0f;
+        if (triangle.MaterialIndex < RenderScene->Materials.size()) {
+            const RendererMaterial& material = RenderScene->Materials[triangle.MaterialIndex];
+            albedo = material.AlbedoFactor;
+            if (HasFeature(material, MATERIAL_FEATURE_ALBEDO_MAP)) {
+                albedo *= SampleMaterialTexture(material.AlbedoMap, texCoords);
+            }
+            metallic = material.MetalnessFactor;
+            roughness = material.RoughnessFactor;
+            if (HasFeature(material, MATERIAL_FEATURE_METALLICROUGHNESS_MAP)) {
+                glm::vec4 metallicRoughness = SampleMaterialTexture(material.MetallicRoughnessMap, texCoords);
+                metallic *= metallicRoughness.r;
+                roughness *= metallicRoughness.g;
+            }
+        }
+
+        point->Position = origin + direction * hit.Distance;
+        point->Normal = normal;
+        point->Albedo = albedo;
+        point->Metalness = metallic;
+        point->Roughness = roughness;
+    }
+
+    // The functions below mirror shaders/lighting.h, keep them in sync.
+    static glm::vec3 specularReflection(glm::vec3 reflectance0, glm::vec3 reflectance90, float VdotH) {
+        return reflectance0 + (reflectance90 - reflectance0) * glm::pow(glm::clamp(1.0f - VdotH, 0.0f, 1.0f), 5.0f);
+    }
+
+    static float geometricOcclusion(float NdotL, float NdotV, float alphaRoughness) {
+        float roughnessSq = alphaRoughness * alphaRoughness;
+        float attenuationL = 2.0f * NdotL / (NdotL + glm::sqrt(roughnessSq + (1.0f - roughnessSq) * (NdotL * NdotL)));
+        float attenuationV = 2.0f * NdotV / (NdotV + glm::sqrt(roughnessSq + (1.0f - roughnessSq) * (NdotV * NdotV)));
+        return attenuationL * attenuationV;
+    }
+
+    static float microfacetDistribution(float NdotH, float alphaRoughness) {
+        float roughnessSq = alphaRoughness * alphaRoughness;
+        float f = (NdotH * roughnessSq - NdotH) * NdotH + 1.0f;
+        return roughnessSq / (glm::pi<float>() * f * f);
+    }
+
+    static glm::vec3 randomHemisphereDirection(glm::vec3 normal, CPURandom* random) {
+        float z = random->NextFloat() * 2.0f - 1.0f;
+        float phi = random->NextFloat() * glm::two_pi<float>();
+        float r = glm::sqrt(glm::max(0.0f, 1.0f - z * z));
+        glm::vec3 direction = glm::vec3(r * glm::sin(phi), r * glm::cos(phi), z);
+        return glm::dot(direction, normal) * direction;
+    }
+
+    static float GetLightAttenuationAndLightVec(glm::vec3 position, RendererLight* light, glm::vec3* lightVec) {
+        float attenuation = 0.0f;
+        if (light->Type == LIGHT_TYPE_POINT || light->Type == LIGHT_TYPE_SPOT) {
+            *lightVec = light->Position - position;
+            float distance = glm::length(*lightVec);
+            *lightVec = *lightVec / distance;
+            if (distance < light->Range) {
+                float a = distance / light->Range;
+                attenuation = glm::max(glm::min(1.0f - a * a * a * a, 1.0f), 0.0f) / (distance * distance);
+
+                if (light->Type == LIGHT_TYPE_SPOT) {
+                    float cd = glm::dot(-light->Direction, *lightVec);
+                    float angularAttenuation = glm::clamp(cd * light->AngleScale + light->AngleOffset, 0.0f, 1.0f);
+                    attenuation *= angularAttenuation * angularAttenuation;
+                }
+            }
+        } else {
+            *lightVec = -light->Direction;
+            light->Position = position + *lightVec * 40.0f;
+            attenuation = 1.0f;
+        }
+        return attenuation;
+    }
+
+    static glm::vec3 GetDiffuseColor(const SurfacePoint& point) {
+        const glm::vec3 dielectricSpecular = glm::vec3(0.04f);
+        return glm::mix(glm::vec3(point.Albedo) * (1.0f - dielectricSpecular.r), glm::vec3(0.0f), point.Metalness);
+    }
+
+    static glm::vec3 GetAmbientLight() {
+        return glm::vec3(0.4f, 0.4f, 0.25f) * 10.0f;
+    }
+
+    // Contribution of one light in ShadePointSimple. The visibility is passed in so that the
+    // wavefront integrator can trace all shadow rays of a bounce at once.
+    static void AddLightSimple(const SurfacePoint& point, const RendererLight& light, glm::vec3 lightVec, float attenuation, bool visible, CPUShadingResult* result) {
+        if (attenuation > 0.0f && visible) {
+            float NdotL = glm::clamp(glm::dot(point.Normal, lightVec), 0.001f, 1.0f);
+            result->Diffuse += light.Color * GetDiffuseColor(point) * (NdotL * attenuation * light.Intensity / glm::pi<float>());
+        }
+    }
+
+    // Contribution of one light in ShadePoint.
+    static void AddLight(const SurfacePoint& point, glm::vec3 viewDirection, const RendererLight& light, glm::vec3 lightVec, float attenuation, bool visible, CPUShadingResult* result) {
+        const glm::vec3 dielectricSpecular = glm::vec3(0.04f);
+        const float pi = glm::pi<float>();
+
+        float alphaRoughness = point.Roughness * point.Roughness;
+        glm::vec3 albedo = glm::vec3(point.Albedo);
+        glm::vec3 diffuseColor = GetDiffuseColor(point);
+        glm::vec3 specularColor = glm::mix(dielectricSpecular, albedo, point.Metalness);
+
+        float reflectance = glm::max(glm::max(specularColor.r, specularColor.g), specularColor.b);
+        float reflectance90 = glm::clamp(reflectance * 25.0f, 0.0f, 1.0f);
+        glm::vec3 specularEnvironmentR0 = specularColor;
+        glm::vec3 specularEnvironmentR90 = glm::vec3(1.0f) * reflectance90;
+
+        if (attenuation > 0.0f && visible) {
+            float NdotL = glm::clamp(glm::dot(point.Normal, lightVec), 0.001f, 1.0f);
+            result->Diffuse += light.Color * diffuseColor * (NdotL * attenuation * light.Intensity / pi);
+        }
+
+        glm::vec3 halfVec = glm::normalize(lightVec + viewDirection);
+
+        float NdotL = glm::clamp(glm::dot(point.Normal, lightVec), 0.001f, 1.0f);
+        float NdotV = glm::clamp(glm::abs(glm::dot(point.Normal, viewDirection)), 0.001f, 1.0f);
+        float NdotH = glm::clamp(glm::dot(point.Normal, halfVec), 0.0f, 1.0f);
+        float VdotH = glm::clamp(glm::dot(viewDirection, halfVec), 0.0f, 1.0f);
+
+        glm::vec3 F = specularReflection(specularEnvironmentR0, specularEnvironmentR90, VdotH);
+        float G = geometricOcclusion(NdotL, NdotV, alphaRoughness);
+        float D = microfacetDistribution(NdotH, alphaRoughness);
+
+        glm::vec3 lighting = (NdotL * attenuation * light.Intensity) * light.Color;
+        result->Diffuse += (diffuseColor / pi) * (1.0f - F) * lighting;
+        result->Specular += (lighting * F * G) * D / (4.0f * NdotL * NdotV);
+    }
+
+    static glm::vec3 GetReflectionOrigin(const SurfacePoint& point) {
+        const float surfaceOffset = 0.01f;
+        return point.Position + point.Normal * surfaceOffset;
+    }
+
+    static glm::vec3 GetRefractionOrigin(const SurfacePoint& point) {
+        return point.Position - point.Normal * 0.002f;
+    }
+
+    static bool ContinuesReflection(const SurfacePoint& point) {
+        return point.Roughness < 0.5f || point.Metalness > 0.5f;
+    }
+
+    static bool ContinuesRefraction(const SurfacePoint& point) {
+        return point.Albedo.a > 0.0f && point.Albedo.a < 1.0f;
+    }
+
+    static glm::vec3 GetReflectionDirection(const SurfacePoint& point, glm::vec3 viewDirection, CPURandom* random) {
+        glm::vec3 reflectionVec = glm::normalize(glm::reflect(-viewDirection, point.Normal));
+        return glm::normalize(glm::mix(reflectionVec, randomHemisphereDirection(reflectionVec, random), point.Roughness));
+    }
+
+    static glm::vec3 GetRefractionDirection(const SurfacePoint& point, glm::vec3 viewDirection) {
+        return glm::normalize(glm::refract(-viewDirection, point.Normal, 0.9f));
+    }
+
+    CPUShadingResult ShadePointSimple(const SurfacePoint& point) {
+        glm::vec3 surfacePos = GetReflectionOrigin(point);
+
+        CPUShadingResult result;
+        result.Diffuse = glm::vec3(0.0f);
+        result.Specular = glm::vec3(0.0f);
+        for (size_t i = 0; i < Lights.size(); ++i) {
+            RendererLight light = Lights[i];
+            glm::vec3 lightVec;
+            float attenuation = GetLightAttenuationAndLightVec(point.Position, &light, &lightVec);
+            bool visible = attenuation > 0.0f && !CastVisRay(light.Position, surfacePos);
+            AddLightSimple(point, light, lightVec, attenuation, visible, &result);
+        }
+
+        result.Diffuse += GetDiffuseColor(point) * GetAmbientLight();
+        return result;
+    }
+
+    CPUShadingResult ShadePoint(const SurfacePoint& point, glm::vec3 viewDirection, CPURandom* random) {
+        glm::vec3 surfacePos = GetReflectionOrigin(point);
+
+        CPUShadingResult result;
+        result.Diffuse = glm::vec3(0.0f);
+        result.Specular = glm::vec3(0.0f);
+
+        for (size_t i = 0; i < Lights.size(); ++i) {
+            RendererLight light = Lights[i];
+            glm::vec3 lightVec;
+            float attenuation = GetLightAttenuationAndLightVec(point.Position, &light, &lightVec);
+            bool visible = attenuation > 0.0f && !CastVisRay(light.Position, surfacePos);
+            AddLight(point, viewDirection, light, lightVec, attenuation, visible, &result);
+        }
+
+        // Reflections.
+        SurfacePoint nextPoint = point;
+        glm::vec3 lastViewDir = viewDirection;
+        for (int i = 0; i < RENDERING_MAX_RECURSIONS; ++i) {
+            if (ContinuesReflection(nextPoint)) {
+                glm::vec3 glossyReflectionVec = GetReflectionDirection(nextPoint, lastViewDir, random);
+                if (CastSurfaceRay(surfacePos, surfacePos + glossyReflectionVec * 40.0f, &nextPoint)) {
+                    lastViewDir = -glossyReflectionVec;
+                    surfacePos = GetReflectionOrigin(nextPoint);
+                    CPUShadingResult reflection = ShadePointSimple(nextPoint);
+                    result.Specular += reflection.Diffuse + reflection.Specular;
+                } else {
+                    break;
+                }
+            }
+        }
+
+        // Refractions.
+        surfacePos = GetRefractionOrigin(point);
+        nextPoint = point;
+        lastViewDir = viewDirection;
+        for (int i = 0; i < RENDERING_MAX_REFRACTIONS; ++i) {
+            if (ContinuesRefraction(nextPoint)) {
+                glm::vec3 refractionVec = GetRefractionDirection(nextPoint, lastViewDir);
+                if (CastSurfaceRay(surfacePos, surfacePos + refractionVec * 40.0f, &nextPoint)) {
+                    lastViewDir = -refractionVec;
+                    surfacePos = GetRefractionOrigin(nextPoint);
+                    CPUShadingResult refraction = ShadePointSimple(nextPoint);
+                    result.Specular += refraction.Diffuse + refraction.Specular;
+                } else {
+                    break;
+                }
+            }
+        }
+
+        result.Diffuse += GetDiffuseColor(point) * GetAmbientLight();
+        return result;
+    }
+
+    // Same tonemapping as shaders/post.frag.
+    static glm::vec3 Uncharted2Tonemap(glm::vec3 x) {
+        const float A = 0.15f;
+        const float B = 0.50f;
+        const float C = 0.10f;
+        const float D = 0.20f;
+        const float E = 0.02f;
+        const float F = 0.30f;
+        return ((x * (A * x + C * B) + D * E) / (x * (A * x + B) + D * F)) - E / F;
+    }
+
+    // Writes a tonemapped .png or the raw radiance as .hdr, depending on the file extension.
+    bool WriteImage(const char* path, float exposure) {
+        size_t pathLength = strlen(path);
+        if (pathLength > 4 && strcmp(path + pathLength - 4, ".hdr") == 0) {
+            return stbi_write_hdr(path, Width, Height, 3, &Image[0].x) != 0;
+        }
+
+        const float W = 11.2f;
+        glm::vec3 whiteScale = 1.0f / Uncharted2Tonemap(glm::vec3(W));
+        float exposureScale = glm::exp2(exposure);
+        std::vector<uint8_t> pixels((size_t)Width * Height * 3);
+        for (size_t i = 0; i < Image.size(); ++i) {
+            glm::vec3 ldr = Uncharted2Tonemap(Image[i] * exposureScale) * whiteScale;
+            ldr = glm::clamp(ldr, 0.0f, 1.0f);
+            pixels[i * 3 + 0] = (uint8_t)(ldr.r * 255.0f + 0.5f);
+            pixels[i * 3 + 1] = (uint8_t)(ldr.g * 255.0f + 0.5f);
+            pixels[i * 3 + 2] = (uint8_t)(ldr.b * 255.0f + 0.5f);
+        }
+        return stbi_write_png(path, Width, Height, 3, pixels.data(), Width * 3) != 0;
+    }
+};
@@ -0,0 +1,143 @@
+// Assigns the lights to a froxel grid over the view frustum (LIGHT_CLUSTER_TILES_X * LIGHT_CLUSTER_TILES_Y tiles in
+// screen space and LIGHT_CLUSTER_SLICES exponential depth slices), so that the lighting only loops over the lights
+// whose range can reach a position. See GetLightList in shaders/lighting.h.
+struct LightClusters {
+    static const int ClusterCount = LIGHT_CLUSTER_TILES_X * LIGHT_CLUSTER_TILES_Y * LIGHT_CLUSTER_SLICES;
+
+    // Unjittered view projection and depth parameters the clusters were built with, the shaders use the same.
+    glm::mat4 ViewProjection;
+    glm::vec2 DepthScaleBias;
+
+    // Offset and count of every cluster followed by the light indices, the indices of a cluster are in ascending
+    // order. The offsets already skip the ranges, so that one texture buffer holds both.
+    std::vector<uint32_t> Data;
+
+    uint32_t DataBuffer = 0;
+    uint32_t DataBufferTexture = 0;
+    size_t DataBufferCapacity = 0;
+
+    // View space bounds of the clusters and the camera they were computed for.
+    glm::vec3 ClusterMin[ClusterCount];
+    glm::vec3 ClusterMax[ClusterCount];
+    glm::vec4 BoundsCamera = glm::vec4(0.0f);
+    std::vector<uint32_t> ClusterLights[ClusterCount];
+
+    LightClusters() {
+        glGenBuffers(1, &DataBuffer);
+        glGenTextures(1, &DataBufferTexture);
+        ResizeDataBuffer(ClusterCount * 2 + 1024);
+    }
+
+    ~LightClusters() {
+        glDeleteTextures(1, &DataBufferTexture);
+        glDeleteBuffers(1, &DataBuffer);
+    }
+
+    void ResizeDataBuffer(size_t capacity) {
+        DataBufferCapacity = capacity;
+        glBindBuffer(GL_TEXTURE_BUFFER, DataBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, sizeof(uint32_t) * DataBufferCapacity, 0, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+        // The texture has to be attached again after the storage changed.
+        glBindTexture(GL_TEXTURE_BUFFER, DataBufferTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, DataBuffer);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+    }
+
+    static float GetSliceDepth(Camera* camera, int slice) {
+        return camera->Nearplane * glm::pow(camera->Farplane / camera->Nearplane, (float)slice / (float)LIGHT_CLUSTER_SLICES);
+    }
+
+    int GetSlice(float depth) {
+        return (int)glm::floor(glm::log(depth) * DepthScaleBias.x + DepthScaleBias.y);
+    }
+
+    static int GetClusterIndex(int x, int y, int slice) {
+        return (slice * LIGHT_CLUSTER_TILES_Y + y) * LIGHT_CLUSTER_TILES_X + x;
+    }
+
+    void UpdateBounds(Camera* camera) {
+        // Tiles are spread evenly in normalized device coordinates, the view space extent grows with the depth.
+        glm::vec2 tanHalfFov = glm::vec2(1.0f / camera->Projection[0][0], 1.0f / camera->Projection[1][1]);
+        for (int slice = 0; slice < LIGHT_CLUSTER_SLICES; ++slice) {
+            float nearDepth = GetSliceDepth(camera, slice);
+            float farDepth = GetSliceDepth(camera, slice + 1);
+            for (int y = 0; y < LIGHT_CLUSTER_TILES_Y; ++y) {
+                for (int x = 0; x < LIGHT_CLUSTER_TILES_X; ++x) {
+                    glm::vec2 ndcMin = glm::vec2(x, y) / glm::vec2(LIGHT_CLUSTER_TILES_X, LIGHT_CLUSTER_TILES_Y) * 2.0f - 1.0f;
+                    glm::vec2 ndcMax = glm::vec2(x + 1, y + 1) / glm::vec2(LIGHT_CLUSTER_TILES_X, LIGHT_CLUSTER_TILES_Y) * 2.0f - 1.0f;
+                    glm::vec2 a = ndcMin * tanHalfFov * nearDepth;
+                    glm::vec2 b = ndcMax * tanHalfFov * nearDepth;
+                    glm::vec2 c = ndcMin * tanHalfFov * farDepth;
+                    glm::vec2 d = ndcMax * tanHalfFov * farDepth;
+
+                    int cluster = GetClusterIndex(x, y, slice);
+                    ClusterMin[cluster] = glm::vec3(glm::min(glm::min(a, b), glm::min(c, d)), nearDepth);
+                    ClusterMax[cluster] = glm::vec3(glm::max(glm::max(a, b), glm::max(c, d)), farDepth);
+                }
+            }
+        }
+    }
+
+    void Update(Camera* camera, const std::vector<RendererLight>& lights) {
+        glm::vec4 boundsCamera = glm::vec4(camera->FieldOfView, camera->AspectRatio, camera->Nearplane, camera->Farplane);
+        if(boundsCamera != BoundsCamera) {
+            BoundsCamera = boundsCamera;
+            UpdateBounds(camera);
+        }
+        float logDepthRange = glm::log(camera->Farplane / camera->Nearplane);
+        DepthScaleBias = glm::vec2((float)LIGHT_CLUSTER_SLICES / logDepthRange, -(float)LIGHT_CLUSTER_SLICES * glm::log(camera->Nearplane) / logDepthRange);
+        glm::mat4 projection = camera->Projection;
+        projection[0][2] = 0.0f;
+        projection[1][2] = 0.0f;
+        ViewProjection = camera->View * projection;
+
+        for (int i = 0; i < ClusterCount; ++i) {
+            ClusterLights[i].clear();
+        }
+
+        for (uint32_t l = 0; l < (uint32_t)lights.size(); ++l) {
+            const RendererLight& light = lights[l];
+            if(light.Type == LIGHT_TYPE_DIRECTIONAL) {
+                for (int i = 0; i < ClusterCount; ++i) {
+                    ClusterLights[i].push_back(l);
+                }
+                continue;
+            }
+
+            // Point and spot lights are bounded by their range sphere, slightly enlarged so that the float
+            // differences between this and the shader lookup never drop a light on a cluster border.
+            glm::vec3 center = glm::vec3(glm::vec4(light.Position, 1.0f) * camera->View);
+            float radius = light.Range * 1.001f + 0.001f;
+            if(center.z + radius < camera->Nearplane || center.z - radius > camera->Farplane) {
+                continue;
+            }
+            int firstSlice = glm::max(GetSlice(glm::max(center.z - radius, camera->Nearplane)), 0);
+            int lastSlice = glm::min(GetSlice(glm::min(center.z + radius, camera->Farplane)), LIGHT_CLUSTER_SLICES - 1);
+            for (int slice = firstSlice; slice <= lastSlice; ++slice) {
+                for (int i = GetClusterIndex(0, 0, slice); i < GetClusterIndex(0, 0, slice + 1); ++i) {
+                    glm::vec3 closest = glm::clamp(center, ClusterMin[i], ClusterMax[i]);
+                    glm::vec3 offset = closest - center;
+                    if(glm::dot(offset, offset) <= radius * radius) {
+                        ClusterLights[i].push_back(l);
+                    }
+                }
+            }
+        }
+
+        Data.resize(ClusterCount * 2);
+        for (int i = 0; i < ClusterCount; ++i) {
+            Data[i * 2] = (uint32_t)Data.size();
+            Data[i * 2 + 1] = (uint32_t)ClusterLights[i].size();
+            Data.insert(Data.end(), ClusterLights[i].begin(), ClusterLights[i].end());
+        }
+
+        if(Data.size() > DataBufferCapacity) {
+            ResizeDataBuffer(Data.size() * 2);
+        }
+        glBindBuffer(GL_TEXTURE_BUFFER, DataBuffer);
+        glBufferSubData(GL_TEXTURE_BUFFER, 0, sizeof(uint32_t) * Data.size(), Data.data());
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+};
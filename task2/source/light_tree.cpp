@@ -0,0 +1,153 @@
+// Light hierarchy over the point and spot lights, used to importance sample a few lights per shaded point
+// instead of casting a shadow ray to every light (see SampleLightTree in shaders/light_tree.h).
+// The nodes are stored depth first like the BVH, the first child directly follows its parent. Directional lights
+// can't be bounded, they are stored as separate leaves after the tree and are always shaded.
+struct LightTree {
+    std::vector<RendererLightTreeNode> Nodes;
+    int NodeCount = 0;
+    int DirectionalCount = 0;
+
+    uint32_t NodeBuffer = 0;
+    uint32_t NodeBufferTexture = 0;
+    size_t NodeBufferCapacity = 0;
+
+    LightTree() {
+        glGenBuffers(1, &NodeBuffer);
+        glGenTextures(1, &NodeBufferTexture);
+        ResizeNodeBuffer(64);
+    }
+
+    ~LightTree() {
+        glDeleteTextures(1, &NodeBufferTexture);
+        glDeleteBuffers(1, &NodeBuffer);
+    }
+
+    void ResizeNodeBuffer(size_t capacity) {
+        NodeBufferCapacity = capacity;
+        glBindBuffer(GL_TEXTURE_BUFFER, NodeBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, sizeof(RendererLightTreeNode) * NodeBufferCapacity, 0, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+        glBindTexture(GL_TEXTURE_BUFFER, NodeBufferTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32UI, NodeBuffer);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+    }
+
+    static RendererLightTreeNode GetLeaf(const RendererLight& light, uint32_t lightIndex) {
+        RendererLightTreeNode node = {};
+        node.AABBMin = light.Position;
+        node.AABBMax = light.Position;
+        node.Power = light.Intensity * glm::max(glm::max(light.Color.x, light.Color.y), light.Color.z);
+        node.Data = lightIndex | LIGHT_TREE_LEAF;
+        // Slightly enlarged like the light clusters, so that float differences never cull a reaching light.
+        node.Range = light.Range * 1.001f + 0.001f;
+        node.ConeAxis = glm::vec3(0.0f, 0.0f, 1.0f);
+        node.ConeCosAngle = -1.0f;
+        if(light.Type == LIGHT_TYPE_SPOT && glm::length(light.Direction) > 0.0f) {
+            // The spot light attenuation reaches zero at the outer angle.
+            node.ConeAxis = glm::normalize(light.Direction);
+            node.ConeCosAngle = glm::clamp(-light.AngleOffset / light.AngleScale, -1.0f, 1.0f);
+        }
+        return node;
+    }
+
+    // Smallest cone around both cones, see "Importance Sampling of Many Lights with Adaptive Tree Splitting" (Conty Estevez and Kulla 2018).
+    static void MergeCones(const RendererLightTreeNode& a, const RendererLightTreeNode& b, RendererLightTreeNode* result) {
+        result->ConeAxis = a.ConeAxis;
+        result->ConeCosAngle = -1.0f;
+        if(a.ConeCosAngle <= -1.0f || b.ConeCosAngle <= -1.0f) {
+            return;
+        }
+
+        float thetaA = glm::acos(a.ConeCosAngle);
+        float thetaB = glm::acos(b.ConeCosAngle);
+        float thetaD = glm::acos(glm::clamp(glm::dot(a.ConeAxis, b.ConeAxis), -1.0f, 1.0f));
+        if(glm::min(thetaD + thetaB, glm::pi<float>()) <= thetaA) {
+            result->ConeCosAngle = a.ConeCosAngle;
+            return;
+        }
+        if(glm::min(thetaD + thetaA, glm::pi<float>()) <= thetaB) {
+            result->ConeAxis = b.ConeAxis;
+            result->ConeCosAngle = b.ConeCosAngle;
+            return;
+        }
+
+        float thetaO = (thetaA + thetaD + thetaB) * 0.5f;
+        glm::vec3 rotationAxis = glm::cross(a.ConeAxis, b.ConeAxis);
+        if(thetaO >= glm::pi<float>() || glm::length2(rotationAxis) == 0.0f) {
+            return;
+        }
+        result->ConeAxis = glm::normalize(glm::rotate(a.ConeAxis, thetaO - thetaA, glm::normalize(rotationAxis)));
+        result->ConeCosAngle = glm::cos(thetaO);
+    }
+
+    // Builds the subtree over lightIndices[begin, end) and returns the index of its root.
+    int BuildNode(const std::vector<RendererLight>& lights, std::vector<uint32_t>& lightIndices, int begin, int end) {
+        int nodeIndex = (int)Nodes.size();
+        if(end - begin == 1) {
+            Nodes.push_back(GetLeaf(lights[lightIndices[begin]], lightIndices[begin]));
+            return nodeIndex;
+        }
+        Nodes.push_back(RendererLightTreeNode());
+
+        // Median split along the largest axis of the light positions.
+        glm::vec3 boundsMin = glm::vec3(FLT_MAX);
+        glm::vec3 boundsMax = glm::vec3(-FLT_MAX);
+        for (int i = begin; i < end; ++i) {
+            boundsMin = glm::min(boundsMin, lights[lightIndices[i]].Position);
+            boundsMax = glm::max(boundsMax, lights[lightIndices[i]].Position);
+        }
+        glm::vec3 extent = boundsMax - boundsMin;
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        int middle = (begin + end) / 2;
+        std::nth_element(lightIndices.begin() + begin, lightIndices.begin() + middle, lightIndices.begin() + end, [&](uint32_t a, uint32_t b) {
+            return lights[a].Position[axis] < lights[b].Position[axis];
+        });
+
+        BuildNode(lights, lightIndices, begin, middle);
+        int secondChild = BuildNode(lights, lightIndices, middle, end);
+
+        const RendererLightTreeNode& first = Nodes[nodeIndex + 1];
+        const RendererLightTreeNode& second = Nodes[secondChild];
+        RendererLightTreeNode node = {};
+        node.AABBMin = glm::min(first.AABBMin, second.AABBMin);
+        node.AABBMax = glm::max(first.AABBMax, second.AABBMax);
+        node.Power = first.Power + second.Power;
+        node.Data = (uint32_t)secondChild;
+        node.Range = glm::max(first.Range, second.Range);
+        MergeCones(first, second, &node);
+        Nodes[nodeIndex] = node;
+        return nodeIndex;
+    }
+
+    void Build(const std::vector<RendererLight>& lights) {
+        std::vector<uint32_t> lightIndices;
+        std::vector<uint32_t> directionalIndices;
+        for (uint32_t i = 0; i < (uint32_t)lights.size(); ++i) {
+            if(lights[i].Type == LIGHT_TYPE_DIRECTIONAL) {
+                directionalIndices.push_back(i);
+            } else {
+                lightIndices.push_back(i);
+            }
+        }
+
+        Nodes.clear();
+        if(lightIndices.size() > 0) {
+            BuildNode(lights, lightIndices, 0, (int)lightIndices.size());
+        }
+        NodeCount = (int)Nodes.size();
+        DirectionalCount = (int)directionalIndices.size();
+        for (size_t i = 0; i < directionalIndices.size(); ++i) {
+            Nodes.push_back(GetLeaf(lights[directionalIndices[i]], directionalIndices[i]));
+        }
+
+        if(Nodes.size() > NodeBufferCapacity) {
+            ResizeNodeBuffer(Nodes.size() * 2);
+        }
+        if(Nodes.size() > 0) {
+            glBindBuffer(GL_TEXTURE_BUFFER, NodeBuffer);
+            glBufferSubData(GL_TEXTURE_BUFFER, 0, sizeof(RendererLightTreeNode) * Nodes.size(), Nodes.data());
+            glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        }
+    }
+};
@@ -16,9 +16,13 @@ LogMessageGeneric(LogSeverity severity, const char* message, ...) {
 	}
 	if(message) {
 		va_list args;
+		va_list fileArgs;
 	    va_start(args, message);
+	    // A va_list can only be consumed once, so the file output needs its own copy.
+	    va_copy(fileArgs, args);
 	    vprintf(message, args);
-	    vfprintf(GlobalLogFile, message, args);
+	    vfprintf(GlobalLogFile, message, fileArgs);
+	    va_end(fileArgs);
 	    va_end(args);
 	    
 	    printf("\n");
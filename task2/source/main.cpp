@@ -109,7 +109,10 @@ struct {
 #include "shader.cpp"
 #include "debug_renderer.cpp"
 #include "scene.cpp"
+#include "random.cpp"
 #include "bvh.cpp"
+#include "light_clusters.cpp"
+#include "light_tree.cpp"
 #include "scene_renderer.cpp"
 
 
@@ -321,7 +324,10 @@ int main(int argc, char *argv[])
         ImGui::NewFrame();
 
         
-        camera->NewFrame(GLOBAL.ScreenWidth, GLOBAL.ScreenHeight, false);
+        // The accumulated frames are jittered, which antialiases the edges of the still image. The jitter covers a
+        // pixel of the rendering size that the dynamic resolution picks.
+        sceneRenderer->UpdateDynamicResolution();
+        camera->NewFrame(sceneRenderer->RenderingSize.x, sceneRenderer->RenderingSize.y, sceneRenderer->UsesCameraJitter());
 
         // Camera movement code.
         if (Input::IsMouseButtonPressed(SDL_BUTTON_RIGHT)) {
@@ -352,6 +358,16 @@ int main(int argc, char *argv[])
         ImGui::Text("Camera Pos: %f %f %f", camera->Position.x, camera->Position.y, camera->Position.z);
         ImGui::Text("Scene Meshes: %i", (int)scene->Meshes.size());
         ImGui::Text("BVH Nodes: %i", bvh->BVHNodeCount);
+        ImGui::Text("BVH Primitive Memory: %.2f MB", bvh->FlatBVH.getPrimitiveMemory() / (1024.0f * 1024.0f));
+        static float visitedNodesOrdered = 0.0f;
+        static float visitedNodesUnordered = 0.0f;
+        if(ImGui::Button("Measure BVH Traversal")) {
+            BVHTraversalStats ordered = bvh->MeasureTraversal(camera, true);
+            BVHTraversalStats unordered = bvh->MeasureTraversal(camera, false);
+            visitedNodesOrdered = (float)ordered.VisitedNodes / (float)glm::max((uint64_t)1, ordered.Rays);
+            visitedNodesUnordered = (float)unordered.VisitedNodes / (float)glm::max((uint64_t)1, unordered.Rays);
+        }
+        ImGui::Text("Visited Nodes/Ray: %.1f ordered, %.1f unordered", visitedNodesOrdered, visitedNodesUnordered);
         static int nodeLevelsDrawn = 8;
         ImGui::Checkbox("Draw BVH", &drawBVH);
         if(drawBVH) {
@@ -368,6 +384,67 @@ int main(int argc, char *argv[])
         if(ImGui::Checkbox("Enable VSync", &enableVsync)) {
             SDL_GL_SetSwapInterval(enableVsync ? 1 : 0);
         }
+        // 0 shades every light in range, otherwise the lights are sampled from the light tree.
+        ImGui::SliderInt("Light Samples", &sceneRenderer->LightSampleCount, 0, 8);
+        ImGui::Checkbox("Light Resampling (ReSTIR)", &sceneRenderer->UseLightResampling);
+        ImGui::SliderFloat("Path Throughput Cutoff", &sceneRenderer->PathThroughputCutoff, 0.0f, 0.1f);
+        ImGui::Checkbox("Adaptive Sampling", &sceneRenderer->UseAdaptiveSampling);
+        if(sceneRenderer->UseAdaptiveSampling) {
+            ImGui::SliderFloat("Adaptive Sampling Threshold", &sceneRenderer->AdaptiveSamplingThreshold, 0.01f, 0.5f);
+            ImGui::SliderFloat("Adaptive Sampling Budget", &sceneRenderer->AdaptiveSamplingBudget, 0.0f, (float)(RENDERING_MAX_SAMPLES - 1));
+        }
+        char* SecondaryRayModes[] = {"Full Resolution", "Checkerboard", "Half Resolution"};
+        if(ImGui::BeginCombo("Secondary Rays", SecondaryRayModes[sceneRenderer->ActiveSecondaryRayMode])) {
+            for(int i = 0; i < ArrayCount(SecondaryRayModes); ++i) {
+                if(ImGui::Selectable(SecondaryRayModes[i])) {
+                    sceneRenderer->ActiveSecondaryRayMode = (SecondaryRayMode)i;
+                }
+            }
+            ImGui::EndCombo();
+        }
+        ImGui::Checkbox("Temporal Reprojection", &sceneRenderer->UseTemporalReprojection);
+        if(sceneRenderer->UseTemporalReprojection) {
+            ImGui::SliderInt("Temporal History Frames", &sceneRenderer->TemporalMaxHistory, 1, 64);
+        }
+        ImGui::Checkbox("Denoiser", &sceneRenderer->UseDenoiser);
+        if(sceneRenderer->UseDenoiser) {
+            ImGui::SliderInt("Denoise Iterations", &sceneRenderer->DenoiseIterations, 1, DENOISE_MAX_ITERATIONS);
+        }
+        ImGui::Checkbox("Temporal Anti-Aliasing", &sceneRenderer->UseTemporalAntiAliasing);
+        if(sceneRenderer->UseTemporalAntiAliasing) {
+            ImGui::SliderFloat("TAA Sharpness", &sceneRenderer->TAASharpness, 0.0f, 1.0f);
+        }
+        ImGui::Checkbox("Dynamic Resolution", &sceneRenderer->UseDynamicResolution);
+        if(sceneRenderer->UseDynamicResolution) {
+            ImGui::SliderFloat("Target GPU Time (ms)", &sceneRenderer->DynamicResolutionTargetMs, 1.0f, 100.0f);
+            ImGui::SliderFloat("Minimum Scale", &sceneRenderer->DynamicResolutionMinScale, 0.25f, 1.0f);
+            ImGui::Text("Rendering at %i x %i", sceneRenderer->RenderingSize.x, sceneRenderer->RenderingSize.y);
+        }
+        ImGui::Checkbox("Progressive Accumulation", &sceneRenderer->UseProgressiveAccumulation);
+        if(sceneRenderer->UseProgressiveAccumulation) {
+            ImGui::SliderInt("Accumulation Frame Limit", &sceneRenderer->ProgressiveFrameLimit, 1, 4096);
+            if(sceneRenderer->IsAccumulationConverged()) {
+                ImGui::Text("Converged after %i frames in %.1f s", sceneRenderer->AccumulatedFrames, sceneRenderer->AccumulationSeconds);
+            } else {
+                ImGui::Text("Accumulated %i frames in %.1f s", sceneRenderer->AccumulatedFrames, sceneRenderer->AccumulationSeconds);
+            }
+        }
+        if(bvh->EmissiveTriangles.size() > 0) {
+            ImGui::SliderInt("Emissive Samples", &sceneRenderer->EmissiveSampleCount, 0, 8);
+        }
+        if(sceneRenderer->ComputeSupported) {
+            char* LightingModes[] = {"Fragment", "Tiled", "Wavefront"};
+            if(ImGui::BeginCombo("Lighting", LightingModes[sceneRenderer->ActiveLightingMode])) {
+                for(int i = 0; i < ArrayCount(LightingModes); ++i) {
+                    if(ImGui::Selectable(LightingModes[i])) {
+                        sceneRenderer->ActiveLightingMode = (LightingMode)i;
+                    }
+                }
+                ImGui::EndCombo();
+            }
+        } else {
+            ImGui::Text("Tiled and Wavefront Lighting need OpenGL 4.3");
+        }
         ImGui::End();
 
         ImGui::Begin("Light");
@@ -464,7 +541,6 @@ int main(int argc, char *argv[])
 
         scene->UpdateNodes();
         sceneRenderer->Draw(scene, camera, bvh);
-        //added denoising filter
         sceneRenderer->Display();
 
         Debug::SubmitRenderer(camera->ViewProjection);
@@ -0,0 +1,230 @@
+// Disable some warnings on cl.exe
+#define _CRT_SECURE_NO_WARNINGS
+
+// Included standard library stuff
+#include <cstdio>
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <set>
+#include <list>
+#include <time.h>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <atomic>
+
+// Include glew for OpenGL extensions.
+#include "../external/GL/glew.h"
+
+// Include SDL headers for platform abstraction.
+#include "../external/SDL/SDL.h"
+#include "../external/SDL/SDL_video.h"
+#include "../external/SDL/SDL_opengl.h"
+#include "../external/SDL/SDL_syswm.h"
+
+// Include glm math functions and disable some warnings for them
+// we use warning=error so even minor warnings will break the build.
+#pragma warning( push )
+#pragma warning( disable : 4201)
+#define GLM_FORCE_RADIANS
+#include "../external/glm/glm.hpp"
+#include "../external/glm/gtc/matrix_transform.hpp"
+#include "../external/glm/gtc/constants.hpp"
+#include "../external/glm/gtc/reciprocal.hpp"
+#include "../external/glm/gtc/type_ptr.hpp"
+#include "../external/glm/gtx/rotate_vector.hpp"
+#include "../external/glm/gtc/epsilon.hpp"
+#include "../external/glm/gtc/noise.hpp"
+#include "../external/glm/gtc/random.hpp"
+#include "../external/glm/gtx/norm.hpp"
+#include "../external/glm/gtx/hash.hpp"
+#include "../external/glm/gtx/intersect.hpp"
+#pragma warning( pop )
+
+// Include imgui for gui display.
+#pragma warning( push )
+#pragma warning( disable : 4456)
+#define IMGUI_IMPL_OPENGL_LOADER_GLEW
+#include "../external/imgui.h"
+#include "../external/imgui.cpp"
+#include "../external/imgui_widgets.cpp"
+#include "../external/imgui_draw.cpp"
+#include "../external/imgui_impl_opengl3.cpp"
+#include "../external/imgui_impl_sdl.cpp"
+#pragma warning( pop )
+
+// Include tinygltf for GLTF 2.0 loading.
+#pragma warning( push )
+#pragma warning( disable : 4267)
+#define TINYGLTF_IMPLEMENTATION
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#define TINYGLTF_NOEXCEPTION
+#include "tiny_gltf.h"
+#pragma warning( pop )
+
+// Include to generate pseudo random series for TAA.
+#pragma warning( push )
+#pragma warning( disable : 4244)
+#include "../external/halton_sampler.h"
+#pragma warning( pop )
+
+// Used for resizing images to fit into the texture array.
+#pragma warning( push )
+#define STB_IMAGE_RESIZE_IMPLEMENTATION
+#include "../external/stb_image_resize.h"
+#pragma warning( pop )
+
+// Define some basic macros that we will use in the code.
+#define ArrayCount(arr) (sizeof(arr) / sizeof(arr[0]))
+#define BufferOffset(i) ((char *)0 + (i))
+
+// Define some global data for easier use.
+struct {
+    int MouseX;
+    int MouseY;
+    int ScreenWidth;
+    int ScreenHeight;
+    float InvScreenWidth;
+    float InvScreenHeight;
+    float DeltaTime;
+    char* GPUVendor;
+    char* GPUModel;
+} GLOBAL;
+
+// Include the base header for shaders. This will be included in every shader too.
+#include "../shaders/base.h"
+
+// Include our engine code.
+#include "platform.cpp"
+#include "profiler.cpp"
+#include "log.cpp"
+#include "input.cpp"
+#include "camera.cpp"
+#include "texture.cpp"
+#include "rendertarget.cpp"
+#include "shader.cpp"
+#include "debug_renderer.cpp"
+#include "scene.cpp"
+#include "random.cpp"
+#include "bvh.cpp"
+#include "light_clusters.cpp"
+#include "light_tree.cpp"
+#include "scene_renderer.cpp"
+#include "cpu_renderer.cpp"
+
+
+// Renders the scene on all CPU cores without creating a window or OpenGL context.
+// Usage: rrt_headless [-scene file.gltf] [-out image.png|image.hdr] [-width w] [-height h] [-spp n] [-threads n] [-tile n] [-integrator pixel|wavefront]
+int main(int argc, char *argv[])
+{
+    char* scenePath = (char*)"../../data/Fireplace/Fireplace.gltf";
+    char* outputPath = (char*)"rrt_headless.png";
+    int width = 800;
+    int height = 600;
+    int samplesPerPixel = 16;
+    int threadCount = 0;
+    int tileSize = CPU_RENDERER_DEFAULT_TILE_SIZE;
+    CPUIntegrator integrator = CPUIntegratorPerPixel;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-scene") == 0) {
+            scenePath = argv[i + 1];
+        } else if (strcmp(argv[i], "-out") == 0) {
+            outputPath = argv[i + 1];
+        } else if (strcmp(argv[i], "-width") == 0) {
+            width = glm::max(1, atoi(argv[i + 1]));
+        } else if (strcmp(argv[i], "-height") == 0) {
+            height = glm::max(1, atoi(argv[i + 1]));
+        } else if (strcmp(argv[i], "-spp") == 0) {
+            samplesPerPixel = glm::max(1, atoi(argv[i + 1]));
+        } else if (strcmp(argv[i], "-threads") == 0) {
+            threadCount = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-tile") == 0) {
+            tileSize = glm::max(1, atoi(argv[i + 1]));
+        } else if (strcmp(argv[i], "-integrator") == 0) {
+            integrator = strcmp(argv[i + 1], "wavefront") == 0 ? CPUIntegratorWavefront : CPUIntegratorPerPixel;
+        } else {
+            LogWarning("Unknown argument %s", argv[i]);
+        }
+    }
+
+    GLOBAL.ScreenWidth = width;
+    GLOBAL.ScreenHeight = height;
+    GLOBAL.InvScreenWidth = 1.0f / (float)GLOBAL.ScreenWidth;
+    GLOBAL.InvScreenHeight = 1.0f / (float)GLOBAL.ScreenHeight;
+    GlobalProfiler.Initialize();
+
+    // Same camera and light as the interactive renderer.
+    Camera* camera = new Camera();
+    camera->AspectRatio = (float)width / (float)height;
+    camera->Direction = glm::vec3(1.0f, 0.0f, 0.0f);
+    camera->Farplane = 1000.0f;
+    camera->Nearplane = 0.1f;
+    camera->FieldOfView = glm::radians(42.1f);
+    camera->Position = glm::vec3(0.0f, 2.5f, -1.50f);
+    camera->LookAt(glm::vec3(2.0f, 0.0f, 1.1f));
+    camera->UpdateProjectionMatrix();
+    camera->UpdateViewMatrix();
+
+    size_t scenePathLength = strlen(scenePath);
+    bool binaryScene = scenePathLength > 4 && strcmp(scenePath + scenePathLength - 4, ".glb") == 0;
+    Scene* scene = new Scene(scenePath, binaryScene, false);
+    if (!scene->IsValid) {
+        LogError("Could not load scene %s", scenePath);
+        return -1;
+    }
+    Node* lightNode = new Node();
+    lightNode->Position = glm::vec3(-0.1f, 2.3f, -0.3f);
+    glm::vec3 direction = glm::normalize(glm::vec3(3, -5, -3));
+    lightNode->Rotation = glm::quatLookAt(direction, glm::vec3(0, 1, 0));
+    lightNode->Scale = glm::vec3(1, 1, 1);
+    scene->RootNode->Children.push_back(lightNode);
+    Light* light = new Light();
+    light->ParentNode = lightNode;
+    light->Type = LightTypePoint;
+    light->Intensity = 100.0f;
+    light->Radius = 0.1f;
+    light->Range = 15.0f;
+    light->Color = glm::vec3(1, 1, 1);
+    light->InnerAngle = 0.3f;
+    light->OuterAngle = 0.5f;
+    scene->Lights.push_back(light);
+    scene->UpdateNodes();
+
+    BVH* bvh = new BVH();
+    bvh->GenerateBVH(scene);
+
+    CPURenderer* renderer = new CPURenderer(scene, bvh, width, height);
+    renderer->SamplesPerPixel = samplesPerPixel;
+    renderer->TileSize = tileSize;
+    renderer->Integrator = integrator;
+    if (threadCount > 0) {
+        renderer->ThreadCount = threadCount;
+    }
+    renderer->Render(camera);
+
+    LogMessage("Rendered %ix%i with %i spp on %i threads in %.2f s: %.3f Msamples/s (%u tiles stolen)",
+               width, height, samplesPerPixel, renderer->ThreadCount, renderer->RenderSeconds,
+               (double)renderer->RenderedSamples / glm::max(renderer->RenderSeconds, 1e-6) * 1e-6, renderer->StolenTiles);
+    LogMessage("Traced %.2f Mrays: %.3f Mrays/s",
+               (double)renderer->TracedRays * 1e-6, (double)renderer->TracedRays / glm::max(renderer->RenderSeconds, 1e-6) * 1e-6);
+    if (integrator == CPUIntegratorWavefront) {
+        LogMessage("Primary rays: %.3f Mrays/s, secondary rays: %.3f Mrays/s",
+                   (double)renderer->PrimaryRays / glm::max(renderer->PrimaryTraceSeconds, 1e-6) * 1e-6,
+                   (double)renderer->SecondaryRays / glm::max(renderer->SecondaryTraceSeconds, 1e-6) * 1e-6);
+    }
+
+    if (!renderer->WriteImage(outputPath, camera->Exposure)) {
+        LogError("Could not write %s", outputPath);
+        return -1;
+    }
+    LogMessage("Wrote %s", outputPath);
+    return 0;
+}
@@ -254,6 +254,21 @@ struct Profiler
         }
     }
     
+    // Latest available time in milliseconds of the GPU query with the given name, it is PROFILING_GPUFRAMELATENCY
+    // frames old. Returns a negative value when the query has no result yet.
+    float GetGPUTime(const char* name) {
+        for (uint32_t i = 0; i < this->newQueryIndexGPU; i++) {
+            if (strcmp(this->GPUQueries[i].name, name) == 0) {
+                QueryResult* result = &this->GPUQueries[i].frameResults[this->GPUQueries[i].lastFrameIndex];
+                if (result->frame == (uint32_t)-1) {
+                    return -1.0f;
+                }
+                return (float)(((double)(result->elapsedTime)) * this->GPUPerformanceFrequencyMSInv);
+            }
+        }
+        return -1.0f;
+    }
+
     void Draw() {
         if (ImGui::CollapsingHeader("CPU")) {
             for (size_t i = 0; i < this->newQueryIndexCPU; i++) {
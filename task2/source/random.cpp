@@ -0,0 +1,108 @@
+// Counter based random numbers for the CPU side (Philox4x32-10, see Salmon et al. 2011: "Parallel Random Numbers:
+// As Easy as 1, 2, 3"). Every number is a pure function of a key and a counter. The key selects a stream (a pixel
+// and sample of the CPU renderer, a node of the BVH build) and the counter the dimension within it, so parallel jobs
+// share no state and produce the same numbers bit for bit for any thread count and order of work.
+
+// Blocks of four numbers generated together by CPURandom::GetFloats, the lanes are independent and get vectorized.
+#define CPU_RANDOM_BATCH_SIZE 8
+
+struct CPURandom {
+    uint32_t Key[2];
+    // Next dimension returned by NextUInt, the numbers of its block are kept in Block.
+    uint32_t Dimension;
+    uint32_t Block[4];
+
+    CPURandom() {
+        Key[0] = 0;
+        Key[1] = 0;
+        Dimension = 0;
+    }
+
+    CPURandom(uint32_t pixelIndex, uint32_t sampleIndex) {
+        Key[0] = pixelIndex;
+        Key[1] = sampleIndex;
+        Dimension = 0;
+    }
+
+    // Ten Philox rounds over the blocks [firstBlock, firstBlock + N), result[word][lane] is word of block firstBlock + lane.
+    template <int N>
+    static void Generate(const uint32_t key[2], uint32_t firstBlock, uint32_t result[4][N]) {
+        uint32_t c0[N], c1[N], c2[N], c3[N];
+        for (int i = 0; i < N; ++i) {
+            c0[i] = firstBlock + (uint32_t)i;
+            c1[i] = 0;
+            c2[i] = 0;
+            c3[i] = 0;
+        }
+
+        uint32_t k0 = key[0];
+        uint32_t k1 = key[1];
+        for (int round = 0; round < 10; ++round) {
+            for (int i = 0; i < N; ++i) {
+                uint64_t product0 = (uint64_t)0xD2511F53u * c0[i];
+                uint64_t product1 = (uint64_t)0xCD9E8D57u * c2[i];
+                uint32_t next0 = (uint32_t)(product1 >> 32) ^ c1[i] ^ k0;
+                uint32_t next2 = (uint32_t)(product0 >> 32) ^ c3[i] ^ k1;
+                c1[i] = (uint32_t)product1;
+                c3[i] = (uint32_t)product0;
+                c0[i] = next0;
+                c2[i] = next2;
+            }
+            k0 += 0x9E3779B9u;
+            k1 += 0xBB67AE85u;
+        }
+
+        for (int i = 0; i < N; ++i) {
+            result[0][i] = c0[i];
+            result[1][i] = c1[i];
+            result[2][i] = c2[i];
+            result[3][i] = c3[i];
+        }
+    }
+
+    static float ToFloat(uint32_t value) {
+        return (float)(value >> 8) * (1.0f / 16777216.0f);
+    }
+
+    // Random access to any dimension of the stream, independent of the numbers drawn so far.
+    uint32_t GetUInt(uint32_t dimension) const {
+        uint32_t block[4][1];
+        Generate<1>(Key, dimension / 4, block);
+        return block[dimension % 4][0];
+    }
+
+    // Fills result with the dimensions [dimension, dimension + count), the same numbers NextFloat returns for them.
+    void GetFloats(uint32_t dimension, float* result, size_t count) const {
+        uint32_t batch[4][CPU_RANDOM_BATCH_SIZE];
+        uint32_t block = dimension / 4;
+        uint32_t word = dimension % 4;
+        size_t i = 0;
+        while (i < count) {
+            Generate<CPU_RANDOM_BATCH_SIZE>(Key, block, batch);
+            for (int lane = 0; lane < CPU_RANDOM_BATCH_SIZE && i < count; ++lane) {
+                for (; word < 4 && i < count; ++word) {
+                    result[i++] = ToFloat(batch[word][lane]);
+                }
+                word = 0;
+            }
+            block += CPU_RANDOM_BATCH_SIZE;
+        }
+    }
+
+    uint32_t NextUInt() {
+        uint32_t word = Dimension % 4;
+        if (word == 0) {
+            uint32_t block[4][1];
+            Generate<1>(Key, Dimension / 4, block);
+            for (int i = 0; i < 4; ++i) {
+                Block[i] = block[i][0];
+            }
+        }
+        ++Dimension;
+        return Block[word];
+    }
+
+    float NextFloat() {
+        return ToFloat(NextUInt());
+    }
+};
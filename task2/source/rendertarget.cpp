@@ -2,11 +2,14 @@
 struct RenderTargetLayer {
 	Texture* TargetTexture;
 	uint8_t MSAACount;
+	// Requested mip levels, -1 is a full chain that follows the size of the layer.
+	int32_t MipLevels;
 	char Name[256];
 
 	RenderTargetLayer(Texture* texture, uint8_t samples, char* name) {
 		TargetTexture = texture;
 		MSAACount = samples;
+		MipLevels = texture->MipLevels;
 		strcpy_s(Name, ArrayCount(Name), name);
 	}
 
@@ -14,13 +17,14 @@ struct RenderTargetLayer {
 		TargetTexture = new Texture(width, height, mipLevels, format, samples, wrap, filter);
 		TargetTexture->UpdateData();
 		MSAACount = samples;
+		MipLevels = mipLevels;
 		strcpy_s(Name, ArrayCount(Name), name);
 	}
 
 	void
 	Resize(int32_t width, int32_t height) {
 		if(TargetTexture->Width != width || TargetTexture->Height != height) {
-			Texture* texture = new Texture(width, height, TargetTexture->MipLevels, TargetTexture->Format, MSAACount, TargetTexture->Wrap, TargetTexture->Filter);	
+			Texture* texture = new Texture(width, height, MipLevels, TargetTexture->Format, MSAACount, TargetTexture->Wrap, TargetTexture->Filter);	
 			texture->UpdateData();
 			delete TargetTexture;
 			TargetTexture = texture;
@@ -153,7 +157,7 @@ struct RenderTarget {
 			} else {
 	    		glDisable(GL_MULTISAMPLE);
 			}
-	    	glViewport(0, 0, (int)((float)layer->TargetTexture->Width * viewportScaleX), (int)((float)layer->TargetTexture->Height * viewportScaleY));
+	    	glViewport(0, 0, (int)((float)layer->TargetTexture->Width * viewportScaleX + 0.5f), (int)((float)layer->TargetTexture->Height * viewportScaleY + 0.5f));
 		}		
 
 	    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, FBO);
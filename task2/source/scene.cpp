@@ -168,19 +168,45 @@ struct Light {
     float Radius;
 };
 
+// Converts a light into the layout used by the shaders.
+RendererLight GetRendererLight(Light* light) {
+    RendererLight rendererLight;
+    rendererLight.Position = glm::vec3(0.0f);
+    rendererLight.Direction = glm::vec3(0.0f, -1.0f, 0.0f);
+    Node* parentNode = light->ParentNode;
+    if(parentNode) {
+        rendererLight.Position = parentNode->Position;
+        glm::quat rot = parentNode->Rotation;
+        rendererLight.Direction = -glm::vec3(2.0f * (rot.x * rot.z + rot.w * rot.y), 2.0f * (rot.y * rot.z - rot.w * rot.x), 1.0f - 2.0f * (rot.x * rot.x + rot.y * rot.y));
+    }
+    rendererLight.Range = light->Range;
+    rendererLight.Type = light->Type;
+    rendererLight.Color = light->Color;
+    rendererLight.Intensity = light->Intensity;
+    rendererLight.Radius = light->Radius;
+    rendererLight.AngleScale = 1.0f / glm::max(0.001f, glm::cos(light->InnerAngle) - glm::cos(light->OuterAngle));
+    rendererLight.AngleOffset = -glm::cos(light->OuterAngle) * rendererLight.AngleScale;
+    rendererLight.Padding0 = 0.0f;
+    return rendererLight;
+}
+
 struct Scene {
     tinygltf::Model GLTFModel;
     bool IsValid;
+    // Without GPU uploads the scene can be loaded without an OpenGL context (e.g. for the CPU renderer).
+    bool UploadToGPU;
 
     std::unordered_map<int, Mesh*> Meshes;
     std::vector<Light*> Lights;
+    std::vector<RendererMaterial> Materials;
     Node* RootNode;
 
     uint32_t TextureArray = 0;
     uint32_t MaterialBuffer = 0;
     uint32_t MaterialBufferTexture = 0;
 
-    Scene(char* pathToGLTF, bool binaryData = false) {
+    Scene(char* pathToGLTF, bool binaryData = false, bool uploadToGPU = true) {
+        UploadToGPU = uploadToGPU;
         RootNode = new Node();
         tinygltf::TinyGLTF loader;
         std::string err;
@@ -282,7 +308,9 @@ struct Scene {
             newMesh->Groups.push_back(newGroup);
         }
 
-        newMesh->UpdateGPUBuffers();
+        if(UploadToGPU) {
+            newMesh->UpdateGPUBuffers();
+        }
 
         return newMesh;
     }
@@ -331,83 +359,56 @@ struct Scene {
         }
 
         // Update textures.
-        const int32_t TextureSize = 1024;
-        int32_t textureCount = (int32_t)model.textures.size();
-        int32_t mipLevelCount = (int32_t)glm::floor(log2(TextureSize)) + 1;
-        glGenTextures(1, &TextureArray);
-        glBindTexture(GL_TEXTURE_2D_ARRAY, TextureArray);
-        glTexStorage3D(GL_TEXTURE_2D_ARRAY, mipLevelCount, GL_RGBA8, TextureSize, TextureSize, textureCount);
-        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, 0);
-        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, mipLevelCount - 1);
-        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameterf(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_ANISOTROPY_EXT, 8);
-
-        uint8_t* scaledImage = new uint8_t[TextureSize * TextureSize * 4];
-        for(int32_t i = 0; i < textureCount; ++i) {
-            tinygltf::Texture &tex = model.textures[i];
-            tinygltf::Image &image = model.images[tex.source];
-
-            //Resize all textures to same size and put into texture array.
-            stbir_resize_uint8(image.image.data(), image.width, image.height, 0, scaledImage, TextureSize, TextureSize, 0, 4);
-            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, TextureSize, TextureSize, 1, GL_RGBA, GL_UNSIGNED_BYTE, scaledImage);
+        if(UploadToGPU) {
+            uploadTextures(model);
         }
-        glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
-        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
-        delete[] scaledImage;
-
 
         // Update materials.
         size_t materialCount = model.materials.size();
-        glGenBuffers(1, &MaterialBuffer);
-        glBindBuffer(GL_TEXTURE_BUFFER, MaterialBuffer);
-        glBufferData(GL_TEXTURE_BUFFER, sizeof(RendererMaterial) * materialCount, 0, GL_DYNAMIC_DRAW);
-        RendererMaterial* mappedMaterialBuffer = (RendererMaterial*)glMapBuffer(GL_TEXTURE_BUFFER, GL_WRITE_ONLY);
-
+        Materials.resize(materialCount);
         for(size_t i = 0; i < materialCount; ++i) {
             tinygltf::Material &mat = model.materials[i];
+            RendererMaterial* material = &Materials[i];
 
-            mappedMaterialBuffer->AlbedoFactor = glm::vec4((float)mat.pbrMetallicRoughness.baseColorFactor[0], (float)mat.pbrMetallicRoughness.baseColorFactor[1], (float)mat.pbrMetallicRoughness.baseColorFactor[2], (float)mat.pbrMetallicRoughness.baseColorFactor[3]);
-            mappedMaterialBuffer->AlphaCutoff = (float)mat.alphaCutoff;
-            mappedMaterialBuffer->RoughnessFactor = (float)mat.pbrMetallicRoughness.roughnessFactor;
-            mappedMaterialBuffer->EmissiveFactor = glm::vec3((float)mat.emissiveFactor[0], (float)mat.emissiveFactor[1], (float)mat.emissiveFactor[2]);
-            mappedMaterialBuffer->MetalnessFactor = (float)mat.pbrMetallicRoughness.metallicFactor;;
-            mappedMaterialBuffer->OcclusionStrength = (float)mat.occlusionTexture.strength;
-            mappedMaterialBuffer->NormalScale = (float)mat.normalTexture.scale;
+            material->AlbedoFactor = glm::vec4((float)mat.pbrMetallicRoughness.baseColorFactor[0], (float)mat.pbrMetallicRoughness.baseColorFactor[1], (float)mat.pbrMetallicRoughness.baseColorFactor[2], (float)mat.pbrMetallicRoughness.baseColorFactor[3]);
+            material->AlphaCutoff = (float)mat.alphaCutoff;
+            material->RoughnessFactor = (float)mat.pbrMetallicRoughness.roughnessFactor;
+            material->EmissiveFactor = glm::vec3((float)mat.emissiveFactor[0], (float)mat.emissiveFactor[1], (float)mat.emissiveFactor[2]);
+            material->MetalnessFactor = (float)mat.pbrMetallicRoughness.metallicFactor;;
+            material->OcclusionStrength = (float)mat.occlusionTexture.strength;
+            material->NormalScale = (float)mat.normalTexture.scale;
 
             uint32_t featureMask = 0;
-            mappedMaterialBuffer->AlbedoMap = mat.pbrMetallicRoughness.baseColorTexture.index;
-            if(mappedMaterialBuffer->AlbedoMap != -1) {    
+            material->AlbedoMap = mat.pbrMetallicRoughness.baseColorTexture.index;
+            if(material->AlbedoMap != -1) {    
                 featureMask |= MATERIAL_FEATURE_ALBEDO_MAP;
             } else {
                 featureMask &= ~MATERIAL_FEATURE_ALBEDO_MAP;
             }
 
-            mappedMaterialBuffer->MetallicRoughnessMap = mat.pbrMetallicRoughness.metallicRoughnessTexture.index;
-            if(mappedMaterialBuffer->MetallicRoughnessMap != -1) {    
+            material->MetallicRoughnessMap = mat.pbrMetallicRoughness.metallicRoughnessTexture.index;
+            if(material->MetallicRoughnessMap != -1) {    
                 featureMask |= MATERIAL_FEATURE_METALLICROUGHNESS_MAP;
             } else {
                 featureMask &= ~MATERIAL_FEATURE_METALLICROUGHNESS_MAP;
             }
 
-            mappedMaterialBuffer->NormalMap = mat.normalTexture.index;
-            if(mappedMaterialBuffer->NormalMap != -1) {    
+            material->NormalMap = mat.normalTexture.index;
+            if(material->NormalMap != -1) {    
                 featureMask |= MATERIAL_FEATURE_NORMAL_MAP;
             } else {
                 featureMask &= ~MATERIAL_FEATURE_NORMAL_MAP;
             }
 
-            mappedMaterialBuffer->OcclusionMap = mat.occlusionTexture.index;
-            if(mappedMaterialBuffer->OcclusionMap != -1) {    
+            material->OcclusionMap = mat.occlusionTexture.index;
+            if(material->OcclusionMap != -1) {    
                 featureMask |= MATERIAL_FEATURE_OCCLUSION_MAP;
             } else {
                 featureMask &= ~MATERIAL_FEATURE_OCCLUSION_MAP;
             }
 
-            mappedMaterialBuffer->EmissiveMap = mat.emissiveTexture.index;
-            if(mappedMaterialBuffer->EmissiveMap != -1) {
+            material->EmissiveMap = mat.emissiveTexture.index;
+            if(material->EmissiveMap != -1) {
                 featureMask |= MATERIAL_FEATURE_EMISSIVE_MAP;
             } else {
                 featureMask &= ~MATERIAL_FEATURE_EMISSIVE_MAP;
@@ -422,11 +423,16 @@ struct Scene {
                 featureMask |= MATERIAL_FEATURE_OPACITY_TRANSPARENT;
             }
 
-            mappedMaterialBuffer->FeatureMask = featureMask;
+            material->FeatureMask = featureMask;
+        }
 
-            ++mappedMaterialBuffer;
+        if(!UploadToGPU) {
+            return;
         }
-        glUnmapBuffer(GL_TEXTURE_BUFFER);
+
+        glGenBuffers(1, &MaterialBuffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, MaterialBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, sizeof(RendererMaterial) * materialCount, Materials.data(), GL_DYNAMIC_DRAW);
         glBindBuffer(GL_TEXTURE_BUFFER, 0);
 
         glGenTextures(1, &MaterialBufferTexture);
@@ -435,6 +441,35 @@ struct Scene {
         glBindTexture(GL_TEXTURE_BUFFER, 0);
     }
 
+    void uploadTextures(tinygltf::Model &model) {
+        const int32_t TextureSize = 1024;
+        int32_t textureCount = (int32_t)model.textures.size();
+        int32_t mipLevelCount = (int32_t)glm::floor(log2(TextureSize)) + 1;
+        glGenTextures(1, &TextureArray);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, TextureArray);
+        glTexStorage3D(GL_TEXTURE_2D_ARRAY, mipLevelCount, GL_RGBA8, TextureSize, TextureSize, textureCount);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, mipLevelCount - 1);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameterf(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_ANISOTROPY_EXT, 8);
+
+        uint8_t* scaledImage = new uint8_t[TextureSize * TextureSize * 4];
+        for(int32_t i = 0; i < textureCount; ++i) {
+            tinygltf::Texture &tex = model.textures[i];
+            tinygltf::Image &image = model.images[tex.source];
+
+            //Resize all textures to same size and put into texture array.
+            stbir_resize_uint8(image.image.data(), image.width, image.height, 0, scaledImage, TextureSize, TextureSize, 0, 4);
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, TextureSize, TextureSize, 1, GL_RGBA, GL_UNSIGNED_BYTE, scaledImage);
+        }
+        glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+        delete[] scaledImage;
+    }
+
     void DeleteNode(Node* node) {
         for (size_t i = 0; i < node->Children.size(); i++) {
             DeleteNode(node->Children[i]);
@@ -469,7 +504,9 @@ struct Scene {
             delete mesh.second;
         }
 
-        glDeleteBuffers(1, &MaterialBuffer);
+        if(MaterialBuffer) {
+            glDeleteBuffers(1, &MaterialBuffer);
+        }
         Meshes.clear();
     }
 };
\ No newline at end of file
@@ -1,4 +1,18 @@
 
+// Lighting passes that shade the gbuffer, the tiled and wavefront ones need compute shaders.
+enum LightingMode {
+    LightingModeFragment,
+    LightingModeTiled,
+    LightingModeWavefront,
+};
+
+// Resolution the reflection and refraction rays are traced at, see IsSecondaryRayPixel in shaders/base.h.
+enum SecondaryRayMode {
+    SecondaryRaysFull = SECONDARY_RAYS_FULL,
+    SecondaryRaysCheckerboard = SECONDARY_RAYS_CHECKERBOARD,
+    SecondaryRaysHalfResolution = SECONDARY_RAYS_HALF_RESOLUTION,
+};
+
 struct SceneRenderer {
 	Shader* PBRShader;
     Shader* GBufferShader;
@@ -7,6 +21,33 @@ struct SceneRenderer {
     uint32_t LightBuffer = 0;
     uint32_t LightBufferTexture = 0;    
     int LightBufferCount = 0;
+    int LightBufferCapacity = 0;
+    // Lights as uploaded to the light buffer, it is only written again when they change.
+    std::vector<RendererLight> RendererLights;
+    LightClusters* Clusters;
+    LightTree* LightHierarchy;
+    // Lights sampled from the light tree per shaded point instead of shading every light, 0 disables the sampling.
+    int LightSampleCount = 0;
+    // Points sampled on the emissive triangles of the BVH per shaded point.
+    int EmissiveSampleCount = 1;
+    // Reflection and refraction paths end below this throughput, see ContinuesPath in shaders/lighting.h.
+    float PathThroughputCutoff = 0.0f;
+
+    // Adaptive sampling shades the pixels whose relative error is above the threshold with up to RENDERING_MAX_SAMPLES
+    // samples, the budget are the additional samples per pixel of a frame on average (see GetAdaptiveSampleCount in
+    // shaders/lighting.h). The wavefront lighting always takes one sample.
+    bool UseAdaptiveSampling = false;
+    float AdaptiveSamplingThreshold = 0.1f;
+    float AdaptiveSamplingBudget = 0.5f;
+
+    // Spatiotemporal light resampling (ReSTIR), the gbuffer pixels are only shaded with one resampled light.
+    // The initial pass reads the reservoirs of the previous frame from the second target and writes the first,
+    // the spatial pass writes the final reservoirs back into the second one.
+    bool UseLightResampling = false;
+    Shader* LightResamplingInitialShader;
+    Shader* LightResamplingSpatialShader;
+    RenderTargetLayer* LightReservoirs[2];
+    RenderTarget* LightReservoirTargets[2];
 
     RenderTargetLayer* GBufferDepth;
     RenderTargetLayer* GBufferNormal;
@@ -18,6 +59,99 @@ struct SceneRenderer {
     RenderTarget* IntermediateBuffer;
     RenderTargetLayer* IntermediateBufferColor;
 
+    // The lighting pass writes the occluders of its shadow rays and the running mean and variance of the pixels
+    // (see shaders/sample_variance.h) every frame and reads the ones of the previous frame.
+    RenderTarget* LightingBuffer[2];
+    RenderTargetLayer* ShadowOccluderCache[2];
+    RenderTargetLayer* SampleVariance[2];
+
+    // Reflections and refractions traced for half or a quarter of the pixels. They are packed into the compact
+    // SecondaryLighting apart from the direct lighting and the upsample pass adds them back for every pixel
+    // (see shaders/secondary_upsample.frag).
+    SecondaryRayMode ActiveSecondaryRayMode = SecondaryRaysFull;
+    Shader* SecondaryRaysShader;
+    RenderTargetLayer* SecondaryLighting;
+    RenderTarget* SecondaryLightingBuffer;
+    Shader* SecondaryUpsampleShader;
+    RenderTargetLayer* UpsampleBufferColor;
+    RenderTarget* UpsampleBuffer;
+
+    // State the shadow occluder cache was traced with. As long as it stays the same the visibility is reused.
+    bool ReuseShadowVisibility = false;
+    std::vector<RendererLight> ShadowCacheLights;
+    glm::mat4 ShadowCacheView;
+    glm::mat4 ShadowCacheViewProjection;
+    BVH* ShadowCacheBVH = 0;
+    uint32_t ShadowCacheBVHNodes = 0;
+    glm::ivec2 ShadowCacheRenderingSize;
+    bool ShadowCacheSampledLights = false;
+
+    // Progressive accumulation averages the lighting of all frames into a float history as long as the camera, the
+    // lights, the BVH and the lighting settings stay the same and restarts on any change. Once ProgressiveFrameLimit
+    // frames are accumulated the image is converged and only the history is shown.
+    bool UseProgressiveAccumulation = false;
+    int ProgressiveFrameLimit = 1024;
+    int AccumulatedFrames = 0;
+    float AccumulationSeconds = 0.0f;
+    Shader* AccumulationShader;
+    RenderTargetLayer* AccumulationBufferColor[2];
+    RenderTarget* AccumulationBuffer[2];
+    int AccumulationIndex = 0;
+
+    // Temporal reprojection blends the lighting with the history of the previous frames the gbuffer motion maps onto
+    // the same surface and restarts the pixels that were occluded (see shaders/temporal.frag). Unlike the progressive
+    // accumulation it keeps working while the camera moves, the lights and lighting settings still reset it.
+    bool UseTemporalReprojection = false;
+    int TemporalMaxHistory = 16;
+    Shader* TemporalShader;
+    RenderTargetLayer* TemporalHistory[2];
+    RenderTargetLayer* TemporalGeometry[2];
+    RenderTarget* TemporalBuffer[2];
+    int TemporalIndex = 0;
+    bool TemporalHistoryValid = false;
+
+    // Edge-aware a-trous wavelet denoiser (see shaders/denoise.frag) over the lighting after the temporal reprojection.
+    // Every iteration filters with a 5x5 kernel at twice the spacing of the previous one, ping-ponging between the
+    // two targets, DenoiseIndex is the one holding the result.
+    bool UseDenoiser = false;
+    int DenoiseIterations = 4;
+    Shader* DenoiseShader;
+    RenderTargetLayer* DenoiseBufferColor[2];
+    RenderTarget* DenoiseBuffer[2];
+    int DenoiseIndex = 0;
+    char DenoiseQueryNames[DENOISE_MAX_ITERATIONS][32];
+
+    // Temporal anti-aliasing jitters the camera over RENDERING_TAA_SAMPLE_COUNT subpixel positions and resolves the
+    // frames into a history (see shaders/taa.frag), the tonemapping sharpens the result by TAASharpness. The progressive
+    // accumulation averages the jittered frames itself and replaces it.
+    bool UseTemporalAntiAliasing = false;
+    float TAASharpness = 0.25f;
+    Shader* TAAShader;
+    RenderTargetLayer* TAAHistory[2];
+    RenderTarget* TAABuffer[2];
+    int TAAIndex = 0;
+    bool TAAHistoryValid = false;
+
+    // Dynamic resolution renders everything up to the tonemapping into the lower left RenderingSize texels of the
+    // targets, which keep the window size, and the tonemapping upscales the result. The scale follows the GPU time of
+    // the gbuffer and lighting passes towards DynamicResolutionTargetMs (see UpdateDynamicResolution).
+    bool UseDynamicResolution = false;
+    float DynamicResolutionTargetMs = 33.0f;
+    float DynamicResolutionMinScale = 0.5f;
+    float DynamicResolutionScale = 1.0f;
+    int DynamicResolutionWaitFrames = 0;
+    glm::ivec2 RenderingSize;
+    glm::ivec2 RenderingSizeOld;
+
+    // State the accumulation was started with.
+    std::vector<RendererLight> AccumulationLights;
+    std::vector<float> AccumulationSettings;
+    glm::mat4 AccumulationView;
+    glm::mat4 AccumulationViewProjection;
+    BVH* AccumulationBVH = 0;
+    uint32_t AccumulationBVHNodes = 0;
+    glm::ivec2 AccumulationRenderingSize;
+
     RenderTarget* MainBuffer;
     RenderTargetLayer* MainBufferColor;
     RenderTargetLayer* MainBufferDepth;
@@ -25,6 +159,31 @@ struct SceneRenderer {
     uint32_t FullscreenVAO = 0;
     uint32_t FrameCount = 0;
 
+    LightingMode ActiveLightingMode = LightingModeFragment;
+    bool ComputeSupported = false;
+
+    // Lighting path that classifies 8x8 tiles of the gbuffer and shades every class with a kernel
+    // that only contains the lighting features that class needs.
+    Shader* TileClassifyShader = 0;
+    Shader* TileLightingShaders[LIGHTING_TILE_CLASS_COUNT];
+    uint32_t TileDispatchBuffer = 0;
+    uint32_t TileListBuffer = 0;
+    int TileListCapacity = 0;
+
+    // Lighting path that traces the reflection and refraction bounces in compute shader stages
+    // over sorted ray queues instead of inside one fragment invocation per pixel.
+    Shader* WavefrontGenerateShader = 0;
+    Shader* WavefrontBinShader = 0;
+    Shader* WavefrontScatterShader = 0;
+    Shader* WavefrontExtendShader = 0;
+    Shader* WavefrontShadeShader = 0;
+    Shader* WavefrontResolveShader = 0;
+    uint32_t WavefrontCounterBuffer = 0;
+    uint32_t WavefrontEmittedRayBuffer = 0;
+    uint32_t WavefrontSortedRayBuffer = 0;
+    uint32_t WavefrontRadianceBuffer = 0;
+    char WavefrontBounceQueryNames[RENDERING_MAX_RECURSIONS][32];
+
 	SceneRenderer(int width, int height) {
 		PBRShader = new Shader("PBR", "../../shaders/pbr.vert", "../../shaders/pbr.frag");
         GBufferShader = new Shader("GBuffer", "../../shaders/gbuffer.vert", "../../shaders/gbuffer.frag");
@@ -40,13 +199,130 @@ struct SceneRenderer {
 
         IntermediateBufferColor = new RenderTargetLayer(width, height, 1, GL_RGBA16F, 1, GL_CLAMP_TO_EDGE, GL_LINEAR, "Intermediate Buffer");
         IntermediateBuffer = new RenderTarget(0, 1, &IntermediateBufferColor);
+
+        for (int i = 0; i < ArrayCount(LightingBuffer); ++i) {
+            ShadowOccluderCache[i] = new RenderTargetLayer(width, height, 1, GL_RGBA32I, 1, GL_CLAMP_TO_EDGE, GL_NEAREST, "Shadow Occluder Cache");
+            // The mip chain provides the mean of the wanted samples over the screen for the sample budget.
+            SampleVariance[i] = new RenderTargetLayer(width, height, -1, GL_RGBA16F, 1, GL_CLAMP_TO_EDGE, GL_NEAREST_MIPMAP_NEAREST, "Sample Variance");
+            RenderTargetLayer* lightingTargets[] = {IntermediateBufferColor, ShadowOccluderCache[i], SampleVariance[i]};
+            LightingBuffer[i] = new RenderTarget(0, ArrayCount(lightingTargets), lightingTargets);
+        }
+        ClearShadowOccluderCache();
+        ClearSampleVariance();
+
+        // The checkerboard uses the left half of the texture, the half resolution the lower left quarter.
+        SecondaryRaysShader = new Shader("Secondary Rays", "../../shaders/post.vert", "../../shaders/secondary_rays.frag");
+        SecondaryLighting = new RenderTargetLayer(width, height, 1, GL_RGBA16F, 1, GL_CLAMP_TO_EDGE, GL_NEAREST, "Secondary Lighting");
+        SecondaryLightingBuffer = new RenderTarget(0, 1, &SecondaryLighting);
+        SecondaryUpsampleShader = new Shader("Secondary Upsample", "../../shaders/post.vert", "../../shaders/secondary_upsample.frag");
+        UpsampleBufferColor = new RenderTargetLayer(width, height, 1, GL_RGBA16F, 1, GL_CLAMP_TO_EDGE, GL_LINEAR, "Upsample Buffer");
+        UpsampleBuffer = new RenderTarget(0, 1, &UpsampleBufferColor);
+
+        LightResamplingInitialShader = new Shader("Light Resampling Initial", "../../shaders/pbr.vert", "../../shaders/restir_initial.frag");
+        LightResamplingSpatialShader = new Shader("Light Resampling Spatial", "../../shaders/pbr.vert", "../../shaders/restir_spatial.frag");
+        for (int i = 0; i < ArrayCount(LightReservoirs); ++i) {
+            LightReservoirs[i] = new RenderTargetLayer(width, height, 1, GL_RGBA32F, 1, GL_CLAMP_TO_EDGE, GL_NEAREST, "Light Reservoirs");
+            LightReservoirTargets[i] = new RenderTarget(0, 1, &LightReservoirs[i]);
+        }
+        ClearLightReservoirs();
+
+        AccumulationShader = new Shader("Accumulation", "../../shaders/post.vert", "../../shaders/accumulate.frag");
+        for (int i = 0; i < ArrayCount(AccumulationBuffer); ++i) {
+            AccumulationBufferColor[i] = new RenderTargetLayer(width, height, 1, GL_RGBA32F, 1, GL_CLAMP_TO_EDGE, GL_LINEAR, "Accumulation Buffer");
+            AccumulationBuffer[i] = new RenderTarget(0, 1, &AccumulationBufferColor[i]);
+        }
+
+        TemporalShader = new Shader("Temporal Reprojection", "../../shaders/post.vert", "../../shaders/temporal.frag");
+        for (int i = 0; i < ArrayCount(TemporalBuffer); ++i) {
+            TemporalHistory[i] = new RenderTargetLayer(width, height, 1, GL_RGBA16F, 1, GL_CLAMP_TO_EDGE, GL_LINEAR, "Temporal History");
+            TemporalGeometry[i] = new RenderTargetLayer(width, height, 1, GL_RGBA16F, 1, GL_CLAMP_TO_EDGE, GL_NEAREST, "Temporal Geometry");
+            RenderTargetLayer* temporalTargets[] = {TemporalHistory[i], TemporalGeometry[i]};
+            TemporalBuffer[i] = new RenderTarget(0, ArrayCount(temporalTargets), temporalTargets);
+        }
+        ClearTemporalHistory();
+
+        DenoiseShader = new Shader("Denoise", "../../shaders/post.vert", "../../shaders/denoise.frag");
+        for (int i = 0; i < ArrayCount(DenoiseBuffer); ++i) {
+            DenoiseBufferColor[i] = new RenderTargetLayer(width, height, 1, GL_RGBA16F, 1, GL_CLAMP_TO_EDGE, GL_LINEAR, "Denoise Buffer");
+            DenoiseBuffer[i] = new RenderTarget(0, 1, &DenoiseBufferColor[i]);
+        }
+        for (int i = 0; i < DENOISE_MAX_ITERATIONS; ++i) {
+            sprintf_s(DenoiseQueryNames[i], ArrayCount(DenoiseQueryNames[i]), "Denoise Iteration %i", i + 1);
+        }
+
+        TAAShader = new Shader("TAA", "../../shaders/post.vert", "../../shaders/taa.frag");
+        for (int i = 0; i < ArrayCount(TAABuffer); ++i) {
+            TAAHistory[i] = new RenderTargetLayer(width, height, 1, GL_RGBA16F, 1, GL_CLAMP_TO_EDGE, GL_LINEAR, "TAA History");
+            TAABuffer[i] = new RenderTarget(0, 1, &TAAHistory[i]);
+        }
                         
         MainBufferColor = new RenderTargetLayer(width, height, 1, GL_RGBA8, 1, GL_CLAMP_TO_EDGE, GL_LINEAR, "Main Color Buffer");
         MainBuffer = new RenderTarget(GBufferDepth, 1, &MainBufferColor);
+        RenderingSize = GetScaledRenderingSize(1.0f);
+        RenderingSizeOld = RenderingSize;
 
         glGenVertexArrays(1, &FullscreenVAO);
+        Clusters = new LightClusters();
+        LightHierarchy = new LightTree();
+
+        // Compute shaders and storage buffers are core in OpenGL 4.3 but not available on every platform (e.g. macOS).
+        ComputeSupported = GLEW_ARB_compute_shader && GLEW_ARB_shader_storage_buffer_object && GLEW_ARB_shader_image_load_store && GLEW_ARB_shading_language_420pack;
+        if(ComputeSupported) {
+            TileClassifyShader = new Shader("Tile Classify", 0, 0, 0, 0, 0, "../../shaders/tiled_classify.comp");
+            TileLightingShaders[LIGHTING_TILE_CLASS_BACKGROUND] = new Shader("Tile Lighting Background", 0, 0, 0, 0, 0, "../../shaders/tiled_lighting_background.comp");
+            TileLightingShaders[LIGHTING_TILE_CLASS_DIFFUSE] = new Shader("Tile Lighting Diffuse", 0, 0, 0, 0, 0, "../../shaders/tiled_lighting_diffuse.comp");
+            TileLightingShaders[LIGHTING_TILE_CLASS_GLOSSY] = new Shader("Tile Lighting Glossy", 0, 0, 0, 0, 0, "../../shaders/tiled_lighting_glossy.comp");
+            TileLightingShaders[LIGHTING_TILE_CLASS_TRANSPARENT] = new Shader("Tile Lighting Transparent", 0, 0, 0, 0, 0, "../../shaders/tiled_lighting_transparent.comp");
+
+            glGenBuffers(1, &TileDispatchBuffer);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, TileDispatchBuffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(RendererTileDispatch) * LIGHTING_TILE_CLASS_COUNT, 0, GL_DYNAMIC_DRAW);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+            glGenBuffers(1, &TileListBuffer);
+            ResizeTileBuffers(width, height);
+
+            WavefrontGenerateShader = new Shader("Wavefront Generate", 0, 0, 0, 0, 0, "../../shaders/wavefront_generate.comp");
+            WavefrontBinShader = new Shader("Wavefront Bin", 0, 0, 0, 0, 0, "../../shaders/wavefront_bin.comp");
+            WavefrontScatterShader = new Shader("Wavefront Scatter", 0, 0, 0, 0, 0, "../../shaders/wavefront_scatter.comp");
+            WavefrontExtendShader = new Shader("Wavefront Extend", 0, 0, 0, 0, 0, "../../shaders/wavefront_extend.comp");
+            WavefrontShadeShader = new Shader("Wavefront Shade", 0, 0, 0, 0, 0, "../../shaders/wavefront_shade.comp");
+            WavefrontResolveShader = new Shader("Wavefront Resolve", 0, 0, 0, 0, 0, "../../shaders/wavefront_resolve.comp");
+
+            glGenBuffers(1, &WavefrontCounterBuffer);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, WavefrontCounterBuffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(RendererWavefrontCounters), 0, GL_DYNAMIC_DRAW);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+            glGenBuffers(1, &WavefrontEmittedRayBuffer);
+            glGenBuffers(1, &WavefrontSortedRayBuffer);
+            glGenBuffers(1, &WavefrontRadianceBuffer);
+            ResizeWavefrontBuffers(width, height);
+
+            for (int i = 0; i < RENDERING_MAX_RECURSIONS; ++i) {
+                sprintf_s(WavefrontBounceQueryNames[i], ArrayCount(WavefrontBounceQueryNames[i]), "Wavefront Bounce %i", i + 1);
+            }
+        }
 	}
 
+    void ResizeTileBuffers(int width, int height) {
+        // Every class list has room for all tiles of the screen.
+        TileListCapacity = ((width + LIGHTING_TILE_SIZE - 1) / LIGHTING_TILE_SIZE) * ((height + LIGHTING_TILE_SIZE - 1) / LIGHTING_TILE_SIZE);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, TileListBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, (size_t)TileListCapacity * LIGHTING_TILE_CLASS_COUNT * sizeof(uint32_t), 0, GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+
+    void ResizeWavefrontBuffers(int width, int height) {
+        // Every pixel has at most one reflection and one refraction ray in flight.
+        size_t pixelCount = (size_t)width * (size_t)height;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, WavefrontEmittedRayBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, pixelCount * 2 * sizeof(RendererWavefrontRay), 0, GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, WavefrontSortedRayBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, pixelCount * 2 * sizeof(RendererWavefrontRay), 0, GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, WavefrontRadianceBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, pixelCount * 3 * sizeof(glm::vec4), 0, GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+
     void Resize(int width, int height) {
         if(width < 2) {
             width = 2;
@@ -57,7 +333,393 @@ struct SceneRenderer {
 
         GBuffer->Resize(width, height);
         IntermediateBuffer->Resize(width, height);
+        for (int i = 0; i < ArrayCount(LightingBuffer); ++i) {
+            LightingBuffer[i]->Resize(width, height);
+        }
+        ClearShadowOccluderCache();
+        ClearSampleVariance();
+        SecondaryLightingBuffer->Resize(width, height);
+        UpsampleBuffer->Resize(width, height);
+        for (int i = 0; i < ArrayCount(LightReservoirTargets); ++i) {
+            LightReservoirTargets[i]->Resize(width, height);
+        }
+        ClearLightReservoirs();
+        for (int i = 0; i < ArrayCount(AccumulationBuffer); ++i) {
+            AccumulationBuffer[i]->Resize(width, height);
+        }
+        AccumulatedFrames = 0;
+        for (int i = 0; i < ArrayCount(TemporalBuffer); ++i) {
+            TemporalBuffer[i]->Resize(width, height);
+        }
+        ClearTemporalHistory();
+        for (int i = 0; i < ArrayCount(DenoiseBuffer); ++i) {
+            DenoiseBuffer[i]->Resize(width, height);
+        }
+        for (int i = 0; i < ArrayCount(TAABuffer); ++i) {
+            TAABuffer[i]->Resize(width, height);
+        }
+        TAAHistoryValid = false;
         MainBuffer->Resize(width, height);
+        RenderingSize = GetScaledRenderingSize(UseDynamicResolution ? DynamicResolutionScale : 1.0f);
+        RenderingSizeOld = RenderingSize;
+        if(ComputeSupported) {
+            ResizeTileBuffers(width, height);
+            ResizeWavefrontBuffers(width, height);
+        }
+    }
+
+    void ClearShadowOccluderCache() {
+        ShadowCacheLights.clear();
+        ReuseShadowVisibility = false;
+
+        // -1 marks that no occluder is known.
+        GLint noOccluders[] = {-1, -1, -1, -1};
+        for (int i = 0; i < ArrayCount(LightingBuffer); ++i) {
+            LightingBuffer[i]->Bind();
+            glClearBufferiv(GL_COLOR, 1, noOccluders);
+            LightingBuffer[i]->Unbind();
+        }
+    }
+
+    void ClearSampleVariance() {
+        // A mean of 0 marks a pixel without history.
+        GLfloat noHistory[] = {0.0f, 0.0f, 0.0f, 0.0f};
+        for (int i = 0; i < ArrayCount(LightingBuffer); ++i) {
+            LightingBuffer[i]->Bind();
+            glClearBufferfv(GL_COLOR, 2, noHistory);
+            LightingBuffer[i]->Unbind();
+            SampleVariance[i]->TargetTexture->GenerateMipmap();
+        }
+    }
+
+    void ClearLightReservoirs() {
+        // A light index of -1 marks an empty reservoir.
+        for (int i = 0; i < ArrayCount(LightReservoirTargets); ++i) {
+            LightReservoirTargets[i]->Clear(false, true, false, 1.0f, glm::vec4(-1.0f, 0.0f, 0.0f, 0.0f));
+        }
+    }
+
+    void ClearTemporalHistory() {
+        // A linear depth of 0 matches no surface.
+        for (int i = 0; i < ArrayCount(TemporalBuffer); ++i) {
+            TemporalBuffer[i]->Clear(false, true, false, 1.0f, glm::vec4(0.0f));
+        }
+    }
+
+    glm::ivec2 GetTargetSize() {
+        return glm::ivec2(GBufferDepth->TargetTexture->Width, GBufferDepth->TargetTexture->Height);
+    }
+
+    glm::ivec2 GetScaledRenderingSize(float scale) {
+        glm::ivec2 size = glm::ivec2(glm::round(glm::vec2(GetTargetSize()) * scale));
+        return glm::clamp(size, glm::ivec2(1), GetTargetSize());
+    }
+
+    // Part of the targets the current and the previous frame render to, as texture coordinate scale.
+    glm::vec2 GetRenderingScale() {
+        return glm::vec2(RenderingSize) / glm::vec2(GetTargetSize());
+    }
+
+    glm::vec2 GetRenderingScaleOld() {
+        return glm::vec2(RenderingSizeOld) / glm::vec2(GetTargetSize());
+    }
+
+    // Picks the rendering size of the next frame, before the camera jitter that depends on it. The cost of the gbuffer
+    // and lighting grows with the pixel count, so the scale moves by the square root of the ratio of the target to the
+    // measured time, by at most one step per change and only outside of the tolerance. The GPU timings arrive
+    // PROFILING_GPUFRAMELATENCY frames late, after a change the controller waits until they were measured at the new
+    // size. The progressive accumulation keeps the size it started with.
+    void UpdateDynamicResolution() {
+        if(!UseDynamicResolution) {
+            DynamicResolutionScale = 1.0f;
+        } else if(DynamicResolutionWaitFrames > 0) {
+            --DynamicResolutionWaitFrames;
+        } else if(AccumulatedFrames == 0) {
+            float gBufferMs = GlobalProfiler.GetGPUTime("GBuffer");
+            float lightingMs = GlobalProfiler.GetGPUTime("Compute Lighting");
+            float ratio = DynamicResolutionTargetMs / glm::max(gBufferMs + lightingMs, 0.001f);
+            if(gBufferMs >= 0.0f && lightingMs >= 0.0f && glm::abs(ratio - 1.0f) > (float)RENDERING_DYNAMIC_RESOLUTION_TOLERANCE) {
+                float step = glm::clamp(glm::sqrt(ratio), (float)RENDERING_DYNAMIC_RESOLUTION_STEP_DOWN, (float)RENDERING_DYNAMIC_RESOLUTION_STEP_UP);
+                DynamicResolutionScale = glm::clamp(DynamicResolutionScale * step, glm::min(DynamicResolutionMinScale, 1.0f), 1.0f);
+            }
+        }
+
+        glm::ivec2 size = GetScaledRenderingSize(DynamicResolutionScale);
+        if(size != RenderingSize) {
+            RenderingSize = size;
+            DynamicResolutionWaitFrames = PROFILING_GPUFRAMELATENCY + 1;
+            // The running variance belongs to pixels that now cover other parts of the screen, the texels outside of
+            // the rendered part have to stay cleared for the mean of adaptive sampling.
+            ClearSampleVariance();
+        }
+    }
+
+    // The reduced resolutions need the secondary rays and upsample passes, without them every pixel traces the
+    // secondary rays.
+    int GetSecondaryRayMode() {
+        if(!SecondaryRaysShader->IsValid || !SecondaryUpsampleShader->IsValid) {
+            return SECONDARY_RAYS_FULL;
+        }
+        return (int)ActiveSecondaryRayMode;
+    }
+
+    // Size of the part of SecondaryLighting that the pattern of the mode fills.
+    glm::ivec2 GetSecondaryLightingSize() {
+        glm::ivec2 size = RenderingSize;
+        if(GetSecondaryRayMode() == SECONDARY_RAYS_CHECKERBOARD) {
+            return glm::ivec2((size.x + 1) / 2, size.y);
+        }
+        return (size + 1) / 2;
+    }
+
+    void DrawSecondaryRays(Scene* scene, Camera* camera, BVH* bvh) {
+        auto gpuSecondary = GlobalProfiler.StartGPUQuery("Secondary Rays");
+        SecondaryRaysShader->Bind();
+        SetLightingUniforms(SecondaryRaysShader, scene, camera, bvh);
+        SecondaryLightingBuffer->Bind();
+        glm::ivec2 size = GetSecondaryLightingSize();
+        glViewport(0, 0, size.x, size.y);
+        glBindVertexArray(FullscreenVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glBindVertexArray(0);
+        SecondaryLightingBuffer->Unbind();
+        GlobalProfiler.StopGPUQuery(gpuSecondary);
+    }
+
+    // Lighting of the current frame with the reconstructed reflections and refractions.
+    Texture* GetCurrentLighting() {
+        if(GetSecondaryRayMode() != SECONDARY_RAYS_FULL) {
+            return UpsampleBufferColor->TargetTexture;
+        }
+        return IntermediateBufferColor->TargetTexture;
+    }
+
+    void UpsampleSecondaryLighting(Camera* camera) {
+        auto gpuUpsample = GlobalProfiler.StartGPUQuery("Secondary Upsample");
+        SecondaryUpsampleShader->Bind();
+        glm::vec2 scale = GetRenderingScale();
+        SecondaryUpsampleShader->SetUniform("RenderingScale", scale);
+        SecondaryUpsampleShader->SetUniform("RenderingScaleOld", GetRenderingScaleOld());
+        SecondaryUpsampleShader->SetUniform("RenderingSize", RenderingSize);
+        SecondaryUpsampleShader->SetUniform("CameraInvViewProjection", camera->ViewProjectionInv);
+        SecondaryUpsampleShader->SetUniform("CameraPosition", camera->Position);
+        SecondaryUpsampleShader->SetUniform("SecondaryRayMode", GetSecondaryRayMode());
+        SecondaryUpsampleShader->SetUniform("FrameCount", FrameCount);
+        SecondaryUpsampleShader->SetTexture("IntermediateBuffer", 0, IntermediateBufferColor->TargetTexture);
+        SecondaryUpsampleShader->SetTexture("SecondaryLighting", 1, SecondaryLighting->TargetTexture);
+        SecondaryUpsampleShader->SetTexture("GBufferDepth", 2, GBufferDepth->TargetTexture);
+        SecondaryUpsampleShader->SetTexture("GBufferNormal", 3, GBufferNormal->TargetTexture);
+        UpsampleBuffer->Bind(scale.x, scale.y);
+        glBindVertexArray(FullscreenVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glBindVertexArray(0);
+        UpsampleBuffer->Unbind();
+        GlobalProfiler.StopGPUQuery(gpuUpsample);
+    }
+
+    bool IsLightResamplingActive() {
+        return UseLightResampling && LightResamplingInitialShader->IsValid && LightResamplingSpatialShader->IsValid;
+    }
+
+    // Only the light placement matters for the visibility, the color and intensity may change.
+    static bool CastsSameShadows(const RendererLight& a, const RendererLight& b) {
+        return a.Position == b.Position && a.Direction == b.Direction && a.Range == b.Range && a.Type == b.Type &&
+               a.AngleScale == b.AngleScale && a.AngleOffset == b.AngleOffset;
+    }
+
+    void UpdateShadowCacheState(Scene* scene, Camera* camera, BVH* bvh) {
+        // TAA jitter is ignored, it moves the shadow edges by less than a pixel.
+        bool isStatic = ShadowCacheLights.size() == RendererLights.size() && ShadowCacheView == camera->View &&
+                        ShadowCacheViewProjection == camera->ViewProjectionUnjittered &&
+                        ShadowCacheBVH == bvh && ShadowCacheBVHNodes == bvh->NodeBufferTexture && ShadowCacheRenderingSize == RenderingSize;
+        // Sampled lights don't trace into the cache, so it is only complete after a frame that shaded every light.
+        bool sampledLights = LightSampleCount > 0 || IsLightResamplingActive();
+        isStatic = isStatic && !sampledLights && !ShadowCacheSampledLights;
+        for (size_t i = 0; isStatic && i < RendererLights.size(); ++i) {
+            isStatic = CastsSameShadows(RendererLights[i], ShadowCacheLights[i]);
+        }
+        ShadowCacheLights = RendererLights;
+        ShadowCacheView = camera->View;
+        ShadowCacheViewProjection = camera->ViewProjectionUnjittered;
+        ShadowCacheBVH = bvh;
+        ShadowCacheBVHNodes = bvh->NodeBufferTexture;
+        ShadowCacheRenderingSize = RenderingSize;
+        ShadowCacheSampledLights = sampledLights;
+
+        // The first frame after a change traces the shadow rays and fills the cache.
+        ReuseShadowVisibility = isStatic;
+    }
+
+    // Everything besides the scene and the camera that changes the lighting.
+    std::vector<float> GetLightingSettings() {
+        float settings[] = {(float)ActiveLightingMode, (float)LightSampleCount, (float)EmissiveSampleCount, PathThroughputCutoff,
+                            (float)IsLightResamplingActive(), (float)UseAdaptiveSampling, AdaptiveSamplingThreshold, AdaptiveSamplingBudget,
+                            (float)GetSecondaryRayMode(), (float)IsTemporalReprojectionActive(), (float)TemporalMaxHistory, (float)IsDenoiserActive(), (float)DenoiseIterations};
+        return std::vector<float>(settings, settings + ArrayCount(settings));
+    }
+
+    void UpdateAccumulationState(Camera* camera, BVH* bvh) {
+        // The jitter is part of the accumulation, it antialiases the edges.
+        std::vector<float> settings = GetLightingSettings();
+        bool lightingStatic = AccumulationBVH == bvh && AccumulationBVHNodes == bvh->NodeBufferTexture && AccumulationSettings == settings &&
+                              AccumulationLights.size() == RendererLights.size() &&
+                              (RendererLights.size() == 0 || memcmp(AccumulationLights.data(), RendererLights.data(), sizeof(RendererLight) * RendererLights.size()) == 0);
+        bool isStatic = UseProgressiveAccumulation && lightingStatic && AccumulationView == camera->View &&
+                        AccumulationViewProjection == camera->ViewProjectionUnjittered && AccumulationRenderingSize == RenderingSize;
+        AccumulationLights = RendererLights;
+        AccumulationSettings = settings;
+        AccumulationView = camera->View;
+        AccumulationViewProjection = camera->ViewProjectionUnjittered;
+        AccumulationBVH = bvh;
+        AccumulationBVHNodes = bvh->NodeBufferTexture;
+        AccumulationRenderingSize = RenderingSize;
+
+        if(!isStatic) {
+            AccumulatedFrames = 0;
+            AccumulationSeconds = 0.0f;
+        }
+        // The reprojection handles the camera, the history of other lighting is wrong everywhere.
+        TemporalHistoryValid = lightingStatic;
+    }
+
+    bool IsAccumulationConverged() {
+        return UseProgressiveAccumulation && AccumulatedFrames >= ProgressiveFrameLimit;
+    }
+
+    bool IsTemporalReprojectionActive() {
+        return UseTemporalReprojection && TemporalShader->IsValid;
+    }
+
+    bool IsDenoiserActive() {
+        return UseDenoiser && DenoiseShader->IsValid;
+    }
+
+    // Lighting of the current frame after the temporal reprojection.
+    Texture* GetReprojectedLighting() {
+        if(IsTemporalReprojectionActive()) {
+            return TemporalHistory[TemporalIndex]->TargetTexture;
+        }
+        return GetCurrentLighting();
+    }
+
+    // Lighting of the current frame after the temporal reprojection and the denoiser.
+    Texture* GetLightingResult() {
+        if(IsDenoiserActive()) {
+            return DenoiseBufferColor[DenoiseIndex]->TargetTexture;
+        }
+        return GetReprojectedLighting();
+    }
+
+    void DrawTemporalReprojection(Camera* camera) {
+        auto gpuTemporal = GlobalProfiler.StartGPUQuery("Temporal Reprojection");
+        int target = (TemporalIndex + 1) % ArrayCount(TemporalBuffer);
+        TemporalShader->Bind();
+        glm::vec2 scale = GetRenderingScale();
+        TemporalShader->SetUniform("RenderingScale", scale);
+        TemporalShader->SetUniform("RenderingScaleOld", GetRenderingScaleOld());
+        TemporalShader->SetUniform("RenderingSizeOld", RenderingSizeOld);
+        TemporalShader->SetUniform("CameraViewProjection", camera->ViewProjection);
+        TemporalShader->SetUniform("CameraInvViewProjection", camera->ViewProjectionInv);
+        TemporalShader->SetUniform("CameraViewProjectionOld", camera->ViewProjectionOld);
+        TemporalShader->SetUniform("TemporalMaxHistory", TemporalMaxHistory);
+        TemporalShader->SetUniform("TemporalHistoryValid", (int32_t)TemporalHistoryValid);
+        TemporalShader->SetTexture("IntermediateBuffer", 0, GetCurrentLighting());
+        TemporalShader->SetTexture("GBufferDepth", 1, GBufferDepth->TargetTexture);
+        TemporalShader->SetTexture("GBufferNormal", 2, GBufferNormal->TargetTexture);
+        TemporalShader->SetTexture("GBufferMotion", 3, GBufferMotion->TargetTexture);
+        TemporalShader->SetTexture("TemporalHistory", 4, TemporalHistory[TemporalIndex]->TargetTexture);
+        TemporalShader->SetTexture("TemporalGeometryHistory", 5, TemporalGeometry[TemporalIndex]->TargetTexture);
+        TemporalBuffer[target]->Bind(scale.x, scale.y);
+        glBindVertexArray(FullscreenVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glBindVertexArray(0);
+        TemporalBuffer[target]->Unbind();
+        GlobalProfiler.StopGPUQuery(gpuTemporal);
+
+        TemporalIndex = target;
+    }
+
+    void Denoise(Camera* camera) {
+        int iterations = glm::clamp(DenoiseIterations, 1, DENOISE_MAX_ITERATIONS);
+        DenoiseShader->Bind();
+        glm::vec2 scale = GetRenderingScale();
+        DenoiseShader->SetUniform("RenderingScale", scale);
+        DenoiseShader->SetUniform("RenderingScaleOld", GetRenderingScaleOld());
+        DenoiseShader->SetUniform("RenderingSize", RenderingSize);
+        DenoiseShader->SetUniform("CameraInvViewProjection", camera->ViewProjectionInv);
+        DenoiseShader->SetUniform("CameraPosition", camera->Position);
+        DenoiseShader->SetUniform("DenoiseTemporalHistory", (int32_t)IsTemporalReprojectionActive());
+        DenoiseShader->SetTexture("GBufferDepth", 1, GBufferDepth->TargetTexture);
+        DenoiseShader->SetTexture("GBufferNormal", 2, GBufferNormal->TargetTexture);
+        DenoiseShader->SetTexture("GBufferAlbedoTransparency", 3, GBufferAlbedoTransparency->TargetTexture);
+        DenoiseShader->SetTexture("SampleVariance", 4, SampleVariance[FrameCount & 1]->TargetTexture);
+        glBindVertexArray(FullscreenVAO);
+        for (int i = 0; i < iterations; ++i) {
+            auto gpuDenoise = GlobalProfiler.StartGPUQuery(DenoiseQueryNames[i]);
+            DenoiseShader->SetUniform("DenoiseStepSize", 1 << i);
+            DenoiseShader->SetUniform("DenoiseFirstIteration", (int32_t)(i == 0));
+            DenoiseShader->SetUniform("DenoiseLastIteration", (int32_t)(i == iterations - 1));
+            DenoiseShader->SetTexture("IntermediateBuffer", 0, i == 0 ? GetReprojectedLighting() : DenoiseBufferColor[(i + 1) & 1]->TargetTexture);
+            DenoiseBuffer[i & 1]->Bind(scale.x, scale.y);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            DenoiseBuffer[i & 1]->Unbind();
+            GlobalProfiler.StopGPUQuery(gpuDenoise);
+        }
+        glBindVertexArray(0);
+        DenoiseIndex = (iterations - 1) & 1;
+    }
+
+    bool IsTemporalAntiAliasingActive() {
+        return UseTemporalAntiAliasing && TAAShader->IsValid && !UseProgressiveAccumulation;
+    }
+
+    // The camera has to jitter its projection for the temporal anti-aliasing and the progressive accumulation.
+    bool UsesCameraJitter() {
+        return UseTemporalAntiAliasing || UseProgressiveAccumulation;
+    }
+
+    void ResolveTemporalAntiAliasing() {
+        auto gpuTAA = GlobalProfiler.StartGPUQuery("TAA");
+        int target = (TAAIndex + 1) % ArrayCount(TAABuffer);
+        TAAShader->Bind();
+        glm::vec2 scale = GetRenderingScale();
+        TAAShader->SetUniform("RenderingScale", scale);
+        TAAShader->SetUniform("RenderingScaleOld", GetRenderingScaleOld());
+        TAAShader->SetUniform("RenderingSize", RenderingSize);
+        TAAShader->SetUniform("TAAHistoryValid", (int32_t)TAAHistoryValid);
+        TAAShader->SetTexture("IntermediateBuffer", 0, GetLightingResult());
+        TAAShader->SetTexture("TAAHistory", 1, TAAHistory[TAAIndex]->TargetTexture);
+        TAAShader->SetTexture("GBufferDepth", 2, GBufferDepth->TargetTexture);
+        TAAShader->SetTexture("GBufferMotion", 3, GBufferMotion->TargetTexture);
+        TAABuffer[target]->Bind(scale.x, scale.y);
+        glBindVertexArray(FullscreenVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glBindVertexArray(0);
+        TAABuffer[target]->Unbind();
+        GlobalProfiler.StopGPUQuery(gpuTAA);
+
+        TAAIndex = target;
+        TAAHistoryValid = true;
+    }
+
+    void Accumulate() {
+        auto gpuAccumulation = GlobalProfiler.StartGPUQuery("Accumulation");
+        int target = (AccumulationIndex + 1) % ArrayCount(AccumulationBuffer);
+        glm::vec2 scale = GetRenderingScale();
+        AccumulationShader->Bind();
+        AccumulationShader->SetUniform("AccumulationWeight", 1.0f / (float)(AccumulatedFrames + 1));
+        AccumulationShader->SetTexture("IntermediateBuffer", 0, GetLightingResult());
+        AccumulationShader->SetTexture("AccumulationHistory", 1, AccumulationBufferColor[AccumulationIndex]->TargetTexture);
+        AccumulationBuffer[target]->Bind(scale.x, scale.y);
+        glBindVertexArray(FullscreenVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glBindVertexArray(0);
+        AccumulationBuffer[target]->Unbind();
+        GlobalProfiler.StopGPUQuery(gpuAccumulation);
+
+        AccumulationIndex = target;
+        ++AccumulatedFrames;
+        AccumulationSeconds += GLOBAL.DeltaTime;
     }
 
     void DrawMesh(Scene* scene, Mesh* mesh) {
@@ -97,123 +759,395 @@ struct SceneRenderer {
 
     void Draw(Scene* scene, Camera* camera, BVH* bvh) {
         if(scene->IsValid && GBufferShader->IsValid && PBRShader->IsValid) {
-            auto gpuGBuffer = GlobalProfiler.StartGPUQuery("GBuffer");
-            glEnable(GL_DEPTH_TEST);
-            glDepthFunc(GL_LESS);
-            glDepthMask(GL_TRUE);
-            glEnable(GL_CULL_FACE);
-            glCullFace(GL_FRONT);
-
-            // Draw GBuffer
-            GBuffer->Clear(true, true, true, 1.0f, glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
-            GBuffer->Bind();
-
             UpdateLights(scene);
-            GBufferShader->Bind();
-            GBufferShader->SetUniform("ViewProjection", camera->ViewProjection);
-            GBufferShader->SetUniform("ViewProjectionOld", camera->ViewProjectionOld);   
-            GBufferShader->SetTextureBuffer("MaterialBuffer", 0, scene->MaterialBufferTexture);
-            GBufferShader->SetTextureArray("MaterialTextures", 1, scene->TextureArray);
-
-            DrawNode(scene, scene->RootNode);
-            GBuffer->Unbind();
-
-            GlobalProfiler.StopGPUQuery(gpuGBuffer);
-
-            auto gpuComputeLighting = GlobalProfiler.StartGPUQuery("Compute Lighting");
-
-            // Draw to lighting buffers.
-            Shader* pbr = PBRShader;
-            
-            glDepthFunc(GL_ALWAYS);
-            glDisable(GL_DEPTH_TEST);
-            glDisable(GL_CULL_FACE);
-            glDepthMask(GL_FALSE);
-
-            pbr->Bind();
-            pbr->SetUniform("LightCount", LightBufferCount);
-            pbr->SetUniform("FrameCount", FrameCount);
-            pbr->SetUniform("CameraPosition", camera->Position);
-            pbr->SetUniform("CameraInvViewProjection", camera->ViewProjectionInv);
-            pbr->SetUniform("RenderingScale", glm::vec2(1.0f, 1.0f));
-
-            // Be careful with the texture slots because some intel cards may only have valid slots from 0 to 7
-            pbr->SetTexture("GBufferDepth", 0, GBufferDepth->TargetTexture);
-            pbr->SetTexture("GBufferNormal", 1, GBufferNormal->TargetTexture);
-            pbr->SetTexture("GBufferAlbedoTransparency", 2, GBufferAlbedoTransparency->TargetTexture);
-            pbr->SetTexture("GBufferMetallnessRoughness", 3, GBufferMetalnessRoughness->TargetTexture);
-            pbr->SetTextureBuffer("LightBuffer", 4 ,LightBufferTexture);
-            pbr->SetTextureBuffer("MaterialBuffer", 5, scene->MaterialBufferTexture);
-            pbr->SetTextureArray("MaterialTextures", 6, scene->TextureArray);
-
-            IntermediateBuffer->Bind();
-            glBindVertexArray(FullscreenVAO);
-            glDrawArrays(GL_TRIANGLES, 0, 3);
-            glBindVertexArray(0);
-            IntermediateBuffer->Unbind();
+            UpdateAccumulationState(camera, bvh);
+            bool accumulate = UseProgressiveAccumulation && AccumulationShader->IsValid;
+            if(!accumulate || !IsAccumulationConverged()) {
+                DrawLighting(scene, camera, bvh);
+                if(IsTemporalReprojectionActive()) {
+                    DrawTemporalReprojection(camera);
+                }
+                if(IsDenoiserActive()) {
+                    Denoise(camera);
+                }
+                if(accumulate) {
+                    Accumulate();
+                } else if(IsTemporalAntiAliasingActive()) {
+                    ResolveTemporalAntiAliasing();
+                }
+            } else {
+                // The converged history is only tonemapped, with the state the lighting passes would have left.
+                glDepthFunc(GL_ALWAYS);
+                glDisable(GL_DEPTH_TEST);
+                glDisable(GL_CULL_FACE);
+                glDepthMask(GL_FALSE);
+            }
 
-            GlobalProfiler.StopGPUQuery(gpuComputeLighting);
+            bool taa = !accumulate && IsTemporalAntiAliasingActive();
+            if(!taa) {
+                TAAHistoryValid = false;
+            }
+            Texture* result = GetLightingResult();
+            if(accumulate) {
+                result = AccumulationBufferColor[AccumulationIndex]->TargetTexture;
+            } else if(taa) {
+                result = TAAHistory[TAAIndex]->TargetTexture;
+            }
 
             auto gpuTonemap = GlobalProfiler.StartGPUQuery("Tonemap");
             // Draw to main buffer.
             MainBuffer->Bind();
             PostProcessingShader->Bind();
-            PostProcessingShader->SetUniform("RenderingScale", glm::vec2(1, 1));
-            PostProcessingShader->SetUniform("RenderingScaleOld", glm::vec2(1, 1));
+            PostProcessingShader->SetUniform("RenderingScale", GetRenderingScale());
+            PostProcessingShader->SetUniform("RenderingScaleOld", GetRenderingScaleOld());
             PostProcessingShader->SetUniform("CameraExposure", camera->Exposure);
-            PostProcessingShader->SetTexture("IntermediateBuffer", 0, IntermediateBufferColor->TargetTexture);
+            PostProcessingShader->SetUniform("Sharpness", taa ? TAASharpness : 0.0f);
+            PostProcessingShader->SetTexture("IntermediateBuffer", 0, result);
             glBindVertexArray(FullscreenVAO);
             glDrawArrays(GL_TRIANGLES, 0, 3);
             glBindVertexArray(0);
             MainBuffer->Unbind();
             GlobalProfiler.StopGPUQuery(gpuTonemap);
         }
+        RenderingSizeOld = RenderingSize;
         ++FrameCount;
     }
 
+    // Draws the gbuffer and lights it into the intermediate buffer.
+    void DrawLighting(Scene* scene, Camera* camera, BVH* bvh) {
+        auto gpuGBuffer = GlobalProfiler.StartGPUQuery("GBuffer");
+        glm::vec2 scale = GetRenderingScale();
+        glEnable(GL_DEPTH_TEST);
+        glDepthFunc(GL_LESS);
+        glDepthMask(GL_TRUE);
+        glEnable(GL_CULL_FACE);
+        glCullFace(GL_FRONT);
+
+        // Draw GBuffer
+        GBuffer->Clear(true, true, true, 1.0f, glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+        GBuffer->Bind(scale.x, scale.y);
+
+        Clusters->Update(camera, RendererLights);
+        UpdateShadowCacheState(scene, camera, bvh);
+        GBufferShader->Bind();
+        GBufferShader->SetUniform("ViewProjection", camera->ViewProjection);
+        GBufferShader->SetUniform("ViewProjectionOld", camera->ViewProjectionOld);   
+        GBufferShader->SetUniform("Jitter", camera->Jitter);
+        GBufferShader->SetUniform("JitterOld", camera->JitterOld);
+        GBufferShader->SetTextureBuffer("MaterialBuffer", 0, scene->MaterialBufferTexture);
+        GBufferShader->SetTextureArray("MaterialTextures", 1, scene->TextureArray);
+
+        DrawNode(scene, scene->RootNode);
+        GBuffer->Unbind();
+
+        GlobalProfiler.StopGPUQuery(gpuGBuffer);
+
+        glDepthFunc(GL_ALWAYS);
+        glDisable(GL_DEPTH_TEST);
+        glDisable(GL_CULL_FACE);
+        glDepthMask(GL_FALSE);
+
+        if(IsLightResamplingActive()) {
+            DrawLightResampling(scene, camera, bvh);
+        }
+
+        // Compute Lighting covers every lighting path, the dynamic resolution reads it.
+        auto gpuComputeLighting = GlobalProfiler.StartGPUQuery("Compute Lighting");
+        if(ActiveLightingMode == LightingModeTiled && IsTiledValid()) {
+            DrawTiledLighting(scene, camera, bvh);
+        } else if(ActiveLightingMode == LightingModeWavefront && IsWavefrontValid()) {
+            DrawWavefrontLighting(scene, camera, bvh);
+        } else {
+            // Draw to lighting buffers.
+            Shader* pbr = PBRShader;
+            pbr->Bind();
+            SetLightingUniforms(pbr, scene, camera, bvh);
+
+            LightingBuffer[FrameCount & 1]->Bind(scale.x, scale.y);
+            glBindVertexArray(FullscreenVAO);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            glBindVertexArray(0);
+            LightingBuffer[FrameCount & 1]->Unbind();
+        }
+        // The wavefront resolve packs the secondary lighting of its own ray queues.
+        bool wavefront = ActiveLightingMode == LightingModeWavefront && IsWavefrontValid();
+        if(GetSecondaryRayMode() != SECONDARY_RAYS_FULL && !wavefront) {
+            DrawSecondaryRays(scene, camera, bvh);
+        }
+        GlobalProfiler.StopGPUQuery(gpuComputeLighting);
+
+        if(UseAdaptiveSampling) {
+            SampleVariance[FrameCount & 1]->TargetTexture->GenerateMipmap();
+        }
+        if(GetSecondaryRayMode() != SECONDARY_RAYS_FULL) {
+            UpsampleSecondaryLighting(camera);
+        }
+    }
+
+    // Binds everything that shaders/lighting.h and shaders/raytrace.h read.
+    void SetLightingUniforms(Shader* shader, Scene* scene, Camera* camera, BVH* bvh) {
+        shader->SetUniform("LightCount", LightBufferCount);
+        shader->SetUniform("FrameCount", FrameCount);
+        shader->SetUniform("CameraPosition", camera->Position);
+        shader->SetUniform("CameraInvViewProjection", camera->ViewProjectionInv);
+        glm::vec2 scale = GetRenderingScale();
+        shader->SetUniform("RenderingScale", scale);
+        shader->SetUniform("RenderingSize", RenderingSize);
+        shader->SetUniform("RenderingSizeOld", RenderingSizeOld);
+
+        // Be careful with the texture slots because some intel cards may only have valid slots from 0 to 7
+        shader->SetTexture("GBufferDepth", 0, GBufferDepth->TargetTexture);
+        shader->SetTexture("GBufferNormal", 1, GBufferNormal->TargetTexture);
+        shader->SetTexture("GBufferAlbedoTransparency", 2, GBufferAlbedoTransparency->TargetTexture);
+        shader->SetTexture("GBufferMetallnessRoughness", 3, GBufferMetalnessRoughness->TargetTexture);
+        shader->SetTextureBuffer("LightBuffer", 4 ,LightBufferTexture);
+        shader->SetTextureBuffer("MaterialBuffer", 5, scene->MaterialBufferTexture);
+        shader->SetTextureArray("MaterialTextures", 6, scene->TextureArray);
+        shader->SetTextureBuffer("BVHNodeBuffer", 7, bvh->NodeBufferTexture);
+        shader->SetTextureBuffer("BVHTriangleBuffer", 8, bvh->TriangleBufferTexture);
+        shader->SetTextureBuffer("BVHVertexBuffer", 9, bvh->VertexBufferTexture);
+        #if BVH_PRECOMPUTE_TRIANGLE_TRANSFORMS
+        shader->SetTextureBuffer("BVHTriangleTransformBuffer", 10, bvh->TriangleTransformBufferTexture);
+        #endif
+        shader->SetTexture("ShadowOccluderCache", 11, ShadowOccluderCache[(FrameCount + 1) & 1]->TargetTexture);
+        shader->SetUniform("ReuseShadowVisibility", (int32_t)ReuseShadowVisibility);
+        shader->SetTextureBuffer("LightClusterBuffer", 12, Clusters->DataBufferTexture);
+        shader->SetTextureBuffer("EmissiveTriangleBuffer", 13, bvh->EmissiveTriangleBufferTexture);
+        shader->SetUniform("EmissiveTriangleCount", (int)bvh->EmissiveTriangles.size());
+        shader->SetUniform("EmissiveSampleCount", EmissiveSampleCount);
+        shader->SetUniform("PathThroughputCutoff", PathThroughputCutoff);
+        shader->SetUniform("LightClusterViewProjection", Clusters->ViewProjection);
+        shader->SetUniform("LightClusterDepthScaleBias", Clusters->DepthScaleBias);
+        shader->SetTextureBuffer("LightTreeBuffer", 14, LightHierarchy->NodeBufferTexture);
+        shader->SetUniform("LightTreeNodeCount", LightHierarchy->NodeCount);
+        shader->SetUniform("LightTreeDirectionalCount", LightHierarchy->DirectionalCount);
+        shader->SetUniform("LightSampleCount", LightSampleCount);
+        shader->SetTexture("LightReservoirs", 15, LightReservoirs[1]->TargetTexture);
+        shader->SetUniform("UseLightReservoirs", (int32_t)IsLightResamplingActive());
+        shader->SetTexture("SampleVariance", 16, SampleVariance[(FrameCount + 1) & 1]->TargetTexture);
+        shader->SetUniform("UseAdaptiveSampling", (int32_t)UseAdaptiveSampling);
+        shader->SetUniform("AdaptiveSamplingThreshold", AdaptiveSamplingThreshold);
+        shader->SetUniform("AdaptiveSamplingBudget", AdaptiveSamplingBudget);
+        shader->SetUniform("AdaptiveSamplingCoverage", scale.x * scale.y);
+        shader->SetUniform("SecondaryRayMode", GetSecondaryRayMode());
+    }
+
+    void DrawLightResampling(Scene* scene, Camera* camera, BVH* bvh) {
+        auto gpuResampling = GlobalProfiler.StartGPUQuery("Light Resampling");
+        glm::vec2 scale = GetRenderingScale();
+        glBindVertexArray(FullscreenVAO);
+
+        // Initial candidates and temporal reuse.
+        LightResamplingInitialShader->Bind();
+        SetLightingUniforms(LightResamplingInitialShader, scene, camera, bvh);
+        // The resampling traces no rays, the motion vectors use the slot of the BVH nodes.
+        LightResamplingInitialShader->SetTexture("GBufferMotion", 7, GBufferMotion->TargetTexture);
+        LightReservoirTargets[0]->Bind(scale.x, scale.y);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        LightReservoirTargets[0]->Unbind();
+
+        // Spatial reuse into the final reservoirs.
+        LightResamplingSpatialShader->Bind();
+        SetLightingUniforms(LightResamplingSpatialShader, scene, camera, bvh);
+        LightResamplingSpatialShader->SetTexture("LightReservoirs", 15, LightReservoirs[0]->TargetTexture);
+        LightReservoirTargets[1]->Bind(scale.x, scale.y);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        LightReservoirTargets[1]->Unbind();
+
+        glBindVertexArray(0);
+        GlobalProfiler.StopGPUQuery(gpuResampling);
+    }
+
+    bool IsTiledValid() {
+        if(!ComputeSupported || !TileClassifyShader->IsValid) {
+            return false;
+        }
+        for (int i = 0; i < LIGHTING_TILE_CLASS_COUNT; ++i) {
+            if(!TileLightingShaders[i]->IsValid) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void DrawTiledLighting(Scene* scene, Camera* camera, BVH* bvh) {
+        static const char* classQueryNames[LIGHTING_TILE_CLASS_COUNT] = {"Lighting Background Tiles", "Lighting Diffuse Tiles", "Lighting Glossy Tiles", "Lighting Transparent Tiles"};
+
+        Texture* target = IntermediateBufferColor->TargetTexture;
+        glm::ivec2 size = RenderingSize;
+        glm::ivec2 tiles = (size + glm::ivec2(LIGHTING_TILE_SIZE - 1)) / LIGHTING_TILE_SIZE;
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, TileDispatchBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, TileListBuffer);
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, TileDispatchBuffer);
+
+        auto gpuClassify = GlobalProfiler.StartGPUQuery("Tile Classification");
+        RendererTileDispatch dispatches[LIGHTING_TILE_CLASS_COUNT];
+        for (int i = 0; i < LIGHTING_TILE_CLASS_COUNT; ++i) {
+            dispatches[i].GroupCountX = 0;
+            dispatches[i].GroupCountY = 1;
+            dispatches[i].GroupCountZ = 1;
+        }
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, TileDispatchBuffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(dispatches), dispatches);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+        TileClassifyShader->Bind();
+        SetLightingUniforms(TileClassifyShader, scene, camera, bvh);
+        TileClassifyShader->SetUniform("RenderingSize", size);
+        TileClassifyShader->SetUniform("TileListCapacity", TileListCapacity);
+        glDispatchCompute(tiles.x, tiles.y, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+        GlobalProfiler.StopGPUQuery(gpuClassify);
+
+        // Every class only pays for the tiles that are on screen.
+        glBindImageTexture(0, target->OpenGLBuffer, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+        glBindImageTexture(1, ShadowOccluderCache[FrameCount & 1]->TargetTexture->OpenGLBuffer, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32I);
+        glBindImageTexture(2, SampleVariance[FrameCount & 1]->TargetTexture->OpenGLBuffer, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+        for (int i = 0; i < LIGHTING_TILE_CLASS_COUNT; ++i) {
+            auto gpuClass = GlobalProfiler.StartGPUQuery(classQueryNames[i]);
+            Shader* shader = TileLightingShaders[i];
+            shader->Bind();
+            SetLightingUniforms(shader, scene, camera, bvh);
+            shader->SetUniform("RenderingSize", size);
+            shader->SetUniform("TileListCapacity", TileListCapacity);
+            glDispatchComputeIndirect(i * sizeof(RendererTileDispatch));
+            GlobalProfiler.StopGPUQuery(gpuClass);
+        }
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT);
+        glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+        glBindImageTexture(1, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32I);
+        glBindImageTexture(2, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+    }
+
+    bool IsWavefrontValid() {
+        return ComputeSupported && WavefrontGenerateShader->IsValid && WavefrontBinShader->IsValid && WavefrontScatterShader->IsValid &&
+               WavefrontExtendShader->IsValid && WavefrontShadeShader->IsValid && WavefrontResolveShader->IsValid;
+    }
+
+    // Sorts the emitted rays by bin into the sorted queue, which is then dispatched indirectly.
+    void SortWavefrontRays() {
+        WavefrontBinShader->Bind();
+        glDispatchCompute(1, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+
+        WavefrontScatterShader->Bind();
+        glDispatchComputeIndirect(offsetof(RendererWavefrontCounters, DispatchSize));
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+    void DrawWavefrontLighting(Scene* scene, Camera* camera, BVH* bvh) {
+        Texture* target = IntermediateBufferColor->TargetTexture;
+        glm::ivec2 size = RenderingSize;
+        glm::ivec2 groups = (size + glm::ivec2(7)) / 8;
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, WavefrontCounterBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, WavefrontEmittedRayBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, WavefrontSortedRayBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, WavefrontRadianceBuffer);
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, WavefrontCounterBuffer);
+
+        // Direct lighting of the gbuffer and the first reflection and refraction rays.
+        auto gpuGenerate = GlobalProfiler.StartGPUQuery("Wavefront Generate");
+        RendererWavefrontCounters counters = {};
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, WavefrontCounterBuffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(RendererWavefrontCounters), &counters);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+        WavefrontGenerateShader->Bind();
+        SetLightingUniforms(WavefrontGenerateShader, scene, camera, bvh);
+        WavefrontGenerateShader->SetUniform("RenderingSize", size);
+        glBindImageTexture(1, ShadowOccluderCache[FrameCount & 1]->TargetTexture->OpenGLBuffer, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32I);
+        glDispatchCompute(groups.x, groups.y, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        GlobalProfiler.StopGPUQuery(gpuGenerate);
+
+        // Traverse rays binned by direction, then shade hits binned by material.
+        for (int i = 0; i < RENDERING_MAX_RECURSIONS; ++i) {
+            auto gpuBounce = GlobalProfiler.StartGPUQuery(WavefrontBounceQueryNames[i]);
+            SortWavefrontRays();
+            WavefrontExtendShader->Bind();
+            SetLightingUniforms(WavefrontExtendShader, scene, camera, bvh);
+            glDispatchComputeIndirect(offsetof(RendererWavefrontCounters, DispatchSize));
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+            SortWavefrontRays();
+            WavefrontShadeShader->Bind();
+            SetLightingUniforms(WavefrontShadeShader, scene, camera, bvh);
+            WavefrontShadeShader->SetUniform("RenderingSize", size);
+            glDispatchComputeIndirect(offsetof(RendererWavefrontCounters, DispatchSize));
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+            GlobalProfiler.StopGPUQuery(gpuBounce);
+        }
+
+        auto gpuResolve = GlobalProfiler.StartGPUQuery("Wavefront Resolve");
+        WavefrontResolveShader->Bind();
+        WavefrontResolveShader->SetUniform("RenderingSize", size);
+        WavefrontResolveShader->SetUniform("SecondaryRayMode", GetSecondaryRayMode());
+        WavefrontResolveShader->SetUniform("FrameCount", FrameCount);
+        WavefrontResolveShader->SetTexture("SampleVariance", 0, SampleVariance[(FrameCount + 1) & 1]->TargetTexture);
+        WavefrontResolveShader->SetUniform("AdaptiveSamplingThreshold", AdaptiveSamplingThreshold);
+        glBindImageTexture(0, target->OpenGLBuffer, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+        glBindImageTexture(1, SampleVariance[FrameCount & 1]->TargetTexture->OpenGLBuffer, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+        glBindImageTexture(2, SecondaryLighting->TargetTexture->OpenGLBuffer, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+        glDispatchCompute(groups.x, groups.y, 1);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT);
+        glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+        glBindImageTexture(1, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+        glBindImageTexture(2, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+        GlobalProfiler.StopGPUQuery(gpuResolve);
+    }
+
     void UpdateLights(Scene* scene) {
-        if(LightBufferCount < scene->Lights.size()) {
-            LightBufferCount = (int)scene->Lights.size();
+        bool changed = RendererLights.size() != scene->Lights.size();
+        RendererLights.resize(scene->Lights.size());
+        for (size_t i = 0; i < scene->Lights.size(); ++i) {
+            RendererLight light = GetRendererLight(scene->Lights[i]);
+            if(changed || memcmp(&light, &RendererLights[i], sizeof(RendererLight)) != 0) {
+                RendererLights[i] = light;
+                changed = true;
+            }
+        }
+        LightBufferCount = (int)RendererLights.size();
+        if(!changed && LightBuffer) {
+            return;
+        }
+
+        if(LightBufferCapacity < LightBufferCount || !LightBuffer) {
+            LightBufferCapacity = glm::max(LightBufferCount, 1);
             if(LightBuffer) {
                 glDeleteBuffers(1, &LightBuffer);
                 glDeleteTextures(1, &LightBufferTexture);
             }
             glGenBuffers(1, &LightBuffer);
             glBindBuffer(GL_TEXTURE_BUFFER, LightBuffer);
-            glBufferData(GL_TEXTURE_BUFFER, sizeof(RendererLight) * LightBufferCount, 0, GL_DYNAMIC_DRAW);
+            glBufferData(GL_TEXTURE_BUFFER, sizeof(RendererLight) * LightBufferCapacity, 0, GL_DYNAMIC_DRAW);
             glBindBuffer(GL_TEXTURE_BUFFER, 0);
 
             glGenTextures(1, &LightBufferTexture);
             glBindTexture(GL_TEXTURE_BUFFER, LightBufferTexture);
-            glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, LightBuffer);
+            glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32UI, LightBuffer);
             glBindTexture(GL_TEXTURE_BUFFER, 0);
         }
 
-        glBindBuffer(GL_TEXTURE_BUFFER, LightBuffer);
-        RendererLight* mappedLightBuffer = (RendererLight*)glMapBuffer(GL_TEXTURE_BUFFER, GL_WRITE_ONLY);
-        for(int i = 0; i < LightBufferCount; ++i) {
-            Light* light = scene->Lights[i];
-            Node* parentNode = light->ParentNode;
-            if(parentNode) {
-                mappedLightBuffer->Position = parentNode->Position;
-                glm::quat rot = parentNode->Rotation;
-                mappedLightBuffer->Direction = -glm::vec3(2.0f * (rot.x * rot.z + rot.w * rot.y), 2.0f * (rot.y * rot.z - rot.w * rot.x), 1.0f - 2.0f * (rot.x * rot.x + rot.y * rot.y));
-            }
-            mappedLightBuffer->Range = light->Range;
-            mappedLightBuffer->Type = light->Type;
-            mappedLightBuffer->Color = light->Color;
-            mappedLightBuffer->Intensity = light->Intensity;
-            mappedLightBuffer->Radius = light->Radius;
-            mappedLightBuffer->AngleScale = 1.0f / glm::max(0.001f, glm::cos(light->InnerAngle) - glm::cos(light->OuterAngle));
-            mappedLightBuffer->AngleOffset = -glm::cos(light->OuterAngle) * mappedLightBuffer->AngleScale;
-
-            ++mappedLightBuffer;
+        if(LightBufferCount > 0) {
+            glBindBuffer(GL_TEXTURE_BUFFER, LightBuffer);
+            glBufferSubData(GL_TEXTURE_BUFFER, 0, sizeof(RendererLight) * LightBufferCount, RendererLights.data());
+            glBindBuffer(GL_TEXTURE_BUFFER, 0);
         }
-        glUnmapBuffer(GL_TEXTURE_BUFFER);
-        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        LightHierarchy->Build(RendererLights);
     }
 
     void Display() {
-        BlitRenderTarget(MainBuffer, 0, true);
+        if(RenderingSize == GetTargetSize()) {
+            BlitRenderTarget(MainBuffer, 0, true);
+            return;
+        }
+        // The depth the debug drawing tests against only covers the rendered part, it is stretched over the window.
+        BlitRenderTarget(MainBuffer, 0);
+        glm::ivec2 size = glm::min(GetTargetSize(), glm::ivec2(GLOBAL.ScreenWidth, GLOBAL.ScreenHeight));
+        glBlitFramebuffer(0, 0, RenderingSize.x, RenderingSize.y, 0, 0, size.x, size.y, GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT, GL_NEAREST);
     }
 };
\ No newline at end of file
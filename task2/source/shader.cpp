@@ -70,7 +70,11 @@ struct SubShader
 		);
 
 		if (Type == GL_COMPUTE_SHADER) {
-			Code.push_back("#extension GL_ARB_compute_shader         : require\n");
+			Code.push_back("#extension GL_ARB_compute_shader                : require\n"
+						   "#extension GL_ARB_shader_storage_buffer_object : require\n"
+						   "#extension GL_ARB_shader_image_load_store      : require\n"
+						   "#extension GL_ARB_shading_language_420pack     : require\n"
+			);
 		}
 		#ifndef __APPLE__
 			Code.push_back("#extension GL_ARB_shading_language_packing : require\n");
@@ -345,6 +349,15 @@ struct Shader {
 		glUniform2fv(location, 1, &value[0]);
 	}
 
+	void
+	SetUniform(const char* uniformName, glm::ivec2 value) {
+		uint32_t location = GetUniformLocation(uniformName);
+		if(location == INVALID_LOCATION) {
+			return;
+		}
+		glUniform2iv(location, 1, &value[0]);
+	}
+
 	void
 	SetUniform(const char* uniformName, glm::vec3 value) {
 		uint32_t location = GetUniformLocation(uniformName);